@@ -142,7 +142,18 @@ struct world_api {
     char *(*format_noun)(char *buf, size_t len, const char *name,
                          size_t count, bool default_article, bool capitalize);
 
-
+    /* newer additions go at the end, so modules built against an
+     * older header still find everything above where they expect */
+    void   (*room_set_desc)(room_id room, const char *desc); // copies desc
+
+    size_t (*send_msg_room)(room_id room, user_t *except, const char *fmt, ...) __attribute__((format(printf,3,4)));
+    size_t (*send_msg_user)(const char *user, const char *fmt, ...) __attribute__((format(printf,2,3)));
+    bool (*send_msg_pid)(pid_t pid, const char *fmt, ...) __attribute__((format(printf,2,3)));
+    void (*send_msg_set)(user_t **children, size_t n, const char *fmt, ...) __attribute__((format(printf,3,4)));
+
+    /* hold this while using what userdb_lookup() returns */
+    void (*userdb_lock)(void);
+    void (*userdb_unlock)(void);
 };
 
 /* defined in src/world_api.c  */
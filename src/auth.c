@@ -175,56 +175,248 @@ void first_run_setup(void)
     free(admin_pass);
 }
 
-struct userdata_t *auth_check(const char *name2, const char *pass2)
+/* hashes pass with the user's salt, and compares the result with the
+ * stored hash; touches nothing else, so any thread can call it */
+static bool auth_verify(const struct userdata_t *data, const char *pass2)
 {
-    if(!are_child)
-        debugf("WARNING: auth_check called from master!\n");
+    char *pass = strdup(pass2);
+    remove_cruft(pass);
+
+    /* hashes are in lowercase hex to avoid the Trucha bug
+     * but still allow comparison with strcmp() */
+    char *new_hash_hex = hash_pass_hex(pass, data->salt);
+
+    bool success = true;
+    /* constant-time comparison to hopefully prevent a timing attack */
+    for(int i = 0; i < AUTH_HASHLEN; ++i)
+    {
+        if(new_hash_hex[i] != data->passhash[i])
+            success = false;
+    }
+
+    free(new_hash_hex);
+
+    memset(pass, 0, strlen(pass));
+    free(pass);
 
+    return success;
+}
+
+static struct userdata_t *auth_lookup(const char *name2)
+{
     /* get our own copy to remove newlines */
     char *name = strdup(name2);
-    char *pass = strdup(pass2);
     remove_cruft(name);
-    remove_cruft(pass);
 
     /* request data from the master process */
     struct userdata_t *data = userdb_request_lookup(name);
 
     free(name);
+    return data;
+}
 
-    char *salt = data->salt, *hash = data->passhash;
+struct userdata_t *auth_check(const char *name2, const char *pass2)
+{
+    struct userdata_t *data = auth_lookup(name2);
 
-    if(data)
+    if(data && auth_verify(data, pass2))
+        return data;
+
+    debugf("Authentication failure for user %s\n", name2);
+
+    /* failure: the caller is responsible for delaying, as this may
+     * be the master */
+    return NULL;
+}
+
+/*** checks off the event loop ***/
+
+struct auth_job {
+    struct userdata_t data;
+    bool found, ok;
+    char *pass;
+    char name[MAX_NAME_LEN + 1];
+
+    /* NULL once cancelled */
+    void (*cb)(void *arg, struct userdata_t *data);
+    void *arg;
+
+    struct auth_job *next;
+};
+
+/* protects everything below but the watcher */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_wake = PTHREAD_COND_INITIALIZER;
+static struct auth_job *todo_head = NULL, *todo_tail = NULL, *done = NULL;
+static bool running = false, stopping = false;
+
+static pthread_t auth_thread;
+static ev_async done_watcher;
+static struct ev_loop *main_loop = NULL;
+
+static void free_job(struct auth_job *job)
+{
+    memset(job->pass, 0, strlen(job->pass));
+    free(job->pass);
+    free(job);
+}
+
+static void *auth_main(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&job_lock);
+    while(1)
+    {
+        while(!todo_head && !stopping)
+            pthread_cond_wait(&job_wake, &job_lock);
+        if(stopping)
+            break;
+
+        struct auth_job *job = todo_head;
+        todo_head = job->next;
+        if(!todo_head)
+            todo_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        job->ok = job->found && auth_verify(&job->data, job->pass);
+
+        pthread_mutex_lock(&job_lock);
+        job->next = done;
+        done = job;
+        ev_async_send(main_loop, &done_watcher);
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    return NULL;
+}
+
+static void done_cb(EV_P_ ev_async *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    pthread_mutex_lock(&job_lock);
+    struct auth_job *job = done;
+    done = NULL;
+    pthread_mutex_unlock(&job_lock);
+
+    while(job)
     {
-        /* hashes are in lowercase hex to avoid the Trucha bug
-         * but still allow comparison with strcmp() */
-        char *new_hash_hex = hash_pass_hex(pass, salt);
+        struct auth_job *next = job->next;
 
-        bool success = true;
-        /* constant-time comparison to hopefully prevent a timing attack */
-        for(int i = 0; i < AUTH_HASHLEN; ++i)
+        /* cancelling happens on this thread too, so cb can't go away
+         * from under us now */
+        if(job->cb)
         {
-            if(new_hash_hex[i] != hash[i])
-                success = false;
+            if(!job->ok)
+                debugf("Authentication failure for user %s\n", job->name);
+            job->cb(job->arg, job->ok ? &job->data : NULL);
         }
+        free_job(job);
 
-        free(new_hash_hex);
+        job = next;
+    }
+}
 
-        if(success)
-        {
-            memset(pass, 0, strlen(pass));
-            free(pass);
+static void auth_start(void)
+{
+    main_loop = EV_DEFAULT;
+    ev_async_init(&done_watcher, done_cb);
+    ev_async_start(main_loop, &done_watcher);
+    /* it mustn't keep the loop running by itself */
+    ev_unref(main_loop);
 
-            return data;
-        }
+    /* signals are the main thread's business */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    if(pthread_create(&auth_thread, NULL, auth_main, NULL))
+        error("pthread_create");
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    running = true;
+}
+
+struct auth_job *auth_check_async(const char *name, const char *pass,
+                                  void (*cb)(void *arg, struct userdata_t *data),
+                                  void *arg)
+{
+    if(!running)
+        auth_start();
+
+    struct auth_job *job = calloc(1, sizeof(*job));
+
+    /* the lookup's quick, and may need the master */
+    struct userdata_t *data = auth_lookup(name);
+    if(data)
+    {
+        job->data = *data;
+        job->found = true;
     }
+    strncpy(job->name, name, sizeof(job->name) - 1);
+    job->pass = strdup(pass);
+    job->cb = cb;
+    job->arg = arg;
+
+    pthread_mutex_lock(&job_lock);
+    if(todo_tail)
+        todo_tail->next = job;
+    else
+        todo_head = job;
+    todo_tail = job;
+    pthread_cond_signal(&job_wake);
+    pthread_mutex_unlock(&job_lock);
 
-    debugf("Authentication failure for user %s\n", name2);
+    return job;
+}
 
-    memset(pass, 0, strlen(pass));
-    free(pass);
+void auth_cancel(struct auth_job *job)
+{
+    if(job)
+        job->cb = NULL;
+}
 
-    /* failure: note that this function should be run exclusively by
-     * child processes */
-    sleep(2);
-    return NULL;
+void auth_forked(void)
+{
+    /* the thread didn't come along, and the jobs were the parent's */
+    pthread_mutex_init(&job_lock, NULL);
+    pthread_cond_init(&job_wake, NULL);
+    todo_head = todo_tail = done = NULL;
+    running = false;
+}
+
+void auth_shutdown(void)
+{
+    if(!running)
+        return;
+
+    pthread_mutex_lock(&job_lock);
+    stopping = true;
+    pthread_cond_signal(&job_wake);
+    pthread_mutex_unlock(&job_lock);
+
+    pthread_join(auth_thread, NULL);
+
+    ev_ref(main_loop);
+    ev_async_stop(main_loop, &done_watcher);
+
+    while(todo_head)
+    {
+        struct auth_job *job = todo_head;
+        todo_head = job->next;
+        free_job(job);
+    }
+    while(done)
+    {
+        struct auth_job *job = done;
+        done = job->next;
+        free_job(job);
+    }
+    todo_tail = NULL;
+
+    running = stopping = false;
 }
@@ -34,5 +34,18 @@ struct userdata_t;
 /* NULL on failure, user data struct on success */
 struct userdata_t *auth_check(const char *user, const char *pass);
 
+/* auth_check() for processes serving many clients from one loop: the
+ * hashing is done on a thread of its own, and cb is called back on
+ * the loop with the result. The job can be cancelled until then. */
+struct auth_job;
+struct auth_job *auth_check_async(const char *user, const char *pass,
+                                  void (*cb)(void *arg, struct userdata_t *data),
+                                  void *arg);
+void auth_cancel(struct auth_job *job);
+
+/* call in a new child, before any of the above */
+void auth_forked(void);
+void auth_shutdown(void);
+
 bool auth_user_add(const char *user, const char *pass, int authlevel);
 bool auth_user_del(const char *user);
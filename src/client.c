@@ -25,645 +25,2400 @@
 #include "server.h"
 #include "room.h"
 #include "telnet.h"
+#include "tls.h"
 #include "userdb.h"
 #include "util.h"
 
-bool are_admin = false;
+struct client_session *session = NULL;
 
-int client_fd, to_parent, from_parent;
+/* the forked modes only ever serve one client per process */
+static struct client_session child_session;
 
-static room_id current_room = 0;
+/* event and mux modes: sessions waiting to be reaped */
+static struct client_session *closed_sessions = NULL;
 
-static volatile sig_atomic_t output_locked = 0;
+/* mux mode: a worker's sessions by ID, and its pipes to the master */
+static void *mux_sessions = NULL;
+static int worker_to_parent = -1, worker_from_parent = -1;
+static int worker_ctlsock = -1;
+static struct ipc_shm *worker_shm = NULL;
 
-char *current_user = NULL;
+/* whether this process serves its sessions from an event loop; the
+ * master always does, if only to log them in */
+static bool multiplexed(void)
+{
+    return !are_child || server_mode == MODE_MUX;
+}
+
+/* forked and mux modes: the master only logs clients in, and leaves
+ * the rest to whatever it hands them to, see client_next_authed() */
+static bool login_only(void)
+{
+    return !are_child && server_mode != MODE_EVENT;
+}
+
+/* sessions the master's logged in, waiting to be handed on */
+static struct client_session *authed_sessions = NULL;
+
+/* sessions which might have output held, see out_raw() */
+static struct client_session *dirty_sessions = NULL;
+
+/* event and mux modes: flushes everything before the loop blocks */
+static ev_prepare flush_watcher;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t client_queue_drop = DEFAULT_QUEUE_DROP;
+size_t client_queue_max = DEFAULT_QUEUE_MAX;
+
+/* output the socket hasn't taken yet, in flight or not */
+static size_t queued(struct client_session *sess)
+{
+    return sess->qlen + sess->send_len;
+}
+
+bool client_congested(void)
+{
+    return queued(session) > client_queue_drop;
+}
+
+/* tells the master how much is queued, when that changes by a KB or
+ * so; CLIENT LIST shows it */
+static void report_queue(struct client_session *sess)
+{
+    size_t depth = queued(sess);
+    size_t bucket = depth ? depth / 1024 + 1 : 0;
+    if(sess->closing || bucket == sess->q_reported)
+        return;
+    sess->q_reported = bucket;
+
+    struct client_session *old = session;
+    session = sess;
+    client_report_queue(depth);
+    session = old;
+}
+
+/* writev() and read() on a session's socket, or its TLS stream */
+static ssize_t sess_writev(struct client_session *sess, const struct iovec *iov, int n)
+{
+    return sess->ssl ? tls_writev(sess->ssl, iov, n) : writev(sess->fd, iov, n);
+}
+
+/*** io_uring ***/
+
+/* sessions freed while they had requests in flight, see client_free() */
+static struct client_session *freeing_sessions = NULL;
+
+static void client_free_done(struct client_session *sess);
+
+/* past this much stashed input, reading stops until it's been taken */
+#define CLIENT_STASH_MAX (4 * CLIENT_IN_SZ)
+
+static void uring_recv_start(struct client_session *sess)
+{
+    if(!uring_recv(&sess->recv_op, sess->fd))
+        sess->stash_eof = true;
+}
+
+/* sends what's queued, unless a send's already in flight; the queue
+ * and the send buffer swap places, so output can be queued meanwhile
+ * without moving what the kernel is reading */
+static void uring_send_queue(struct client_session *sess)
+{
+    if(sess->send_op.pending || !sess->qlen)
+        return;
+
+    char *buf = sess->sending;
+    size_t size = sess->send_size;
+
+    sess->sending = sess->queue;
+    sess->send_size = sess->qsize;
+    sess->send_off = sess->qoff;
+    sess->send_len = sess->qlen;
+
+    sess->queue = buf;
+    sess->qsize = size;
+    sess->qoff = sess->qlen = 0;
+
+    if(!uring_send(&sess->send_op, sess->fd, sess->sending + sess->send_off, sess->send_len))
+        sess->send_len = 0;
+}
+
+static void queue_caught_up(struct client_session *sess);
+static void report_queue(struct client_session *sess);
+
+static void uring_send_cb(struct uring_op *op, int res, unsigned flags, const void *buf)
+{
+    (void) flags;
+    (void) buf;
+
+    struct client_session *sess = op->data;
+
+    if(res > 0)
+    {
+        sess->send_off += res;
+        sess->send_len -= res;
+        if(sess->send_len &&
+           !uring_send(op, sess->fd, sess->sending + sess->send_off, sess->send_len))
+            sess->send_len = 0;
+    }
+    else
+    {
+        /* the client's gone, which the read side will notice */
+        sess->send_len = 0;
+        sess->qlen = 0;
+    }
+
+    if(!sess->send_len)
+    {
+        sess->send_off = 0;
+        uring_send_queue(sess);
+    }
+
+    if(sess->freeing)
+    {
+        if(!sess->recv_op.pending && !sess->send_op.pending)
+            client_free_done(sess);
+        return;
+    }
+
+    if(!queued(sess))
+        queue_caught_up(sess);
+
+    report_queue(sess);
+}
+
+static void uring_recv_cb(struct uring_op *op, int res, unsigned flags, const void *buf)
+{
+    struct client_session *sess = op->data;
+
+    if(res > 0)
+    {
+        if(sess->stash_off + sess->stash_len + res > sess->stash_size)
+        {
+            memmove(sess->stash, sess->stash + sess->stash_off, sess->stash_len);
+            sess->stash_off = 0;
+
+            if(sess->stash_len + res > sess->stash_size)
+            {
+                sess->stash_size = MAX(sess->stash_size * 2, sess->stash_len + res);
+                sess->stash = realloc(sess->stash, sess->stash_size);
+            }
+        }
+        memcpy(sess->stash + sess->stash_off + sess->stash_len, buf, res);
+        sess->stash_len += res;
+
+        /* it's sending faster than it's being served */
+        if(sess->stash_len >= CLIENT_STASH_MAX)
+            uring_cancel(op);
+    }
+    /* out of buffers for now, or cancelled by us: not the client's doing */
+    else if(res != -ENOBUFS && res != -ECANCELED)
+        sess->stash_eof = true;
+
+    if(sess->freeing)
+    {
+        if(!sess->recv_op.pending && !sess->send_op.pending)
+            client_free_done(sess);
+        return;
+    }
+
+    if(!uring_more(flags) && !sess->stash_eof && !sess->detaching &&
+       sess->stash_len < CLIENT_STASH_MAX)
+        uring_recv_start(sess);
+
+    if(sess->reading && !sess->closing)
+        ev_feed_event(EV_DEFAULT_ &sess->io_watcher, EV_READ);
+}
+
+/* read() from what's been received */
+static ssize_t stash_read(struct client_session *sess, void *buf, size_t len)
+{
+    if(!sess->stash_len)
+    {
+        if(sess->stash_eof)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    len = MIN(len, sess->stash_len);
+    memcpy(buf, sess->stash + sess->stash_off, len);
+    sess->stash_off += len;
+    sess->stash_len -= len;
+    if(!sess->stash_len)
+        sess->stash_off = 0;
+
+    /* reading stopped while it was full */
+    if(!sess->recv_op.pending && !sess->stash_eof && !sess->detaching &&
+       sess->stash_len < CLIENT_STASH_MAX)
+        uring_recv_start(sess);
+
+    return len;
+}
+
+static ssize_t sess_read(struct client_session *sess, void *buf, size_t len)
+{
+    if(sess->uring)
+        return stash_read(sess, buf, len);
+    return sess->ssl ? tls_read(sess->ssl, buf, len) : read(sess->fd, buf, len);
+}
+
+/* event and mux modes: whether a session's input is read, which with
+ * io_uring only decides whether what's received is passed on */
+static void client_input_start(struct client_session *sess)
+{
+    if(sess->uring)
+        sess->reading = true;
+    else
+        ev_io_start(EV_DEFAULT_ &sess->io_watcher);
+}
+
+static void client_input_stop(struct client_session *sess)
+{
+    if(sess->uring)
+        sess->reading = false;
+    else
+        ev_io_stop(EV_DEFAULT_ &sess->io_watcher);
+}
+
+static bool client_input_active(struct client_session *sess)
+{
+    return sess->uring ? sess->reading : ev_is_active(&sess->io_watcher);
+}
+
+/* the socket's taken everything, so own up to what it missed */
+static void queue_caught_up(struct client_session *sess)
+{
+    if(sess->dropped && !sess->closing)
+    {
+        struct client_session *old = session;
+        session = sess;
+        out("[%u messages dropped]\n", sess->dropped);
+        sess->dropped = 0;
+        session = old;
+    }
+}
+
+/* writes as much of the queue as the socket will take */
+static void drain_queue(struct client_session *sess)
+{
+    while(sess->qlen)
+    {
+        struct iovec iov = { sess->queue + sess->qoff, sess->qlen };
+        ssize_t ret = sess_writev(sess, &iov, 1);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN)
+                sess->qlen = 0;
+            break;
+        }
+        sess->qoff += ret;
+        sess->qlen -= ret;
+    }
+
+    if(!sess->qlen)
+    {
+        sess->qoff = 0;
+        if(multiplexed())
+            ev_io_stop(EV_DEFAULT_ &sess->out_watcher);
+
+        queue_caught_up(sess);
+    }
+
+    report_queue(sess);
+}
+
+void client_drain(void)
+{
+    drain_queue(session);
+}
+
+static void enqueue(struct client_session *sess, const void *buf, size_t len)
+{
+    if(queued(sess) + len > client_queue_max)
+    {
+        /* it's not reading, so stop writing: the read side sees the
+         * shutdown and disconnects it as usual */
+        debugf("client %s: over %zu bytes of output queued, disconnecting\n",
+               inet_ntoa(sess->addr), client_queue_max);
+        sess->slow = true;
+        sess->qlen = 0;
+        shutdown(sess->fd, SHUT_RDWR);
+        return;
+    }
+
+    if(sess->qoff + sess->qlen + len > sess->qsize)
+    {
+        memmove(sess->queue, sess->queue + sess->qoff, sess->qlen);
+        sess->qoff = 0;
+
+        if(sess->qlen + len > sess->qsize)
+        {
+            sess->qsize = MAX(sess->qsize * 2, MAX(sess->qlen + len, CLIENT_OUT_SZ));
+            sess->queue = realloc(sess->queue, sess->qsize);
+        }
+    }
+
+    if(!sess->qlen && multiplexed() && !sess->uring)
+        ev_io_start(EV_DEFAULT_ &sess->out_watcher);
+
+    memcpy(sess->queue + sess->qoff + sess->qlen, buf, len);
+    sess->qlen += len;
+}
+
+/* writes n buffers to a session's socket without blocking, queueing
+ * whatever it won't take */
+static void write_iov(struct client_session *sess, struct iovec *iter, int n)
+{
+    if(sess->slow)
+        return;
+
+    /* anything already queued has to go first; io_uring sends
+     * everything from the queue */
+    while(n && !sess->qlen && !sess->uring)
+    {
+        ssize_t ret = sess_writev(sess, iter, n);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                break;
+            /* the client's gone, which the read side will notice */
+            return;
+        }
+
+        while(n && (size_t)ret >= iter->iov_len)
+        {
+            ret -= iter->iov_len;
+            ++iter;
+            --n;
+        }
+        if(n)
+        {
+            iter->iov_base = (char*)iter->iov_base + ret;
+            iter->iov_len -= ret;
+        }
+    }
+
+    for(; n; ++iter, --n)
+        enqueue(sess, iter->iov_base, iter->iov_len);
+
+    if(sess->uring)
+        uring_send_queue(sess);
+
+    report_queue(sess);
+}
+
+/* forked modes: gives queued output a little while to go out before
+ * the process exits */
+static void drain_before_exit(struct client_session *sess)
+{
+    uint64_t deadline = now_ms() + CLIENT_CLOSE_TIMEOUT;
+    struct pollfd pfd = { sess->fd, POLLOUT, 0 };
+
+    while(sess->qlen && !sess->slow)
+    {
+        uint64_t now = now_ms();
+        if(now >= deadline || poll(&pfd, 1, deadline - now) <= 0)
+            break;
+        drain_queue(sess);
+    }
+}
+
+/* runs n buffers through a session's deflate stream and writes out the
+ * result, ending with a flush of the given kind */
+static void compress_iov(struct client_session *sess, const struct iovec *iov, int n, int flush)
+{
+    static unsigned char zbuf[CLIENT_OUT_SZ];
+    z_stream *z = sess->zstream;
+
+    for(int i = 0; i < n; ++i)
+    {
+        z->next_in = iov[i].iov_base;
+        z->avail_in = iov[i].iov_len;
+        sess->z_in += iov[i].iov_len;
+
+        int mode = i == n - 1 ? flush : Z_NO_FLUSH;
+        do {
+            z->next_out = zbuf;
+            z->avail_out = sizeof(zbuf);
+
+            uint64_t start = cpu_ns();
+            deflate(z, mode);
+            sess->z_cpu += cpu_ns() - start;
+
+            struct iovec out = { zbuf, sizeof(zbuf) - z->avail_out };
+            sess->z_out += out.iov_len;
+            write_iov(sess, &out, 1);
+        } while(!z->avail_out);
+    }
+}
+
+/* writes a session's held output followed by len bytes of buf, all in
+ * one syscall unless the socket is backed up */
+static void flush_session(struct client_session *sess, const void *buf, size_t len)
+{
+    struct iovec iov[2] = {
+        { sess->outbuf,     sess->outlen },
+        { (void*)buf,       len          },
+    };
+    int n = buf ? 2 : 1;
+
+    if(sess->zstream)
+        compress_iov(sess, iov, n, Z_SYNC_FLUSH);
+    else
+        write_iov(sess, iov, n);
+
+    sess->outlen = 0;
+}
+
+/* small window and memory levels: ~64K a session instead of ~256K, and
+ * MUD text compresses well enough with them */
+#define MCCP_WINDOW_BITS 13
+#define MCCP_MEM_LEVEL   6
+
+void client_compress_start(void)
+{
+    if(session->zstream)
+        return;
+
+    z_stream *z = calloc(1, sizeof(*z));
+    if(deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    MCCP_WINDOW_BITS, MCCP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        debugf("deflateInit2 failed, not compressing\n");
+        free(z);
+
+        const unsigned char seq[] = { IAC, WONT, TELOPT_COMPRESS2 };
+        out_raw(seq, ARRAYLEN(seq));
+        return;
+    }
+
+    /* this is the last thing sent uncompressed */
+    const unsigned char seq[] = { IAC, SB, TELOPT_COMPRESS2, IAC, SE };
+    out_raw(seq, ARRAYLEN(seq));
+    client_flush();
+
+    session->zstream = z;
+}
+
+static void compress_end(struct client_session *sess)
+{
+    struct iovec iov = { sess->outbuf, sess->outlen };
+    compress_iov(sess, &iov, 1, Z_FINISH);
+    sess->outlen = 0;
+
+    deflateEnd(sess->zstream);
+    free(sess->zstream);
+    sess->zstream = NULL;
+
+    debugf("client %d: MCCP: %"PRIu64" bytes compressed to %"PRIu64", %"PRIu64" us CPU\n",
+           sess->pid, sess->z_in, sess->z_out, sess->z_cpu / 1000);
+}
+
+void client_compress_end(void)
+{
+    if(session->zstream)
+        compress_end(session);
+}
+
+static void print_tls_stats(void)
+{
+    if(!session->ssl)
+    {
+        out("TLS: not in use by this session\n");
+        return;
+    }
+
+    out("TLS: %s, %s%s\n", SSL_get_version(session->ssl),
+        SSL_get_cipher_name(session->ssl),
+        SSL_session_reused(session->ssl) ? ", resumed session" : "");
+}
+
+static void print_compress_stats(void)
+{
+    if(!session->z_in)
+    {
+        out("MCCP: not in use by this session\n");
+        return;
+    }
+
+    out("MCCP: %"PRIu64" bytes compressed to %"PRIu64" (%.1f%%), %.3f ms CPU\n",
+        session->z_in, session->z_out, 100.0 * session->z_out / session->z_in,
+        session->z_cpu / 1e6);
+}
+
+void out_raw(const void *buf, size_t len)
+{
+    if(!session)
+        error("out() called without a client");
+    if(!len)
+        return;
+
+    /* doesn't fit: send it along with what's held */
+    if(session->outlen + len > sizeof(session->outbuf))
+    {
+        flush_session(session, buf, len);
+        return;
+    }
+
+    if(!session->outlen)
+    {
+        session->out_since = now_ms();
+        if(!session->out_queued)
+        {
+            session->out_queued = true;
+            session->next_dirty = dirty_sessions;
+            dirty_sessions = session;
+        }
+    }
+
+    memcpy(session->outbuf + session->outlen, buf, len);
+    session->outlen += len;
+
+    /* a long stream of output shouldn't be held back all the way */
+    if(now_ms() - session->out_since >= CLIENT_OUT_LATENCY)
+        flush_session(session, NULL, 0);
+}
+
+void client_flush(void)
+{
+    if(session->outlen)
+        flush_session(session, NULL, 0);
+}
+
+/* sessions stay on the dirty list after client_flush(), until this
+ * comes across them */
+int client_flush_due(void)
+{
+    uint64_t now = now_ms();
+    int next = -1;
+
+    struct client_session **iter = &dirty_sessions;
+    while(*iter)
+    {
+        struct client_session *sess = *iter;
+        if(sess->outlen && now - sess->out_since >= CLIENT_OUT_LATENCY)
+            flush_session(sess, NULL, 0);
+
+        if(!sess->outlen)
+        {
+            sess->out_queued = false;
+            *iter = sess->next_dirty;
+            continue;
+        }
+
+        int wait = sess->out_since + CLIENT_OUT_LATENCY - now;
+        if(next < 0 || wait < next)
+            next = wait;
+        iter = &sess->next_dirty;
+    }
+
+    return next;
+}
+
+static void flush_all(void)
+{
+    while(dirty_sessions)
+    {
+        struct client_session *sess = dirty_sessions;
+        dirty_sessions = sess->next_dirty;
+        sess->out_queued = false;
+        if(sess->outlen)
+            flush_session(sess, NULL, 0);
+    }
+}
+
+static void flush_cb(EV_P_ ev_prepare *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    flush_all();
+}
+
+/*
+ * Wraps text to the current session's width, starting at column *pos,
+ * into buf, which needs room for three bytes per byte of text. Newlines
+ * become CRLFs. Returns the length, and leaves the column it ended on
+ * in *pos.
+ */
+static size_t wrap_text(const char *text, char *buf, int *pos)
+{
+    uint16_t width = telnet_get_width();
+
+    /* the part of the line not written yet, and the column it starts on */
+    const char *ptr = text;
+    int col = *pos;
+
+    char *out = buf;
+    int i = 0, last_space = 0;
+    while(ptr[i])
+    {
+        bool is_newline = (ptr[i] == '\n');
+        if(is_newline || col + i >= width)
+        {
+            /* break at the last space, or mid-word if there isn't one */
+            int len = (is_newline || !last_space) ? i : last_space;
+
+            memcpy(out, ptr, len);
+            out += len;
+            *out++ = '\r';
+            *out++ = '\n';
+            ptr += len;
+
+            if(is_newline)
+                ++ptr; /* skip the newline */
+
+            /* skip following spaces */
+            while(*ptr == ' ')
+                ++ptr;
+            last_space = 0;
+            col = 0;
+            i = 0;
+        }
+        else
+        {
+            if(ptr[i] == ' ')
+                last_space = i;
+            ++i;
+        }
+    }
+    memcpy(out, ptr, i);
+    out += i;
+
+    *pos = col + i;
+    return out - buf;
+}
+
+void __attribute__((format(printf,1,2))) out(const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+
+    va_end(ap);
+
+    char wrapped[sizeof(buf) * 3];
+    out_raw(wrapped, wrap_text(buf, wrapped, &session->out_pos));
+}
+
+/* room descriptions, wrapped, by room and width; see out_desc() */
+#define WRAP_CACHE_SZ 64
+
+static struct wrap_entry {
+    room_id  room;
+    uint32_t version;
+    uint16_t width;
+    int      end_pos;
+    char     *text;
+    size_t   len;
+} wrap_cache[WRAP_CACHE_SZ];
+
+void out_desc(room_id room, uint32_t version, const char *desc)
+{
+    static char scratch[MSG_MAX * 3];
+
+    /* descriptions start on a new line, anything else isn't worth
+     * keeping */
+    if(session->out_pos || strlen(desc) >= MSG_MAX)
+    {
+        out("%s", desc);
+        return;
+    }
+
+    uint16_t width = telnet_get_width();
+    struct wrap_entry *entry = wrap_cache + ((unsigned)room * 31 + width) % WRAP_CACHE_SZ;
+
+    if(!entry->text || entry->room != room || entry->version != version || entry->width != width)
+    {
+        int pos = 0;
+        size_t len = wrap_text(desc, scratch, &pos);
+
+        entry->text = realloc(entry->text, len);
+        memcpy(entry->text, scratch, len);
+        entry->len = len;
+        entry->end_pos = pos;
+        entry->room = room;
+        entry->version = version;
+        entry->width = width;
+    }
+
+    out_raw(entry->text, entry->len);
+    session->out_pos = entry->end_pos;
+}
+
+void client_disconnect(void)
+{
+    client_compress_end();
+    client_flush();
+
+    if(!multiplexed())
+    {
+        drain_before_exit(session);
+        tls_close(session->ssl);
+        exit(0);
+    }
+
+    if(session->closing)
+        return;
+
+    /* we can't free the session yet, as we are probably deep inside
+     * one of its callbacks */
+    session->closing = true;
+    client_input_stop(session);
+    ev_timer_stop(EV_DEFAULT_ &session->delay_timer);
+    auth_cancel(session->auth_job);
+    session->auth_job = NULL;
+
+    session->next_closed = closed_sessions;
+    closed_sessions = session;
+}
+
+struct client_session *client_next_closed(void)
+{
+    struct client_session *ret = closed_sessions;
+    if(ret)
+        closed_sessions = ret->next_closed;
+    return ret;
+}
+
+/*
+ * Reads whatever the client's sent into the session's input ring,
+ * through the telnet parser. Returns false if the connection's gone.
+ */
+static bool client_fill_input(void)
+{
+    unsigned char buf[CLIENT_IN_SZ];
+    size_t space = CLIENT_IN_SZ - (session->in_tail - session->in_head);
+
+    /* full of lines waiting to be handled */
+    if(!space)
+        return true;
+
+    ssize_t len = sess_read(session, buf, space);
+    if(len < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if(len <= 0)
+        return false;
+
+    session->last_input = time(NULL);
+
+    len = telnet_parse_data(buf, len);
+    if(len < 0)
+    {
+        client_disconnect();
+        return true;
+    }
+
+    for(ssize_t i = 0; i < len; ++i)
+        session->inbuf[session->in_tail++ % CLIENT_IN_SZ] = buf[i];
+
+    return true;
+}
+
+/*
+ * Finds the length of the next line in the input ring, and whether a
+ * newline ends it. Returns false if it isn't complete yet.
+ */
+static bool client_line_ready(unsigned *len_out, bool *newline_out)
+{
+    unsigned avail = session->in_tail - session->in_head;
+    unsigned max = MIN(avail, CLIENT_READ_SZ - 1);
+
+    unsigned len = 0;
+    while(len < max && session->inbuf[(session->in_head + len) % CLIENT_IN_SZ] != '\n')
+        ++len;
+
+    /* treat a full line as a complete one */
+    bool newline = len < max;
+    if(!newline && len < CLIENT_READ_SZ - 1)
+        return false;
+
+    *len_out = len;
+    *newline_out = newline;
+    return true;
+}
+
+/*
+ * Copies the next complete line out of the input ring into
+ * session->line and returns it, or NULL if there isn't one yet.
+ */
+static char *client_next_line(void)
+{
+    unsigned len;
+    bool newline;
+    if(!client_line_ready(&len, &newline))
+        return NULL;
+
+    for(unsigned i = 0; i < len + newline; ++i)
+    {
+        char *c = session->inbuf + session->in_head++ % CLIENT_IN_SZ;
+        if(i < len)
+            session->line[i] = *c;
+
+        /* don't leave passwords lying around */
+        if(session->line_secret)
+            *c = '\0';
+    }
+    session->line[len] = '\0';
+
+    return session->line;
+}
+
+/* forked modes only: blocks until a line of input is available */
+char *client_read(void)
+{
+    /* set of the client fd and the pipe from our parent */
+    struct pollfd fds[2];
+
+    /* order matters here: we first fulfill parent requests, then
+     * handle client data */
+
+    fds[0].fd = session->from_parent;
+    fds[0].events = POLLIN;
+
+    fds[1].fd = session->fd;
+
+    while(1)
+    {
+        char *line = client_next_line();
+        if(line)
+            return line;
+
+        /* TLS may have decrypted more than we took, which poll()
+         * won't tell us about */
+        if(tls_pending(session->ssl))
+        {
+            if(!client_fill_input())
+                error("lost connection");
+            continue;
+        }
+
+        /* we're waiting for input, so anything that came in from the
+         * master in the meantime goes out now */
+        client_flush();
+
+        fds[1].events = POLLIN | (session->qlen ? POLLOUT : 0);
+
+        poll(fds, ARRAYLEN(fds), -1);
+
+        if(fds[1].revents & POLLOUT)
+            drain_queue(session);
+
+        if(fds[0].revents & POLLIN)
+            poll_requests(session->from_parent, session->shm);
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if(!client_fill_input())
+                error("lost connection");
+        }
+    }
+}
+
+/* the next line of input will be passed to cb */
+static void client_expect(void (*cb)(char*), bool secret)
+{
+    session->line_cb = cb;
+    session->line_secret = secret;
+}
+
+/* still not encrypted, but a bit better than echoing the password! */
+static void client_read_password(void (*cb)(char*))
+{
+    telnet_echo_off();
+    client_expect(cb, true);
+}
+
+#define FAIL_DELAY 2
+
+/* waits a while before calling cb, to slow down password guessing */
+static void client_delay(void (*cb)(void))
+{
+    if(!multiplexed())
+    {
+        client_flush();
+        sleep(FAIL_DELAY);
+        cb();
+        return;
+    }
+
+    /* we can't block other sessions, so stop reading input until a
+     * timer fires */
+    session->line_cb = NULL;
+    session->delay_cb = cb;
+    client_input_stop(session);
+    ev_timer_set(&session->delay_timer, FAIL_DELAY, 0);
+    ev_timer_start(EV_DEFAULT_ &session->delay_timer);
+}
+
+static void client_auth_cb(void *arg, struct userdata_t *data);
+
+/* checks session->user's password, then calls cb with the user's data
+ * in session->auth_data, or NULL. The hashing mustn't block other
+ * sessions either, so they're paused like in client_delay() while
+ * another thread does it. */
+static void client_check_pass(const char *pass, void (*cb)(void))
+{
+    if(!multiplexed())
+    {
+        session->auth_data = auth_check(session->user, pass);
+        cb();
+        return;
+    }
+
+    session->line_cb = NULL;
+    session->delay_cb = cb;
+    client_input_stop(session);
+    session->auth_job = auth_check_async(session->user, pass, client_auth_cb, session);
+}
+
+static void dialog_end(void)
+{
+    if(session->dialog_pass)
+    {
+        memset(session->dialog_pass, 0, strlen(session->dialog_pass));
+        free(session->dialog_pass);
+        session->dialog_pass = NULL;
+    }
+    free(session->dialog_user);
+    session->dialog_user = NULL;
+}
+
+#define CMD_OK      0
+#define CMD_LOGOUT  1
+#define CMD_QUIT    2
+
+/*** callbacks ***/
+
+static void useradd_priv_cb(char *allow_admin)
+{
+    int priv = PRIV_USER;
+    if(toupper(allow_admin[0]) == 'Y')
+        priv = PRIV_ADMIN;
+
+    if(auth_user_add(session->dialog_user, session->dialog_pass, priv))
+        out("Success.\n");
+    else
+        out("Failure.\n");
+
+    dialog_end();
+}
+
+static void useradd_verify_cb(char *pass2)
+{
+    if(strcmp(session->dialog_pass, pass2))
+    {
+        dialog_end();
+        out("Failure.\n");
+        return;
+    }
+
+    out("Admin privileges [y/N]? ");
+    client_expect(useradd_priv_cb, false);
+}
+
+static void useradd_pass_cb(char *pass)
+{
+    session->dialog_pass = strdup(pass);
+
+    out("Verify Password: ");
+    client_read_password(useradd_verify_cb);
+}
+
+int user_cb(char **save)
+{
+    char *what = strtok_r(NULL, WSPACE, save);
+    if(!what)
+    {
+        out("Usage: USER <ADD|DEL|MODIFY|LIST> <ARGS>\n");
+        return CMD_OK;
+    }
+
+    all_upper(what);
+
+    if(!strcmp(what, "DEL"))
+    {
+        char *user = strtok_r(NULL, WSPACE, save);
+        if(user)
+        {
+            if(strcmp(user, session->user) && auth_user_del(user))
+                out("Success.\n");
+            else
+                out("Failure.\n");
+        }
+        else
+        {
+            out("Usage: USER DEL <USERNAME>\n");
+        }
+    }
+    else if(!strcmp(what, "ADD") || !strcmp(what, "MODIFY"))
+    {
+        char *user = strtok_r(NULL, WSPACE, save);
+        if(user)
+        {
+            if(!strcmp(user, session->user))
+            {
+                out("Do not modify your own password using USER. User CHPASS instead.\n");
+                return CMD_OK;
+            }
+
+            out("Editing user '%s'\n", user);
+
+            out("New Password (_DO_NOT_USE_A_VALUABLE_PASSWORD_): ");
+
+            /* BAD BAD BAD BAD BAD BAD BAD CLEARTEXT PASSWORDS!!! */
+            session->dialog_user = strdup(user);
+            client_read_password(useradd_pass_cb);
+        }
+        else
+            out("Usage: USER <ADD|MODIFY> <USERNAME>\n");
+    }
+    else if(!strcmp(what, "LIST"))
+    {
+        client_user_list();
+    }
+    else
+    {
+        out("Usage: USER <ADD|DEL|MODIFY|LIST> <ARGS>\n");
+    }
+
+    return CMD_OK;
+}
+
+int client_cb(char **save)
+{
+    char *what = strtok_r(NULL, WSPACE, save);
+    if(!what)
+    {
+        out("Usage: CLIENT <LIST|KICK|STATS> <PID>\n");
+        return CMD_OK;
+    }
+
+    all_upper(what);
+
+    if(!strcmp(what, "LIST"))
+    {
+        send_master(REQ_LISTCLIENTS, NULL, 0);
+    }
+    else if(!strcmp(what, "STATS"))
+    {
+        print_tls_stats();
+        print_compress_stats();
+        send_master(REQ_STATS, NULL, 0);
+    }
+    else if(!strcmp(what, "KICK"))
+    {
+        char *pid_s = strtok_r(NULL, WSPACE, save);
+        if(pid_s)
+        {
+            all_upper(pid_s);
+            if(!strcmp(pid_s, "ALL"))
+            {
+                const char *msg = "Kicking everyone...\n";
+                send_master(REQ_KICKALL, msg, strlen(msg));
+                out("All clients kicked.\n");
+                return CMD_OK;
+            }
+            /* weird pointer voodoo */
+            /* TODO: simplify */
+            char pidbuf[MAX(sizeof(pid_t), MSG_MAX)];
+            char *end;
+            pid_t pid = strtol(pid_s, &end, 0);
+            if(pid == session->pid)
+            {
+                out("You cannot kick yourself. Use EXIT instead.\n");
+                return CMD_OK;
+            }
+            else if(*end != '\0')
+            {
+                out("Expected a child PID after KICK.\n");
+                return CMD_OK;
+            }
+            memcpy(pidbuf, &pid, sizeof(pid));
+            int len = sizeof(pid_t) + snprintf(pidbuf + sizeof(pid_t),
+                                               sizeof(pidbuf) - sizeof(pid_t),
+                                               "You were kicked.\n");
+            send_master(REQ_KICK, pidbuf, len);
+        }
+        else
+            out("Usage: CLIENT KICK <PID|ALL>\n");
+    }
+    return CMD_OK;
+}
+
+int quit_cb(char **save)
+{
+    (void) save;
+    return CMD_QUIT;
+}
+
+int say_cb(char **save)
+{
+    char buf[MSG_MAX];
+    char *what = strtok_r(NULL, "", save);
+    int len = snprintf(buf, sizeof(buf), "%s says %s\n", session->user, what);
+
+    send_master(REQ_ROOMMSG, buf, len);
+    return CMD_OK;
+}
+
+int date_cb(char **save)
+{
+    (void) save;
+    time_t t = time(NULL);
+    out("%s", ctime(&t));
+    return CMD_OK;
+}
+
+int logout_cb(char **save)
+{
+    (void) save;
+    out("Logged out.\n");
+    telnet_clear_screen();
+    return CMD_LOGOUT;
+}
+
+int look_cb(char **save)
+{
+    char *what = strtok_r(NULL, "", save);
+    if(!what)
+        client_look();
+    else
+    {
+        client_look_at(what);
+    }
+    return CMD_OK;
+}
+
+int inventory_cb(char **save)
+{
+    (void) save;
+    client_inventory();
+    return CMD_OK;
+}
+
+int take_cb(char **save)
+{
+    char *what = strtok_r(NULL, "", save);
+    client_take(what);
+    return CMD_OK;
+}
+
+int wait_cb(char **save)
+{
+    (void) save;
+    /* debugging */
+    send_master(REQ_WAIT, NULL, 0);
+    return CMD_OK;
+}
+
+int go_cb(char **save)
+{
+    char *dir = strtok_r(NULL, WSPACE, save);
+    if(dir)
+    {
+        all_upper(dir);
+        /* the master shows us the new room */
+        client_move(dir);
+    }
+    else
+        out("I don't understand where you want me to go.\n");
+    return CMD_OK;
+}
+
+int drop_cb(char **save)
+{
+    char *what = strtok_r(NULL, "", save);
+    if(what)
+        client_drop(what);
+    else
+        out("You must supply an object.\n");
+    return CMD_OK;
+}
+
+int brief_cb(char **save)
+{
+    (void) save;
+    if(!(session->gmcp & GMCP_ON))
+    {
+        out("Your client doesn't support GMCP.\n");
+        return CMD_OK;
+    }
+
+    client_set_gmcp(session->gmcp ^ GMCP_BRIEF);
+    if(session->gmcp & GMCP_BRIEF)
+        out("Rooms will no longer be described when you enter them.\n");
+    else
+        out("Rooms will be described when you enter them.\n");
+    return CMD_OK;
+}
+
+static void chpass_verify_cb(char *pass2)
+{
+    if(strcmp(session->dialog_pass, pass2))
+    {
+        dialog_end();
+
+        out("Passwords do not match.\n");
+        return;
+    }
+
+    auth_user_add(session->user, session->dialog_pass, session->dialog_priv);
+
+    dialog_end();
+
+    out("Password updated.\n");
+}
+
+static void chpass_new_cb(char *pass1)
+{
+    session->dialog_pass = strdup(pass1);
+
+    out("Retype new password: ");
+    client_read_password(chpass_verify_cb);
+}
+
+static void chpass_failed(void)
+{
+    out("Authentication failed.\n");
+}
+
+static void chpass_checked(void)
+{
+    struct userdata_t *current_data = session->auth_data;
+
+    if(!current_data)
+    {
+        client_delay(chpass_failed);
+        return;
+    }
+
+    session->dialog_priv = current_data->priv;
+
+    out("Enter new password: ");
+    client_read_password(chpass_new_cb);
+}
+
+static void chpass_current_cb(char *current)
+{
+    client_check_pass(current, chpass_checked);
+}
+
+int chpass_cb(char **save)
+{
+    (void) save;
+    out("Changing password for %s\n", session->user);
+    out("Enter current password: ");
+    client_read_password(chpass_current_cb);
+
+    return CMD_OK;
+}
+
+static const struct client_cmd {
+    const char *cmd;
+    int (*cb)(char **saveptr);
+    bool admin_only;
+} cmds[] = {
+    {  "USER",       user_cb,       true   },
+    {  "CLIENT",     client_cb,     true   },
+    {  "EXIT",       quit_cb,       false  },
+    {  "QUIT",       quit_cb,       false  },
+    {  "SAY",        say_cb,        false  },
+    {  "DATE",       date_cb,       false  },
+    {  "LOGOUT",     logout_cb,     false  },
+    {  "LOOK",       look_cb,       false  },
+    {  "INVENTORY",  inventory_cb,  false  },
+    {  "TAKE",       take_cb,       false  },
+    {  "WAIT",       wait_cb,       true   },
+    {  "GO",         go_cb,         false  },
+    {  "DROP",       drop_cb,       false  },
+    {  "BRIEF",      brief_cb,      false  },
+    {  "CHPASS",     chpass_cb,     false  },
+};
 
-bool child_rawmode = false;
+static void *cmd_map = NULL;
 
-bool poll_requests(void);
+void client_init(void)
+{
+    cmd_map = hash_init(ARRAYLEN(cmds), hash_djb, compare_strings);
+    hash_insert_pairs(cmd_map, (const struct hash_pair*)cmds, sizeof(cmds[0]), ARRAYLEN(cmds));
+}
 
-void out_raw(const void *buf, size_t len)
+void client_shutdown(void)
 {
-    if(!are_child)
-        error("out() called from master");
-    if(!len)
-        return;
+    /* the ring's gone, so their requests are too */
+    while(freeing_sessions)
+        client_free_done(freeing_sessions);
+
+    hash_free(cmd_map);
+    cmd_map = NULL;
+
+    for(unsigned i = 0; i < WRAP_CACHE_SZ; ++i)
+    {
+        free(wrap_cache[i].text);
+        wrap_cache[i].text = NULL;
+    }
+}
 
-try_again:
+static void client_login(void);
 
-    while(output_locked);
+/* the main command loop */
+static void command_cb(char *line)
+{
+    char orig[CLIENT_READ_SZ];
+    strcpy(orig, line);
+    char *save = NULL;
 
-    /* something weird happened and the value changed between the loop and here */
-    if(!output_locked)
+    if(!session->rawmode)
     {
-        output_locked = 1;
-        write(client_fd, buf, len);
-        output_locked = 0;
+        char *tok = strtok_r(line, WSPACE, &save);
+
+        if(!tok)
+            goto next_cmd;
+
+        all_upper(tok);
+
+        const struct client_cmd *cmd = hash_lookup(cmd_map, tok);
+        if(cmd && cmd->cb && (!cmd->admin_only || (cmd->admin_only && session->admin)))
+        {
+            int ret = cmd->cb(&save);
+            switch(ret)
+            {
+            case CMD_OK:
+                goto next_cmd;
+            case CMD_LOGOUT:
+                client_login();
+                goto next_cmd;
+            case CMD_QUIT:
+                client_disconnect();
+                goto next_cmd;
+            default:
+                error("client: bad callback return value");
+            }
+        }
+        else if(cmd && cmd->admin_only && !session->admin)
+        {
+            out("You are not allowed to do that.\n");
+            goto next_cmd;
+        }
     }
+
+    /* if we can't handle it, let the master process try */
+    send_master(REQ_EXECVERB, orig, strlen(orig) + 1);
+
+next_cmd:
+    ;
+}
+
+
+/*** login ***/
+
+static void login_user_cb(char *user);
+
+static void login_prompt(void)
+{
+    out("login: ");
+    client_expect(login_user_cb, false);
+}
+
+static void login_failed(void)
+{
+    out("Login incorrect\n\n");
+    if(++session->failures >= MAX_FAILURES)
+        client_disconnect();
     else
-        goto try_again;
+        login_prompt();
 }
 
-void __attribute__((format(printf,1,2))) out(const char *fmt, ...)
+static void login_checked(void)
 {
-    char buf[1024];
-    memset(buf, 0, sizeof(buf));
-    va_list ap;
-    va_start(ap, fmt);
+    struct userdata_t *current_data = session->auth_data;
 
-    vsnprintf(buf, sizeof(buf), fmt, ap);
+    if(!current_data)
+    {
+        client_change_state(STATE_FAILED);
+        free(session->user);
+        session->user = NULL;
+        client_delay(login_failed);
+        return;
+    }
 
-    va_end(ap);
+    out("Last login: %s", ctime(&current_data->last_login));
+    current_data->last_login = time(0);
+    int authlevel = current_data->priv;
+    userdb_request_add(current_data);
+
+    /* something has gone wrong, but we are here for some reason */
+    if(authlevel == PRIV_NONE)
+    {
+        client_disconnect();
+        return;
+    }
 
-    /* do some line wrapping */
+    session->admin = (authlevel == PRIV_ADMIN);
 
-    static int pos = 0;
-    int last_space = 0;
-    char *ptr = buf;
-    uint16_t line_width = telnet_get_width() + 1;
-    char *line_buf = malloc(line_width + 2);
-    size_t line_idx = 0;
-    while(ptr[pos])
+    /* it goes to a process of its own, which takes it from here */
+    if(login_only())
     {
-        bool is_newline = (ptr[pos] == '\n');
-        if(is_newline || pos >= line_width - 1)
-        {
-            if(is_newline || !last_space)
-                last_space = pos;
+        debugf("Client %s: authenticated as %s.\n", inet_ntoa(session->addr), session->user);
+        client_input_stop(session);
+        session->line_cb = command_cb;
+        session->authed = true;
+        session->next_authed = authed_sessions;
+        authed_sessions = session;
+        return;
+    }
 
-            while(*ptr && last_space-- > 0)
-            {
-                line_buf[line_idx++] = *ptr++;
-            }
+    if(session->admin)
+        client_change_state(STATE_ADMIN);
+    else
+        client_change_state(STATE_LOGGEDIN);
 
-            line_buf[line_idx++] = '\r';
-            line_buf[line_idx++] = '\n';
+    /* authenticated, begin main command loop */
+    debugf("Client %s: authenticated as %s.\n", inet_ntoa(session->addr), session->user);
+    client_change_user(session->user);
 
-            out_raw(line_buf, line_idx);
-            line_idx = 0;
+    client_change_room(0);
 
-            if(is_newline)
-                ++ptr; /* skip the newline */
+    client_look();
 
-            /* skip following spaces */
-            while(*ptr == ' ')
-                ++ptr;
-            last_space = 0;
-            pos = 0;
-        }
-        else
-        {
-            if(ptr[pos] == ' ')
-                last_space = pos;
-            ++pos;
-        }
+    client_expect(command_cb, false);
+}
+
+static void login_pass_cb(char *pass)
+{
+    client_change_state(STATE_CHECKING);
+    client_check_pass(pass, login_checked);
+}
+
+static void login_user_cb(char *user)
+{
+    free(session->user);
+    session->user = strdup(user);
+
+    out("Password: ");
+    client_read_password(login_pass_cb);
+}
+
+static void client_login(void)
+{
+    free(session->user);
+    session->user = NULL;
+    session->admin = false;
+    session->failures = 0;
+
+    int total = session->nclients;
+
+    out("NetCosm " NETCOSM_VERSION "\n");
+    if(total > 1)
+        out("%d clients connected.\n", total);
+    else
+        out("%d client connected.\n", total);
+
+    out("\nPlease authenticate to continue.\n\n");
+
+    client_change_state(STATE_AUTH);
+
+    login_prompt();
+}
+
+/*** session state machine ***/
+
+/* prints the prompt if we're waiting for a command, and sends
+ * everything the line produced in one go */
+static void client_finish_line(void)
+{
+    if(!session->closing && !session->delay_cb && !session->authed)
+    {
+        if(!session->line_cb)
+            session->line_cb = command_cb;
+
+        if(session->line_cb == command_cb && !session->rawmode)
+            out(">> ");
     }
-    out_raw(ptr, strlen(ptr));
-    free(line_buf);
+
+    client_flush();
 }
 
-#define CLIENT_READ_SZ 128
+/* passes a complete line to whatever is expecting it, takes ownership */
+static void client_handle_line(char *line)
+{
+    void (*cb)(char*) = session->line_cb;
+    bool secret = session->line_secret;
 
-char *client_read(void)
+    if(secret)
+    {
+        telnet_echo_on();
+        out("\n");
+    }
+
+    session->line_cb = NULL;
+    session->line_secret = false;
+
+    if(cb)
+        cb(line);
+
+    if(secret)
+        memset(line, 0, strlen(line));
+
+    client_finish_line();
+}
+
+static void client_setup_socket(void)
+{
+    /* output is batched by us, see out_raw(), and queued if the client
+     * doesn't keep up, see write_iov() */
+    int one = 1;
+    setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void client_start(void)
 {
-    char *buf;
-    size_t bufidx;
-tryagain:
+    client_setup_socket();
 
-    buf = calloc(1, CLIENT_READ_SZ);
-    bufidx = 0;
+    telnet_init();
 
-    /* set of the client fd and the pipe from our parent */
-    struct pollfd fds[2];
+    debugf("== New client %s ==\n", inet_ntoa(session->addr));
+    debugf("Total clients: %d\n", session->nclients);
 
-    /* order matters here: we first fulfill parent requests, then
-     * handle client data */
+    client_login();
 
-    fds[0].fd = from_parent;
-    fds[0].events = POLLIN;
+    client_finish_line();
+}
 
-    fds[1].fd = client_fd;
-    fds[1].events = POLLIN;
+/* forked modes: shakes hands with a client from the TLS port, giving
+ * up if it takes longer than CLIENT_HANDSHAKE_TIMEOUT */
+static bool client_handshake(void)
+{
+    client_setup_socket();
+
+    session->ssl = tls_new(session->fd);
+    if(!session->ssl)
+        return false;
+
+    uint64_t deadline = now_ms() + CLIENT_HANDSHAKE_TIMEOUT;
+    struct pollfd pfd = { session->fd, 0, 0 };
 
     while(1)
     {
-        poll(fds, ARRAYLEN(fds), -1);
-        for(int i = 0; i < 2; ++i)
+        switch(tls_handshake(session->ssl))
         {
-            if(fds[i].revents & POLLIN)
-            {
-                if(fds[i].fd == from_parent)
-                {
-                    poll_requests();
-                }
-                else if(fds[i].fd == client_fd)
-                {
-                    ssize_t len = read(client_fd, buf + bufidx, CLIENT_READ_SZ - bufidx - 1);
-                    if(len <= 0)
-                        error("lost connection");
-
-                    /* null-terminate */
-                    buf[CLIENT_READ_SZ - 1] = '\0';
-
-                    enum telnet_status ret = telnet_parse_data((unsigned char*)buf + bufidx, len);
-
-                    switch(ret)
-                    {
-                    case TELNET_EXIT:
-                    case TELNET_FOUNDCMD:
-                        free(buf);
-                        if(ret == TELNET_EXIT)
-                            exit(0);
-                        goto tryagain;
-                    case TELNET_DATA:
-                        bufidx += len;
-                        continue;
-                    case TELNET_LINEOVER:
-                        break;
-                    }
-
-                    remove_cruft(buf);
-
-                    return buf;
-                }
-            }
+        case TLS_DONE:
+            return true;
+        case TLS_WANT_READ:
+            pfd.events = POLLIN;
+            break;
+        case TLS_WANT_WRITE:
+            pfd.events = POLLOUT;
+            break;
+        case TLS_FAILED:
+            debugf("client %s: TLS handshake failed\n", inet_ntoa(session->addr));
+            return false;
+        }
+
+        uint64_t now = now_ms();
+        if(now >= deadline || poll(&pfd, 1, deadline - now) == 0)
+        {
+            debugf("client %s: TLS handshake timed out\n", inet_ntoa(session->addr));
+            return false;
         }
     }
 }
 
-/* still not encrypted, but a bit better than echoing the password! */
-char *client_read_password(void)
+/* picks up a session where it was left when handed back to the
+ * master, without a word to the client: its next line is a command
+ * like any other. One the master's just logged in is shown where it
+ * is, and what it typed meanwhile is handled as if we'd read it. */
+static void client_resume(const struct handoff *handoff)
 {
-    telnet_echo_off();
-    char *ret = client_read();
-    telnet_echo_on();
-    out("\n");
-    return ret;
-}
+    const struct parked_state *state = &handoff->state;
 
-#define CMD_OK      0
-#define CMD_LOGOUT  1
-#define CMD_QUIT    2
+    client_setup_socket();
 
-/*** callbacks ***/
+    session->term_width = state->term_width;
+    session->term_height = state->term_height;
+    session->user = strdup(state->user);
+    session->admin = state->admin;
+    session->rawmode = state->rawmode;
 
-int user_cb(char **save)
+    debugf("Client %s: resuming as %s.\n", inet_ntoa(session->addr), session->user);
+
+    client_set_gmcp(state->gmcp);
+    client_change_state(session->admin ? STATE_ADMIN : STATE_LOGGEDIN);
+    client_change_user(session->user);
+    client_change_room(state->room);
+
+    /* its last stream was finished before hibernating */
+    if(state->mccp)
+        client_compress_start();
+
+    client_expect(command_cb, false);
+
+    if(!handoff->login)
+    {
+        client_flush();
+        return;
+    }
+
+    session->telnet = handoff->telnet;
+    for(unsigned i = 0; i < handoff->input_len; ++i)
+        session->inbuf[session->in_tail++ % CLIENT_IN_SZ] = handoff->input[i];
+
+    client_look();
+    client_finish_line();
+}
+
+/*
+ * Gets the current session ready to be handed back to the master, and
+ * fills in what only it knows of state. Only between commands, with
+ * nothing half-done and all output gone; a restart also takes clients
+ * which haven't logged in, who start over. The TLS state can't be
+ * handed over, only the socket.
+ */
+static bool client_detach(struct parked_state *state, bool restart)
 {
-    char *what = strtok_r(NULL, WSPACE, save);
-    if(!what)
+    /* no line_cb: one's being handled; a session the master's logged
+     * in hands over what it's read, telnet state and all */
+    if(!session->line_cb || session->ssl || session->closing || session->delay_cb ||
+       (session->telnet.state != TS_DATA && !session->authed))
+        return false;
+
+    if(session->user ? (session->line_cb != command_cb || session->line_secret ||
+                        (session->in_head != session->in_tail && !session->authed)) : !restart)
+        return false;
+
+    /* io_uring: whatever's received has to be read first, and no
+     * more received */
+    if(session->uring)
     {
-        out("Usage: USER <ADD|DEL|MODIFY|LIST> <ARGS>\n");
-        return CMD_OK;
+        session->detaching = true;
+        if(session->recv_op.pending)
+            uring_cancel(&session->recv_op);
+        if(session->recv_op.pending || session->stash_len || session->stash_eof)
+            return false;
     }
 
-    all_upper(what);
+    client_flush();
+    if(queued(session))
+        return false;
 
-    if(!strcmp(what, "DEL"))
+    memset(state, 0, sizeof(*state));
+    state->term_width = session->term_width;
+    state->term_height = session->term_height;
+    state->mccp = (session->zstream != NULL) || session->detach_mccp;
+
+    /* the master fills in the rest, it knows better */
+    if(session->zstream)
     {
-        char *user = strtok_r(NULL, WSPACE, save);
-        if(user)
+        client_compress_end();
+        if(!multiplexed())
+            drain_before_exit(session);
+
+        /* it can't be waited for in event and mux modes, so it's
+         * handed back once it's gone, still marked as compressing */
+        if(queued(session))
         {
-            if(strcmp(user, current_user) && auth_user_del(user))
-                out("Success.\n");
+            if(multiplexed())
+                session->detach_mccp = true;
             else
-                out("Failure.\n");
-        }
-        else
-        {
-            out("Usage: USER DEL <USERNAME>\n");
+                client_compress_start();
+            return false;
         }
     }
-    else if(!strcmp(what, "ADD") || !strcmp(what, "MODIFY"))
+
+    return true;
+}
+
+void client_hibernate(int idle)
+{
+    if(multiplexed() || session->ctlsock < 0 || !session->user ||
+       time(NULL) - session->last_input < idle)
+        return;
+
+    struct parked_state state;
+    if(!client_detach(&state, false))
+        return;
+
+    if(!send_fd(session->ctlsock, session->fd, &state, sizeof(state)))
     {
-        char *user = strtok_r(NULL, WSPACE, save);
-        if(user)
-        {
-            if(!strcmp(user, current_user))
-            {
-                out("Do not modify your own password using USER. User CHPASS instead.\n");
-                return CMD_OK;
-            }
+        if(state.mccp)
+            client_compress_start();
+        return;
+    }
 
-            out("Editing user '%s'\n", user);
+    debugf("Client %s: hibernating.\n", inet_ntoa(session->addr));
 
-            out("New Password (_DO_NOT_USE_A_VALUABLE_PASSWORD_): ");
+    /* exit() would shut the socket down, see server_shutdown() */
+    _exit(0);
+}
 
-            /* BAD BAD BAD BAD BAD BAD BAD CLEARTEXT PASSWORDS!!! */
-            char *pass = client_read_password();
+void client_restart(void)
+{
+    int sock = multiplexed() ? worker_ctlsock : session->ctlsock;
 
-            out("Verify Password: ");
-            char *pass2 = client_read_password();
+    struct parked_state state;
+    if(sock < 0 || !client_detach(&state, true))
+        return;
 
-            if(strcmp(pass, pass2))
-            {
-                memset(pass, 0, strlen(pass));
-                memset(pass2, 0, strlen(pass2));
-                free(pass);
-                free(pass2);
-                out("Failure.\n");
-                return CMD_OK;
-            }
+    /* a worker has to say which of its sessions it is */
+    state.id = session->pid;
+
+    if(!send_fd(sock, session->fd, &state, sizeof(state)))
+    {
+        if(state.mccp)
+            client_compress_start();
+        return;
+    }
 
-            out("Admin privileges [y/N]? ");
-            char *allow_admin = client_read();
-            int priv = PRIV_USER;
-            if(toupper(allow_admin[0]) == 'Y')
-                priv = PRIV_ADMIN;
+    debugf("Client %s: handed back for a restart.\n", inet_ntoa(session->addr));
 
-            free(allow_admin);
+    if(!multiplexed())
+        _exit(0);
 
-            if(auth_user_add(user, pass, priv))
-                out("Success.\n");
-            else
-                out("Failure.\n");
-            memset(pass, 0, strlen(pass));
-            free(pass);
-        }
-        else
-            out("Usage: USER <ADD|MODIFY> <USERNAME>\n");
+    session->handed_back = true;
+    client_disconnect();
+}
+
+int client_release(struct client_session *sess, struct parked_state *state)
+{
+    struct client_session *old = session;
+    session = sess;
+
+    /* it's on its way to a process of its own, which can */
+    int fd = -1;
+    if(!sess->authed && client_detach(state, true))
+    {
+        fd = sess->fd;
+        sess->fd = -1;
     }
-    else if(!strcmp(what, "LIST"))
+
+    session = old;
+    return fd;
+}
+
+void client_restart_abort(struct client_session *sess)
+{
+    struct client_session *old = session;
+    session = sess;
+
+    sess->detaching = false;
+    if(sess->uring && !sess->recv_op.pending && !sess->stash_eof &&
+       sess->stash_len < CLIENT_STASH_MAX)
+        uring_recv_start(sess);
+
+    if(sess->detach_mccp)
     {
-        client_user_list();
+        sess->detach_mccp = false;
+        client_compress_start();
     }
-    else
+
+    session = old;
+}
+
+int client_next_authed(struct handoff *handoff, struct child_data **child)
+{
+    struct client_session *old = session;
+    int fd = -1;
+
+    /* those whose output hasn't gone yet stay where they are */
+    struct client_session **iter = &authed_sessions;
+    while((session = *iter))
     {
-        out("Usage: USER <ADD|DEL|MODIFY|LIST> <ARGS>\n");
+        memset(handoff, 0, sizeof(*handoff));
+        if(client_detach(&handoff->state, false))
+            break;
+        iter = &session->next_authed;
     }
 
-    return CMD_OK;
+    if(session)
+    {
+        *iter = session->next_authed;
+        session->authed = false;
+
+        /* unlike a hibernating session's, we know all of it */
+        strncpy(handoff->state.user, session->user, MAX_NAME_LEN);
+        handoff->state.admin = session->admin;
+        handoff->state.gmcp = session->gmcp;
+        handoff->resume = true;
+
+        handoff->login = true;
+        handoff->telnet = session->telnet;
+        handoff->input_len = MIN(session->in_tail - session->in_head, LOGIN_INPUT_SZ);
+        for(unsigned i = 0; i < handoff->input_len; ++i)
+            handoff->input[i] = session->inbuf[(session->in_head + i) % CLIENT_IN_SZ];
+
+        *child = session->child;
+        fd = session->fd;
+        session->fd = -1;
+    }
+
+    session = old;
+    return fd;
+}
+
+void client_main(int fd, const struct handoff *handoff, int ctlsock,
+                 int to, int from, struct ipc_shm *shm)
+{
+    session = &child_session;
+    memset(session, 0, sizeof(*session));
+
+    session->fd = fd;
+    session->ctlsock = ctlsock;
+    session->to_parent = to;
+    session->from_parent = from;
+    session->shm = shm;
+    session->pid = getpid();
+    session->addr = handoff->addr.sin_addr;
+    session->nclients = handoff->nclients;
+    session->last_input = time(NULL);
+
+    /* one-way requests and broadcasts aren't followed by REQ_ALLDONE,
+     * so poll_requests() reads until there's nothing left */
+    if(!shm)
+        fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+
+    if(handoff->tls && !client_handshake())
+        exit(0);
+
+    if(handoff->resume)
+        client_resume(handoff);
+    else
+        client_start();
+
+    while(1)
+        client_handle_line(client_read());
 }
 
-int client_cb(char **save)
+/*** event and mux modes ***/
+
+/* sessions with lines left over after their turn; a check watcher
+ * gives them another every loop iteration, and an idle one keeps the
+ * loop from blocking meanwhile */
+static struct client_session *backlog = NULL;
+static ev_check backlog_watcher;
+static ev_idle backlog_idle;
+
+/*
+ * Handles up to CLIENT_TICK_LINES complete lines from the input ring,
+ * stopping early if the session closes or starts a login delay. Any
+ * left over wait for the next iteration, and no more input is read
+ * until they're done: the ring is the session's command queue.
+ */
+static void client_run_lines(void)
 {
-    char *what = strtok_r(NULL, WSPACE, save);
-    if(!what)
+    char *line;
+    for(int i = 0; i < CLIENT_TICK_LINES; ++i)
     {
-        out("Usage: CLIENT <LIST|KICK> <PID>\n");
-        return CMD_OK;
+        if(session->closing || session->delay_cb || session->authed ||
+           !(line = client_next_line()))
+            return;
+        client_handle_line(line);
     }
 
-    all_upper(what);
+    if(session->closing || session->delay_cb || session->authed)
+        return;
 
-    if(!strcmp(what, "LIST"))
+    unsigned len;
+    bool newline;
+    if(!client_line_ready(&len, &newline))
+        return;
+
+    client_input_stop(session);
+    if(!session->backlogged)
     {
-        send_master(REQ_LISTCLIENTS, NULL, 0);
+        session->backlogged = true;
+        session->next_backlog = backlog;
+        backlog = session;
     }
-    else if(!strcmp(what, "KICK"))
+
+    if(!ev_is_active(&backlog_watcher))
     {
-        char *pid_s = strtok_r(NULL, WSPACE, save);
-        if(pid_s)
-        {
-            all_upper(pid_s);
-            if(!strcmp(pid_s, "ALL"))
-            {
-                const char *msg = "Kicking everyone...\n";
-                send_master(REQ_KICKALL, msg, strlen(msg));
-                out("All clients kicked.\n");
-                return CMD_OK;
-            }
-            /* weird pointer voodoo */
-            /* TODO: simplify */
-            char pidbuf[MAX(sizeof(pid_t), MSG_MAX)];
-            char *end;
-            pid_t pid = strtol(pid_s, &end, 0);
-            if(pid == getpid())
-            {
-                out("You cannot kick yourself. Use EXIT instead.\n");
-                return CMD_OK;
-            }
-            else if(*end != '\0')
-            {
-                out("Expected a child PID after KICK.\n");
-                return CMD_OK;
-            }
-            memcpy(pidbuf, &pid, sizeof(pid));
-            int len = sizeof(pid_t) + snprintf(pidbuf + sizeof(pid_t),
-                                               sizeof(pidbuf) - sizeof(pid_t),
-                                               "You were kicked.\n");
-            send_master(REQ_KICK, pidbuf, len);
-        }
-        else
-            out("Usage: CLIENT KICK <PID|ALL>\n");
+        ev_check_start(EV_DEFAULT_ &backlog_watcher);
+        ev_idle_start(EV_DEFAULT_ &backlog_idle);
     }
-    return CMD_OK;
 }
 
-int quit_cb(char **save)
+/* TLS may have decrypted more input than the ring took, or io_uring
+ * received it, neither of which the socket will signal again; pretend
+ * it has */
+static void client_feed_pending(void)
 {
-    (void) save;
-    return CMD_QUIT;
+    bool pending = tls_pending(session->ssl) || session->stash_len || session->stash_eof;
+    if(pending && !session->closing && client_input_active(session))
+        ev_feed_event(EV_DEFAULT_ &session->io_watcher, EV_READ);
 }
 
-int say_cb(char **save)
+static void backlog_idle_cb(EV_P_ ev_idle *w, int revents)
 {
-    char buf[MSG_MAX];
-    char *what = strtok_r(NULL, "", save);
-    int len = snprintf(buf, sizeof(buf), "%s says %s\n", current_user, what);
-
-    send_master(REQ_BCASTMSG, buf, len);
-    return CMD_OK;
+    (void) EV_A;
+    (void) w;
+    (void) revents;
 }
 
-int date_cb(char **save)
+static void backlog_cb(EV_P_ ev_check *w, int revents)
 {
-    (void) save;
-    time_t t = time(NULL);
-    out("%s", ctime(&t));
-    return CMD_OK;
-}
+    (void) w;
+    (void) revents;
 
-int logout_cb(char **save)
-{
-    (void) save;
-    out("Logged out.\n");
-    telnet_clear_screen();
-    return CMD_LOGOUT;
+    struct client_session *old = session;
+
+    /* sessions still backlogged afterwards put themselves back */
+    struct client_session *list = backlog;
+    backlog = NULL;
+
+    while(list)
+    {
+        session = list;
+        list = session->next_backlog;
+        session->backlogged = false;
+
+        client_run_lines();
+
+        /* caught up, so read input again */
+        if(!session->backlogged && !session->closing && !session->delay_cb &&
+           !session->authed)
+        {
+            client_input_start(session);
+            client_feed_pending();
+        }
+    }
+
+    session = old;
+
+    if(!backlog)
+    {
+        ev_check_stop(EV_A_ &backlog_watcher);
+        ev_idle_stop(EV_A_ &backlog_idle);
+    }
 }
 
-int look_cb(char **save)
+static void client_io_cb(EV_P_ ev_io *w, int revents)
 {
-    char *what = strtok_r(NULL, "", save);
-    if(!what)
-        client_look();
+    (void) EV_A;
+    (void) revents;
+
+    struct client_session *old = session;
+    session = w->data;
+
+    if(!client_fill_input())
+    {
+        debugf("client %s: lost connection\n", inet_ntoa(session->addr));
+        client_disconnect();
+    }
     else
     {
-        client_look_at(what);
+        client_run_lines();
+        client_feed_pending();
     }
-    return CMD_OK;
+
+    session = old;
 }
 
-int inventory_cb(char **save)
+static void client_out_cb(EV_P_ ev_io *w, int revents)
 {
-    (void) save;
-    client_inventory();
-    return CMD_OK;
+    (void) EV_A;
+    (void) revents;
+
+    drain_queue(w->data);
 }
 
-int take_cb(char **save)
+/* carries on with a session paused by client_delay() or
+ * client_check_pass() */
+static void client_unpause(struct client_session *sess)
 {
-    char *what = strtok_r(NULL, "", save);
-    client_take(what);
-    return CMD_OK;
+    struct client_session *old = session;
+    session = sess;
+
+    void (*cb)(void) = session->delay_cb;
+    session->delay_cb = NULL;
+
+    client_input_start(session);
+
+    cb();
+    client_finish_line();
+
+    /* anything typed during the delay */
+    client_run_lines();
+    client_feed_pending();
+
+    session = old;
 }
 
-int wait_cb(char **save)
+static void client_delay_cb(EV_P_ ev_timer *w, int revents)
 {
-    (void) save;
-    /* debugging */
-    send_master(REQ_WAIT, NULL, 0);
-    return CMD_OK;
+    (void) EV_A;
+    (void) revents;
+
+    client_unpause(w->data);
 }
 
-int go_cb(char **save)
+static void client_auth_cb(void *arg, struct userdata_t *data)
 {
-    char *dir = strtok_r(NULL, WSPACE, save);
-    if(dir)
-    {
-        all_upper(dir);
-        if(client_move(dir))
-            client_look();
-    }
-    else
-        out("I don't understand where you want me to go.\n");
-    return CMD_OK;
+    struct client_session *sess = arg;
+    sess->auth_job = NULL;
+    sess->auth_data = data;
+
+    client_unpause(sess);
+    sess->auth_data = NULL;
 }
 
-int drop_cb(char **save)
+static void client_handshake_timeout_cb(EV_P_ ev_timer *w, int revents)
 {
-    char *what = strtok_r(NULL, "", save);
-    if(what)
-        client_drop(what);
-    else
-        out("You must supply an object.\n");
-    return CMD_OK;
+    (void) EV_A;
+    (void) revents;
+
+    struct client_session *old = session;
+    session = w->data;
+
+    debugf("client %s: TLS handshake timed out\n", inet_ntoa(session->addr));
+    client_disconnect();
+
+    session = old;
 }
 
-int chpass_cb(char **save)
+/* the TLS handshake, on io_watcher until it's done */
+static void client_handshake_cb(EV_P_ ev_io *w, int revents)
 {
-    (void) save;
-    out("Changing password for %s\n", current_user);
-    out("Enter current password: ");
-    char *current = client_read_password();
-
-    struct userdata_t *current_data = auth_check(current_user, current);
+    (void) revents;
 
-    memset(current, 0, strlen(current));
-    free(current);
+    struct client_session *old = session;
+    session = w->data;
 
-    if(!current_data)
+    enum tls_status status = tls_handshake(session->ssl);
+    switch(status)
     {
-        out("Authentication failed.\n");
-        return CMD_OK;
+    case TLS_DONE:
+        ev_io_stop(EV_A_ w);
+        ev_timer_stop(EV_A_ &session->delay_timer);
+        ev_set_cb(&session->delay_timer, client_delay_cb);
+        ev_io_init(w, client_io_cb, session->fd, EV_READ);
+        ev_io_start(EV_A_ w);
+        client_start();
+        client_feed_pending();
+        break;
+    case TLS_WANT_READ:
+    case TLS_WANT_WRITE:
+    {
+        int events = status == TLS_WANT_WRITE ? EV_WRITE : EV_READ;
+        if(!(w->events & events))
+        {
+            ev_io_stop(EV_A_ w);
+            ev_io_set(w, session->fd, events);
+            ev_io_start(EV_A_ w);
+        }
+        break;
+    }
+    case TLS_FAILED:
+        debugf("client %s: TLS handshake failed\n", inet_ntoa(session->addr));
+        client_disconnect();
+        break;
     }
 
-    out("Enter new password: ");
-    char *pass1 = client_read_password();
-
-    out("Retype new password: ");
+    session = old;
+}
 
-    char *pass2 = client_read_password();
+struct client_session *client_new(int sock, const struct handoff *handoff,
+                                  struct child_data *child)
+{
+    struct client_session *sess = calloc(1, sizeof(*sess));
+    bool tls = handoff->tls;
+
+    sess->fd = sock;
+    sess->to_parent = worker_to_parent;
+    sess->from_parent = worker_from_parent;
+    sess->shm = worker_shm;
+    sess->pid = handoff->id;
+    sess->addr = handoff->addr.sin_addr;
+    sess->nclients = handoff->nclients;
+    sess->child = child;
+
+    if(child)
+        child->session = sess;
+
+    if(mux_sessions)
+        hash_insert(mux_sessions, &sess->pid, sess);
+
+    ev_io_init(&sess->io_watcher, client_io_cb, sock, EV_READ);
+    sess->io_watcher.data = sess;
+    ev_io_init(&sess->out_watcher, client_out_cb, sock, EV_WRITE);
+    sess->out_watcher.data = sess;
+    ev_init(&sess->delay_timer, client_delay_cb);
+    sess->delay_timer.data = sess;
+
+    /* nothing's said until the client's shaken hands */
+    if(tls)
+    {
+        sess->ssl = tls_new(sock);
+        ev_set_cb(&sess->io_watcher, client_handshake_cb);
+        ev_set_cb(&sess->delay_timer, client_handshake_timeout_cb);
+        ev_timer_set(&sess->delay_timer, CLIENT_HANDSHAKE_TIMEOUT / 1000.0, 0);
+    }
 
-    if(strcmp(pass1, pass2))
+    /* TLS sessions stay on libev, OpenSSL does their reading */
+    sess->uring = uring_running() && !tls;
+    if(sess->uring)
     {
-        memset(pass1, 0, strlen(pass1));
-        memset(pass2, 0, strlen(pass2));
-        free(pass1);
-        free(pass2);
+        sess->recv_op.cb = uring_recv_cb;
+        sess->recv_op.data = sess;
+        sess->send_op.cb = uring_send_cb;
+        sess->send_op.data = sess;
+        uring_recv_start(sess);
+        client_input_start(sess);
+    }
+    else
+        ev_io_start(EV_DEFAULT_ &sess->io_watcher);
 
-        out("Passwords do not match.\n");
-        return CMD_OK;
+    if(!ev_is_active(&flush_watcher))
+    {
+        ev_prepare_init(&flush_watcher, flush_cb);
+        ev_prepare_start(EV_DEFAULT_ &flush_watcher);
+        ev_check_init(&backlog_watcher, backlog_cb);
+        ev_idle_init(&backlog_idle, backlog_idle_cb);
     }
 
-    memset(pass2, 0, strlen(pass2));
-    free(pass2);
+    struct client_session *old = session;
+    session = sess;
 
-    auth_user_add(current_user, pass1, current_data->priv);
+    if(handoff->resume)
+        client_resume(handoff);
+    else if(!tls)
+        client_start();
+    else if(!sess->ssl)
+        client_disconnect();
+    else
+    {
+        client_setup_socket();
+        ev_timer_start(EV_DEFAULT_ &sess->delay_timer);
+    }
 
-    memset(pass1, 0, strlen(pass1));
+    session = old;
 
-    out("Password updated.\n");
+    /* typed while the master was logging it in */
+    if(sess->in_head != sess->in_tail)
+        ev_feed_event(EV_DEFAULT_ &sess->io_watcher, EV_READ);
 
-    return CMD_OK;
+    return sess;
 }
 
-static const struct client_cmd {
-    const char *cmd;
-    int (*cb)(char **saveptr);
-    bool admin_only;
-} cmds[] = {
-    {  "USER",       user_cb,       true   },
-    {  "CLIENT",     client_cb,     true   },
-    {  "EXIT",       quit_cb,       false  },
-    {  "QUIT",       quit_cb,       false  },
-    {  "SAY",        say_cb,        false  },
-    {  "DATE",       date_cb,       false  },
-    {  "LOGOUT",     logout_cb,     false  },
-    {  "LOOK",       look_cb,       false  },
-    {  "INVENTORY",  inventory_cb,  false  },
-    {  "TAKE",       take_cb,       false  },
-    {  "WAIT",       wait_cb,       true   },
-    {  "GO",         go_cb,         false  },
-    {  "DROP",       drop_cb,       false  },
-    {  "CHPASS",     chpass_cb,     false  },
-};
-
-static void *cmd_map = NULL;
-
-void client_init(void)
+/* io_uring: a freed session's output hasn't gone out in time, so
+ * its requests are made to finish */
+static void client_close_timeout_cb(EV_P_ ev_timer *w, int revents)
 {
-    cmd_map = hash_init(ARRAYLEN(cmds), hash_djb, compare_strings);
-    hash_insert_pairs(cmd_map, (const struct hash_pair*)cmds, sizeof(cmds[0]), ARRAYLEN(cmds));
-}
+    (void) EV_A;
+    (void) revents;
 
-void client_shutdown(void)
-{
-    hash_free(cmd_map);
-    cmd_map = NULL;
+    struct client_session *sess = w->data;
+    shutdown(sess->fd, SHUT_RDWR);
+    uring_cancel(&sess->send_op);
+    uring_cancel(&sess->recv_op);
 }
 
-void client_main(int fd, struct sockaddr_in *addr, int total, int to, int from)
+void client_free(struct client_session *sess)
 {
-    client_fd = fd;
-    to_parent = to;
-    from_parent = from;
+    /* the master's forgotten about it, if it was ever told */
+    sess->closing = true;
 
-    output_locked = 0;
-
-    telnet_init();
+    ev_io_stop(EV_DEFAULT_ &sess->io_watcher);
+    ev_io_stop(EV_DEFAULT_ &sess->out_watcher);
+    ev_timer_stop(EV_DEFAULT_ &sess->delay_timer);
+    auth_cancel(sess->auth_job);
+    sess->auth_job = NULL;
 
-    char *ip = inet_ntoa(addr->sin_addr);
-    debugf("== New client %s ==\n", ip);
-    debugf("Total clients: %d\n", total);
+    struct client_session *old = session;
+    session = sess;
+    dialog_end();
+    session = old;
 
-auth:
+    if(mux_sessions)
+        hash_remove(mux_sessions, &sess->pid);
 
-    out("NetCosm " NETCOSM_VERSION "\n");
-    if(total > 1)
-        out("%d clients connected.\n", total);
-    else
-        out("%d client connected.\n", total);
+    if(sess->out_queued)
+    {
+        struct client_session **iter = &dirty_sessions;
+        while(*iter != sess)
+            iter = &(*iter)->next_dirty;
+        *iter = sess->next_dirty;
+    }
+    if(sess->backlogged)
+    {
+        struct client_session **iter = &backlog;
+        while(*iter != sess)
+            iter = &(*iter)->next_backlog;
+        *iter = sess->next_backlog;
+    }
+    if(sess->authed)
+    {
+        struct client_session **iter = &authed_sessions;
+        while(*iter != sess)
+            iter = &(*iter)->next_authed;
+        *iter = sess->next_authed;
+    }
+    if(sess->zstream)
+        compress_end(sess);
+    else if(sess->outlen)
+        flush_session(sess, NULL, 0);
+
+    /* the kernel mustn't be left with our buffers, so the session
+     * lingers until its requests are done; what's left to send gets a
+     * little while to go out, like in the forked modes */
+    if(sess->uring && uring_running())
+    {
+        uring_cancel(&sess->recv_op);
+        if(sess->recv_op.pending || sess->send_op.pending)
+        {
+            sess->freeing = true;
+            sess->next_closed = freeing_sessions;
+            freeing_sessions = sess;
+
+            ev_set_cb(&sess->delay_timer, client_close_timeout_cb);
+            ev_timer_set(&sess->delay_timer, CLIENT_CLOSE_TIMEOUT / 1000.0, 0);
+            ev_timer_start(EV_DEFAULT_ &sess->delay_timer);
+            return;
+        }
+    }
 
-    out("\nPlease authenticate to continue.\n\n");
+    client_free_done(sess);
+}
 
-    int failures = 0;
+void client_forget(struct client_session *sess)
+{
+    /* freeing it mustn't write to the client either */
+    close(sess->fd);
+    sess->fd = -1;
+    sess->slow = true;
+}
 
-    int authlevel;
-    struct userdata_t *current_data = NULL;
+void client_forked(void)
+{
+    dirty_sessions = closed_sessions = backlog = authed_sessions = NULL;
 
-    client_change_state(STATE_AUTH);
+    /* these belonged to the master's loop, which is gone */
+    ev_prepare_init(&flush_watcher, flush_cb);
+}
 
-    /* auth loop */
-    while(1)
+/* whatever's still queued is lost, we can't wait for it here */
+static void client_free_done(struct client_session *sess)
+{
+    if(sess->freeing)
     {
-        out("login: ");
+        struct client_session **iter = &freeing_sessions;
+        while(*iter != sess)
+            iter = &(*iter)->next_closed;
+        *iter = sess->next_closed;
 
-        current_user = client_read();
-        remove_cruft(current_user);
+        ev_timer_stop(EV_DEFAULT_ &sess->delay_timer);
+    }
 
-        out("Password: ");
+    tls_close(sess->ssl);
+    close(sess->fd);
+    free(sess->queue);
+    free(sess->sending);
+    free(sess->stash);
+    free(sess->user);
+    free(sess);
+}
 
-        char *pass = client_read_password();
+struct client_session *client_lookup(pid_t id)
+{
+    return mux_sessions ? hash_lookup(mux_sessions, &id) : NULL;
+}
 
-        client_change_state(STATE_CHECKING);
+/*** mux mode ***/
 
-        current_data = auth_check(current_user, pass);
+static SIMP_HASH(pid_t, id_hash);
+static SIMP_EQUAL(pid_t, id_equal);
 
-        memset(pass, 0, strlen(pass));
-        free(pass);
+/* the master hands us a new client */
+static void worker_ctl_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) EV_A;
+    (void) revents;
 
-        if(current_data)
-        {
-            out("Last login: %s", ctime(&current_data->last_login));
-            current_data->last_login = time(0);
-            authlevel = current_data->priv;
-            userdb_request_add(current_data);
-            break;
-        }
-        else
-        {
-            client_change_state(STATE_FAILED);
-            free(current_user);
-            current_user = NULL;
-            out("Login incorrect\n\n");
-            if(++failures >= MAX_FAILURES)
-                return;
-        }
-    }
+    struct handoff handoff;
+    int sock = recv_fd(w->fd, &handoff, sizeof(handoff));
 
-    /* something has gone wrong, but we are here for some reason */
-    if(authlevel == PRIV_NONE)
-        return;
+    /* master went away */
+    if(sock < 0)
+        exit(0);
 
-    are_admin = (authlevel == PRIV_ADMIN);
-    if(are_admin)
-        client_change_state(STATE_ADMIN);
-    else
-        client_change_state(STATE_LOGGEDIN);
+    client_new(sock, &handoff, NULL);
+}
 
-    /* authenticated, begin main command loop */
-    debugf("Client %s: authenticated as %s.\n", ip, current_user);
-    client_change_user(current_user);
-    current_room = 0;
+/* packets from the master which nobody is waiting on */
+static void worker_master_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) EV_A;
+    (void) revents;
 
-    client_change_room(current_room);
+    poll_requests(w->fd, worker_shm);
+}
 
-    client_look();
+static void worker_reap_cb(EV_P_ ev_prepare *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
 
-    while(1)
+    struct client_session *sess;
+    while((sess = client_next_closed()))
     {
-        if(!child_rawmode)
-            out(">> ");
-        char *line = client_read();
-        char *orig = strdup(line);
-        char *save = NULL;
+        /* the master's already dropped those it took back */
+        session = sess;
+        if(!sess->handed_back)
+            client_report_disconnect();
+        session = NULL;
 
-        if(!child_rawmode)
-        {
-            char *tok = strtok_r(line, WSPACE, &save);
+        client_free(sess);
+    }
+}
 
-            if(!tok)
-                goto next_cmd;
+void client_worker_main(int ctlsock, int to, int from, struct ipc_shm *shm)
+{
+    worker_to_parent = to;
+    worker_from_parent = from;
+    worker_ctlsock = ctlsock;
+    worker_shm = shm;
 
-            all_upper(tok);
+    mux_sessions = hash_init(16, id_hash, id_equal);
 
-            const struct client_cmd *cmd = hash_lookup(cmd_map, tok);
-            if(cmd && cmd->cb && (!cmd->admin_only || (cmd->admin_only && are_admin)))
-            {
-                int ret = cmd->cb(&save);
-                switch(ret)
-                {
-                case CMD_OK:
-                    goto next_cmd;
-                case CMD_LOGOUT:
-                    free(line);
-                    free(orig);
-                    goto auth;
-                case CMD_QUIT:
-                    free(line);
-                    free(orig);
-                    goto done;
-                default:
-                    error("client: bad callback return value");
-                }
-            }
-            else if(cmd && cmd->admin_only && !are_admin)
-            {
-                out("You are not allowed to do that.\n");
-                goto next_cmd;
-            }
-        }
+    /* we only read from the master when there's something there */
+    fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
 
-        /* if we can't handle it, let the master process try */
-        send_master(REQ_EXECVERB, orig, strlen(orig) + 1);
+    struct ev_loop *loop = ev_default_loop(0);
 
-    next_cmd:
+    ev_io ctl_watcher, master_watcher;
+    ev_prepare reap_watcher;
 
-        free(line);
-        free(orig);
-    }
+    ev_io_init(&ctl_watcher, worker_ctl_cb, ctlsock, EV_READ);
+    ev_io_start(EV_A_ &ctl_watcher);
+
+    ev_io_init(&master_watcher, worker_master_cb, from, EV_READ);
+    ev_io_start(EV_A_ &master_watcher);
+
+    ev_prepare_init(&reap_watcher, worker_reap_cb);
+    ev_prepare_start(EV_A_ &reap_watcher);
 
-done:
-    free(current_user);
-    current_user = NULL;
+    ev_loop(loop, 0);
 }
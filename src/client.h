@@ -21,18 +21,268 @@
 
 #include "globals.h"
 
-extern int client_fd, to_parent, from_parent;
-extern bool are_admin;
-extern bool child_rawmode;
+#include "client_reqs.h"
+#include "telnet.h"
+#include "uring.h"
 
-/* call from child process ONLY */
+struct child_data;
+struct handoff;
+struct ipc_shm;
+struct parked_state;
+
+/* longest line of input, plus one; longer ones are split */
+#define CLIENT_READ_SZ 128
+
+/* input waiting to be handled, a power of two */
+#define CLIENT_IN_SZ 1024
+
+/* event and mux modes: most lines one session gets handled before the
+ * others get a turn */
+#define CLIENT_TICK_LINES 4
+
+/* output is held until the session waits for input, or until there's
+ * this much of it... */
+#define CLIENT_OUT_SZ 4096
+
+/* ...or the oldest of it has waited this many milliseconds, which
+ * long broadcasts and slow requests can take */
+#define CLIENT_OUT_LATENCY 50
+
+/* output the client hasn't taken yet is queued; past the first limit,
+ * broadcasts to it are dropped, and past the second it's disconnected
+ * (see -o) */
+#define DEFAULT_QUEUE_DROP (16 * 1024)
+#define DEFAULT_QUEUE_MAX  (64 * 1024)
+
+/* forked modes: how long to wait for queued output to go out before
+ * exiting */
+#define CLIENT_CLOSE_TIMEOUT 1000
+
+/* how long a client from the TLS port gets to shake hands, in ms */
+#define CLIENT_HANDSHAKE_TIMEOUT 10000
+
+/* everything a client needs to serve a connection */
+/* in the forked modes, each process has exactly one of these */
+struct client_session {
+    int      fd;
+
+    /* pipes to and from the master, unused in event mode */
+    int      to_parent, from_parent;
+
+    /* ring buffers to and from the master, NULL if using pipes; if
+     * set, the pipes are eventfds for wakeups */
+    struct ipc_shm *shm;
+
+    /* what the master knows us as */
+    pid_t    pid;
+
+    struct in_addr addr;
+
+    /* number of clients connected when we connected, for the banner */
+    int      nclients;
+
+    /* came in on the TLS port, see tls.h; all I/O goes through it */
+    SSL      *ssl;
+
+    /* forked modes: for handing the client back when hibernating or
+     * restarting; see client_hibernate() */
+    int      ctlsock;
+    time_t   last_input;
+
+    /* user state */
+    char     *user;
+    bool     admin;
+    bool     rawmode;
+
+    /* telnet state */
+    uint16_t term_width, term_height;
+    struct telnet_state telnet;
+
+    /* line wrapping state for out() */
+    int      out_pos;
+
+    /* output which hasn't been written yet, see out_raw() */
+    char     outbuf[CLIENT_OUT_SZ];
+    size_t   outlen;
+    uint64_t out_since; /* in ms, when outbuf stopped being empty */
+    bool     out_queued;
+    struct client_session *next_dirty;
+
+    /* written output the socket didn't take, see write_iov() */
+    char     *queue;
+    size_t   qoff, qlen, qsize;
+    size_t   q_reported;  /* last depth sent with REQ_OUTQUEUE */
+    unsigned dropped;     /* broadcasts dropped since the last one shown */
+    bool     slow;        /* disconnected for not reading */
+    ev_io    out_watcher; /* event and mux modes */
+
+    /* GMCP_* flags, see client_set_gmcp() */
+    unsigned char gmcp;
+
+    /* MCCP2, once the client's agreed to it; see client_compress_start() */
+    z_stream *zstream;
+    uint64_t  z_in, z_out;  /* bytes before and after */
+    uint64_t  z_cpu;        /* ns spent in deflate() */
+
+    /* input with telnet commands stripped out, including any partial
+     * line; a ring, the indices only ever go up */
+    char     inbuf[CLIENT_IN_SZ];
+    unsigned in_head, in_tail;
+
+    /* the line being handled, see client_next_line() */
+    char     line[CLIENT_READ_SZ];
+
+    /* event and mux modes: has complete lines past its budget, see
+     * client_run_lines() */
+    bool     backlogged;
+    struct client_session *next_backlog;
+
+    /* called with the next line of input */
+    void     (*line_cb)(char *line);
+    bool     line_secret;
+
+    /* state for prompts spanning several lines */
+    int      failures;
+    char     *dialog_user, *dialog_pass;
+    int      dialog_priv;
+
+    /* for rate-limiting */
+    int      reqs_since_ts;
+    time_t   ts;
+
+    /* requests to the master: the last one sent and the last one
+     * completed, and the replies to those in between */
+    reqid_t  last_sent, last_done;
+    struct completion cq[MAX_INFLIGHT];
+
+    bool     closing;
+
+    /* event and mux modes */
+    struct child_data *child; /* sessions the master serves only */
+    ev_io    io_watcher;
+    ev_timer delay_timer;
+    void     (*delay_cb)(void);
+    struct client_session *next_closed;
+
+    /* a password being checked, see client_check_pass() */
+    struct auth_job *auth_job;
+    struct userdata_t *auth_data;
+
+    /* event mode with -u: the socket's read and written through
+     * io_uring, and io_watcher is only fed events, never started; see
+     * client_input_start() */
+    bool     uring;
+    bool     reading;       /* as io_watcher would be active */
+    struct uring_op recv_op, send_op;
+    char     *stash;        /* received, not yet read */
+    size_t   stash_off, stash_len, stash_size;
+    bool     stash_eof;
+    char     *sending;      /* in flight, swapped with queue */
+    size_t   send_off, send_len, send_size;
+    bool     freeing;       /* freed, but for its requests in flight */
+
+    /* being handed back to the master, see client_detach(): nothing
+     * more is received, and its MCCP stream has been ended already */
+    bool     detaching;
+    bool     detach_mccp;
+
+    /* mux mode: handed back, so the master's forgotten it already */
+    bool     handed_back;
+
+    /* forked and mux modes: logged in by the master, and waiting to be
+     * handed on, see client_next_authed(); nothing more is read */
+    bool     authed;
+    struct client_session *next_authed;
+};
+
+/* the session currently being served */
+extern struct client_session *session;
+
+/* output queue limits in bytes, see DEFAULT_QUEUE_DROP */
+extern size_t client_queue_drop, client_queue_max;
+
+/* true if broadcasts to the current session should be dropped */
+bool client_congested(void);
+
+/* writes as much of the current session's queued output as it'll take */
+void client_drain(void);
+
+/* call from a client session ONLY */
 void send_master(unsigned char cmd, const void *data, size_t sz);
 
 void out(const char *fmt, ...) __attribute__((format(printf,1,2)));
 void out_raw(const void*, size_t);
 
-/* called for every client */
-void client_main(int sock, struct sockaddr_in *addr, int, int to_parent, int from_parent);
+/* prints a room description; its wrapped form is kept for next time,
+ * until the version changes */
+void out_desc(room_id room, uint32_t version, const char *desc);
+
+/* writes out the current session's held output */
+void client_flush(void);
+
+/* writes out held output which is past CLIENT_OUT_LATENCY, and returns
+ * how many ms until more will be, or -1 if there's none; for poll() */
+int client_flush_due(void);
+
+/* MCCP2: compresses all output from here on, or stops doing so */
+void client_compress_start(void);
+void client_compress_end(void);
+
+/* called for every client in the forked modes; hibernating and
+ * restarting sessions hand their client back over ctlsock */
+void client_main(int sock, const struct handoff *handoff, int ctlsock,
+                 int to_parent, int from_parent, struct ipc_shm *shm);
+
+/* forked modes: hands the client back to the master and exits, if
+ * it's been idle at the prompt for at least idle seconds */
+void client_hibernate(int idle);
+
+/* forked and mux modes: the master is restarting, so hands the client
+ * back for the new one to resume, or to start over if it hasn't
+ * logged in; forked children then exit */
+void client_restart(void);
+
+/* the master: the same for a session it serves itself; fills
+ * in the part of state only the session knows, and returns the
+ * client's socket, which the session no longer owns, or -1 if it
+ * can't be handed back yet */
+int client_release(struct client_session *sess, struct parked_state *state);
+
+/* the master: the restart's off, so a session which wasn't handed
+ * back carries on as it was */
+void client_restart_abort(struct client_session *sess);
+
+/* event and mux modes, and the master logging clients in: serve a
+ * client from the current event loop, as described by handoff; child
+ * is the master's data if we're the master, NULL otherwise */
+struct client_session *client_new(int sock, const struct handoff *handoff,
+                                  struct child_data *child);
+void client_free(struct client_session *sess);
+
+/* sessions which have disconnected since the last call */
+struct client_session *client_next_closed(void);
+
+/* forked and mux modes: the master only serves a client until it's
+ * logged in. Returns the socket of the next one to have done so, which
+ * its session no longer owns, or -1 if none are ready to go yet; fills
+ * in handoff for whatever serves it next, but for the address and
+ * client count, and sets *child to the master's data for it */
+int client_next_authed(struct handoff *handoff, struct child_data **child);
+
+/* in a new child: drops the master's sessions without a word to their
+ * clients, see child_startup(); client_forget() for each, then
+ * client_forked() once they're all freed or forgotten */
+void client_forget(struct client_session *sess);
+void client_forked(void);
+
+/* mux mode: serve clients handed over ctlsock until the master dies */
+void client_worker_main(int ctlsock, int to_parent, int from_parent, struct ipc_shm *shm);
+
+/* mux mode: find one of this worker's sessions */
+struct client_session *client_lookup(pid_t id);
+
+/* drop the current client */
+void client_disconnect(void);
 
 /* can (and should) be called before forking the child */
 void client_init(void);
@@ -21,33 +21,190 @@
 #include "client.h"
 #include "client_reqs.h"
 #include "hash.h"
+#include "ipc.h"
 
 enum reqdata_typespec reqdata_type = TYPE_NONE;
 union reqdata_t returned_reqdata;
 
-static int request_complete;
+/* the completion queue slot for a reply, NULL if there is none */
+static struct completion *reply_slot(reqid_t id)
+{
+    struct completion *slot = session->cq + id % MAX_INFLIGHT;
+    return (id && slot->id == id) ? slot : NULL;
+}
+
+/* handles one packet from the master */
+static void handle_master_packet(reqid_t id, unsigned char cmd, unsigned char *data, size_t datalen)
+{
+    struct completion *slot = reply_slot(id), dummy;
+    if(!slot)
+        slot = &dummy;
+
+    switch(cmd)
+    {
+    case REQ_RAWMODE:
+    {
+        session->rawmode = !session->rawmode;
+        break;
+    }
+    case REQ_BCASTMSG:
+    {
+        /* a broadcast, not a reply: the client can live without it */
+        if(!id && client_congested())
+        {
+            ++session->dropped;
+            break;
+        }
+        out("%s", (char*)data);
+        break;
+    }
+    case REQ_GETROOMDESC:
+    {
+        room_id room;
+        uint32_t version;
+        size_t hdr = sizeof(room) + sizeof(version);
+        if(datalen < hdr)
+            break;
+
+        memcpy(&room, data, sizeof(room));
+        memcpy(&version, data + sizeof(room), sizeof(version));
+        out_desc(room, version, (char*)data + hdr);
+        break;
+    }
+    case REQ_GMCP:
+    {
+        if(session->gmcp & GMCP_ON)
+            telnet_send_gmcp((char*)data, datalen);
+        break;
+    }
+    case REQ_HIBERNATE:
+    {
+        int idle;
+        if(datalen == sizeof(idle))
+        {
+            memcpy(&idle, data, sizeof(idle));
+            client_hibernate(idle);
+        }
+        break;
+    }
+    case REQ_RESTART:
+        client_restart();
+        break;
+    case REQ_KICK:
+    {
+        out("%s", (char*)data);
+        client_disconnect();
+        break;
+    }
+    case REQ_MOVE:
+    {
+        int status = *((int*)data);
+
+        slot->type = TYPE_BOOLEAN;
+        slot->data.boolean = (status == 1);
+        break;
+    }
+    case REQ_GETUSERDATA:
+    {
+        if(datalen == sizeof(struct userdata_t))
+            slot->type = TYPE_USERDATA;
+        else
+            break;
 
-/* for rate-limiting */
-static int reqs_since_ts;
-static time_t ts = 0;
+        struct userdata_t *user = &slot->data.userdata;
+        *user = *((struct userdata_t*)data);
+        break;
+    }
+    case REQ_DELUSERDATA:
+    {
+        slot->type = TYPE_BOOLEAN;
+        slot->data.boolean = *((bool*)data);
+        break;
+    }
+    case REQ_ADDUSERDATA:
+    {
+        slot->type = TYPE_BOOLEAN;
+        slot->data.boolean = *((bool*)data);
+        break;
+    }
+    case REQ_NOP:
+        break;
+    case REQ_PRINTNEWLINE:
+    {
+        out("\n");
+        break;
+    }
+    case REQ_ALLDONE:
+        /* replies come in order, so everything before is done too */
+        if(id)
+            session->last_done = id;
+        break;
+    default:
+        debugf("WARNING: client process received unknown code %d\n", cmd);
+        break;
+    }
+}
 
-bool poll_requests(void)
+/* handles one record from a packet */
+static void handle_record(const unsigned char *rec, size_t reclen)
+{
+    /* mux mode: records are prefixed by the session they're for */
+    size_t sid_len = (server_mode == MODE_MUX) ? sizeof(pid_t) : 0;
+    size_t hdr = sid_len + sizeof(reqid_t);
+
+    if(reclen < hdr + 1)
+        return;
+
+    reqid_t id;
+    memcpy(&id, rec + sid_len, sizeof(id));
+
+    unsigned char cmd = rec[hdr];
+
+    struct client_session *sess = session;
+    if(sid_len)
+    {
+        pid_t sid;
+        memcpy(&sid, rec, sizeof(sid));
+
+        /* already gone */
+        if(!(sess = client_lookup(sid)))
+            return;
+    }
+
+    /* handlers expect null-terminated data */
+    unsigned char data[MSG_MAX + 1];
+    size_t datalen = reclen - hdr - 1;
+    memcpy(data, rec + hdr + 1, datalen);
+    data[datalen] = '\0';
+
+    if(sess != session)
+    {
+        client_deliver(sess, id, cmd, data, datalen);
+        return;
+    }
+
+    handle_master_packet(id, cmd, data, datalen);
+}
+
+bool poll_requests(int fd, struct ipc_shm *shm)
 {
     if(!are_child)
         return false;
 
     bool got_cmd = false;
 
+    if(shm)
+        ipc_clear(fd);
+
     while(1)
     {
-        unsigned char packet[MSG_MAX + 1];
-        memset(packet, 0, sizeof(packet));
-
-        ssize_t packetlen = read(from_parent, packet, MSG_MAX);
+        unsigned char packet[MSG_MAX];
 
-        unsigned char *data = packet + 1;
-        size_t datalen = packetlen - 1;
-        packet[MSG_MAX] = '\0';
+        ssize_t packetlen;
+        if(shm)
+            packetlen = ipc_recv(shm, IPC_TO_CHILD, packet, MSG_MAX);
+        else
+            packetlen = read(fd, packet, MSG_MAX);
 
         /* no data yet */
         if(packetlen < 0)
@@ -62,70 +219,20 @@ bool poll_requests(void)
 
         got_cmd = true;
 
-        unsigned char cmd = packet[0];
-
-        switch(cmd)
+        /* a packet holds one or more records: | LENGTH | RECORD | */
+        size_t pos = 0;
+        while(pos + sizeof(uint16_t) <= (size_t)packetlen)
         {
-        case REQ_RAWMODE:
-        {
-            child_rawmode = !child_rawmode;
-            break;
-        }
-        case REQ_BCASTMSG:
-        {
-            out((char*)data, datalen);
-            break;
-        }
-        case REQ_KICK:
-
-        {
-            out((char*)data, datalen);
-            exit(EXIT_SUCCESS);
-        }
-        case REQ_MOVE:
-        {
-            int status = *((int*)data);
+            uint16_t reclen;
+            memcpy(&reclen, packet + pos, sizeof(reclen));
+            pos += sizeof(reclen);
 
-            reqdata_type = TYPE_BOOLEAN;
-            returned_reqdata.boolean = (status == 1);
-            break;
-        }
-        case REQ_GETUSERDATA:
-        {
-            if(datalen == sizeof(struct userdata_t))
-                reqdata_type = TYPE_USERDATA;
-            else
+            if(reclen > packetlen - pos)
                 break;
 
-            struct userdata_t *user = &returned_reqdata.userdata;
-            *user = *((struct userdata_t*)data);
-            break;
-        }
-        case REQ_DELUSERDATA:
-        {
-            reqdata_type = TYPE_BOOLEAN;
-            returned_reqdata.boolean = *((bool*)data);
-            break;
-        }
-        case REQ_ADDUSERDATA:
-        {
-            reqdata_type = TYPE_BOOLEAN;
-            returned_reqdata.boolean = *((bool*)data);
-            break;
-        }
-        case REQ_NOP:
-            break;
-        case REQ_PRINTNEWLINE:
-        {
-            out("\n");
-            break;
-        }
-        case REQ_ALLDONE:
-            request_complete = 1;
-            return true;
-        default:
-            debugf("WARNING: client process received unknown code %d\n", cmd);
-            break;
+            handle_record(packet + pos, reclen);
+
+            pos += reclen;
         }
     }
 fail:
@@ -133,71 +240,201 @@ fail:
     return got_cmd;
 }
 
+/* for sessions other than the one (if any) waiting in send_master():
+ * the master calls this in place of writing to a pipe in event mode,
+ * and workers call it for packets addressed to other sessions */
+void client_deliver(struct client_session *sess, reqid_t id, unsigned char cmd,
+                    const void *data, size_t datalen)
+{
+    if(sess->closing)
+        return;
+
+    /* handlers expect null-terminated data, like from poll_requests */
+    unsigned char buf[MSG_MAX + 1];
+    if(datalen > MSG_MAX)
+        datalen = MSG_MAX;
+    if(data)
+        memcpy(buf, data, datalen);
+    else
+        datalen = 0;
+    buf[datalen] = '\0';
+
+    struct client_session *old = session;
+    session = sess;
+
+    handle_master_packet(id, cmd, buf, datalen);
+
+    session = old;
+}
+
 void client_change_state(int state)
 {
-    send_master(REQ_CHANGESTATE, &state, sizeof(state));
+    send_master_oneway(REQ_CHANGESTATE, &state, sizeof(state));
 }
 
 void client_change_user(const char *user)
 {
-    send_master(REQ_CHANGEUSER, user, strlen(user) + 1);
+    send_master_oneway(REQ_CHANGEUSER, user, strlen(user) + 1);
+}
+
+void client_report_queue(size_t depth)
+{
+    send_master_oneway(REQ_OUTQUEUE, &depth, sizeof(depth));
+}
+
+void client_set_gmcp(unsigned char flags)
+{
+    if(flags != session->gmcp)
+    {
+        session->gmcp = flags;
+        send_master_oneway(REQ_GMCP, &flags, sizeof(flags));
+    }
 }
 
 void client_change_room(room_id id)
 {
-    send_master(REQ_SETROOM, &id, sizeof(id));
+    send_master_oneway(REQ_SETROOM, &id, sizeof(id));
 }
 
-void send_master(unsigned char cmd, const void *data, size_t sz)
+static void write_request(reqid_t id, unsigned char cmd, const void *data, size_t sz)
+{
+    pid_t our_pid = session->pid;
+
+    /*
+     * format of child->parent packets:
+     * | PID | REQUEST ID | CMD | DATA |
+     */
+    const size_t hdr = sizeof(pid_t) + sizeof(reqid_t);
+
+    /* pack it all into one write so it's atomic */
+    assert(hdr + 1 + sz <= MSG_MAX);
+    char req[MSG_MAX];
+
+    memcpy(req, &our_pid, sizeof(pid_t));
+    memcpy(req + sizeof(pid_t), &id, sizeof(id));
+    memcpy(req + hdr, &cmd, 1);
+    if(data)
+        memcpy(req + hdr + 1, data, sz);
+
+    if(session->shm)
+    {
+        /* the master would be waiting on a request we'd dropped */
+        if(!ipc_send(session->shm, IPC_TO_MASTER, session->to_parent, req, hdr + 1 + sz,
+                     IPC_SEND_TIMEOUT))
+            error("master isn't reading requests");
+    }
+    else
+        write(session->to_parent, req, hdr + 1 + sz);
+}
+
+/* event mode: we are the master, so skip the pipes entirely */
+static void handle_request_local(reqid_t id, unsigned char cmd, const void *data, size_t sz)
+{
+    unsigned char buf[MSG_MAX + 1];
+    assert(sz <= MSG_MAX);
+    if(sz)
+        memcpy(buf, data, sz);
+    buf[sz] = '\0';
+
+    handle_request(session->child, id, cmd, buf, sz);
+}
+
+reqid_t send_master_async(unsigned char cmd, const void *data, size_t sz)
 {
-    if(!are_admin)
+    /* newlines only keep pipelined output in order, don't count them */
+    if(!session->admin && cmd != REQ_PRINTNEWLINE)
     {
         time_t t = time(NULL);
-        if(ts != t)
+        if(session->ts != t)
         {
-            ts = t;
-            reqs_since_ts = 0;
+            session->ts = t;
+            session->reqs_since_ts = 0;
         }
-        if(reqs_since_ts++ > 10)
+        if(session->reqs_since_ts++ > 10)
         {
             out("Rate limit exceeded.\n");
-            return;
+            return 0;
         }
     }
 
-    request_complete = 0;
+    if(!data)
+        sz = 0;
+
+    reqid_t id = ++session->last_sent;
+    if(!id)
+        id = ++session->last_sent;
+
+    /* the oldest request might still be using this slot */
+    if((int32_t)(id - session->last_done) > MAX_INFLIGHT)
+        client_wait(id - MAX_INFLIGHT);
+
+    struct completion *slot = session->cq + id % MAX_INFLIGHT;
+    slot->id = id;
+    slot->type = TYPE_NONE;
+
+    if(are_child)
+        write_request(id, cmd, data, sz);
+    else
+        handle_request_local(id, cmd, data, sz);
 
-    pid_t our_pid = getpid();
+    return id;
+}
 
+/* one-way requests are bookkeeping that the session itself causes
+ * (login, moving), so they aren't rate limited: dropping one would
+ * leave the master's view of us out of date */
+void send_master_oneway(unsigned char cmd, const void *data, size_t sz)
+{
     if(!data)
         sz = 0;
 
-    /*
-     * format of child->parent packets:
-     * | PID | CMD | DATA |
-     */
-
-    /* pack it all into one write so it's atomic */
-    char *req = malloc(sizeof(pid_t) + 1 + sz);
+    if(are_child)
+        write_request(0, cmd, data, sz);
+    else
+        handle_request_local(0, cmd, data, sz);
+}
 
-    memcpy(req, &our_pid, sizeof(pid_t));
-    memcpy(req + sizeof(pid_t), &cmd, 1);
-    if(data)
-        memcpy(req + sizeof(pid_t) + 1, data, sz);
+void client_wait(reqid_t id)
+{
+    if(!id)
+    {
+        reqdata_type = TYPE_NONE;
+        return;
+    }
 
-    assert(1 + sizeof(pid_t) + sz <= MSG_MAX);
-    write(to_parent, req, 1 + sizeof(pid_t) + sz);
+    if(are_child)
+    {
+        /* poll till we get data */
+        struct pollfd pfd[2];
+        pfd[0].fd = session->from_parent;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = session->fd;
 
-    /* poll till we get data */
-    struct pollfd pfd;
-    pfd.fd = from_parent;
-    pfd.events = POLLIN;
+        while((int32_t)(id - session->last_done) > 0)
+        {
+            /* output held back for too long goes out while we wait,
+             * and so does anything queued once the client takes it */
+            pfd[1].events = session->qlen ? POLLOUT : 0;
+            poll(pfd, 2, client_flush_due());
+            if(pfd[1].revents & POLLOUT)
+                client_drain();
+            poll_requests(session->from_parent, session->shm);
+        }
+    }
 
-    poll(&pfd, 1, -1);
+    struct completion *slot = session->cq + id % MAX_INFLIGHT;
+    reqdata_type = slot->type;
+    returned_reqdata = slot->data;
+}
 
-    while(!request_complete) poll_requests();
+void send_master(unsigned char cmd, const void *data, size_t sz)
+{
+    client_wait(send_master_async(cmd, data, sz));
+}
 
-    free(req);
+void client_report_disconnect(void)
+{
+    send_master_oneway(REQ_DISCONNECT, NULL, 0);
 }
 
 /* freed by server_cleanup */
@@ -205,7 +442,8 @@ void *dir_map = NULL;
 
 bool client_move(const char *dir)
 {
-    const struct dir_pair {
+    /* the map points into this, so it mustn't be on the stack */
+    static const struct dir_pair {
         const char *text;
         enum direction_t val;
     } dirs[] = {
@@ -236,10 +474,10 @@ bool client_move(const char *dir)
     if(!dir_map)
     {
         dir_map = hash_init(ARRAYLEN(dirs), hash_djb, compare_strings);
-        hash_insert_pairs(dir_map, (struct hash_pair*)dirs, sizeof(struct dir_pair), ARRAYLEN(dirs));
+        hash_insert_pairs(dir_map, (const struct hash_pair*)dirs, sizeof(struct dir_pair), ARRAYLEN(dirs));
     }
 
-    struct dir_pair *pair = hash_lookup(dir_map, dir);
+    const struct dir_pair *pair = hash_lookup(dir_map, dir);
     if(pair)
     {
         send_master(REQ_MOVE, &pair->val, sizeof(pair->val));
@@ -257,9 +495,7 @@ bool client_move(const char *dir)
 
 void client_look(void)
 {
-    send_master(REQ_GETROOMNAME, NULL, 0);
-    out("\n");
-    send_master(REQ_GETROOMDESC, NULL, 0);
+    send_master(REQ_LOOK, NULL, 0);
 }
 
 void client_look_at(char *obj)
@@ -33,12 +33,51 @@ union reqdata_t {
     bool boolean;
 };
 
+/* the reply to the request last waited for */
 extern enum reqdata_typespec reqdata_type;
 extern union reqdata_t returned_reqdata;
 
+/* how many requests a session can have in flight at once */
+#define MAX_INFLIGHT 8
+
+/* a slot in a session's completion queue */
+struct completion {
+    reqid_t id;
+    enum reqdata_typespec type;
+    union reqdata_t data;
+};
+
+/* sends a request without waiting for the reply, returns its ID, or
+ * 0 if it was dropped; replies are handled in the order requests
+ * were sent */
+reqid_t send_master_async(unsigned char cmd, const void *data, size_t sz);
+
+/* waits for a request, and all those sent before it, to complete;
+ * its reply is then in reqdata_type and returned_reqdata */
+void client_wait(reqid_t id);
+
+/* sends a one-way request, which the master never acknowledges */
+void send_master_oneway(unsigned char cmd, const void *data, size_t sz);
+
+struct client_session;
+struct ipc_shm;
+
+/* handle a packet from the master in a session other than the current one */
+void client_deliver(struct client_session *sess, reqid_t id, unsigned char cmd,
+                    const void *data, size_t datalen);
+
+/* reads and handles packets from the master until none are left;
+ * fd must be non-blocking */
+bool poll_requests(int fd, struct ipc_shm *shm);
+
+/* mux mode: tell the master the current session has ended, no reply */
+void client_report_disconnect(void);
+
 void client_change_room(room_id id);
 void client_change_user(const char *user);
 void client_change_state(int state);
+void client_report_queue(size_t depth);
+void client_set_gmcp(unsigned char flags);
 bool client_move(const char *dir);
 void client_look(void);
 void client_look_at(char *obj);
@@ -33,6 +33,9 @@ struct hash_node {
     const void *key;
     const void *data;
     struct hash_node *next;
+
+    /* lets hash_iterate() resume from a node alone */
+    struct hash_map *map;
 };
 
 struct hash_map {
@@ -45,6 +48,10 @@ struct hash_map {
     void (*free_data)(void *data);
     void* (*dup_data)(void *data);
     size_t n_entries, used_buckets;
+
+    /* removed nodes, kept for reuse so that a map whose contents
+     * come and go (like a room's occupants) stops allocating */
+    struct hash_node *spare;
 };
 
 #define CHECK_SENTINEL(map) do{if(map && ((struct hash_map*)map)->sentinel!=HASH_SENTINEL)error("hash/multimap mixing");}while(0);
@@ -131,53 +138,66 @@ void hash_free(void *ptr)
                 node = next;
             }
         }
+        while(map->spare)
+        {
+            struct hash_node *next = map->spare->next;
+            free(map->spare);
+            map->spare = next;
+        }
         free(map->table);
         free(map);
     }
 }
 
-void *hash_iterate(void *map, void **saveptr, void **keyptr)
+/* the saved state is just the last node returned, so iterating
+ * allocates nothing, and an abandoned iteration leaks nothing */
+void *hash_iterate(void *ptr, void **saveptr, void **keyptr)
 {
-    struct iterstate_t {
-        struct hash_map *map;
-        struct hash_node *node;
-        unsigned bucket;
-    };
-
-    struct iterstate_t *saved;
+    struct hash_map *map;
+    struct hash_node *node;
+    unsigned bucket;
 
-    if(map)
+    if(ptr)
     {
-        *saveptr = malloc(sizeof(struct iterstate_t));
-        saved = *saveptr;
-
-        saved->map = map;
+        map = ptr;
         CHECK_SENTINEL(map);
-        saved->bucket = 0;
-        saved->node = NULL;
+        bucket = 0;
     }
     else
-        saved = *saveptr;
-
-    for(;saved->bucket < saved->map->table_sz; ++(saved->bucket))
     {
-        do {
-            if(!saved->node)
-                saved->node = saved->map->table[saved->bucket];
-            else
-                saved->node = saved->node->next;
-            if(saved->node)
-            {
-                if(keyptr)
-                    *keyptr = (void*)saved->node->key;
-                return (void*)saved->node->data;
-            }
-        } while(saved->node);
+        node = *saveptr;
+
+        /* already finished */
+        if(!node)
+            return NULL;
+
+        if(node->next)
+        {
+            node = node->next;
+            goto found;
+        }
+
+        map = node->map;
+        bucket = map->hash(node->key) % map->table_sz + 1;
     }
 
-    free(saved);
+    for(; bucket < map->table_sz; ++bucket)
+    {
+        if(map->table[bucket])
+        {
+            node = map->table[bucket];
+            goto found;
+        }
+    }
 
+    *saveptr = NULL;
     return NULL;
+
+found:
+    *saveptr = node;
+    if(keyptr)
+        *keyptr = (void*)node->key;
+    return (void*)node->data;
 }
 
 /* 75% */
@@ -187,10 +207,15 @@ static void hash_internal_insert_new(const void *key, const void *data, struct h
                                      unsigned hash, struct hash_node *last)
 {
     /* insert */
-    struct hash_node *new = calloc(sizeof(struct hash_node), 1);
+    struct hash_node *new = map->spare;
+    if(new)
+        map->spare = new->next;
+    else
+        new = calloc(sizeof(struct hash_node), 1);
     new->key = key;
     new->data = data;
     new->next = NULL;
+    new->map = map;
     ++map->n_entries;
     if(!last)
     {
@@ -333,7 +358,8 @@ bool hash_remove(void *ptr, const void *key)
 
                 --map->n_entries;
 
-                free(iter);
+                iter->next = map->spare;
+                map->spare = iter;
 
                 return true;
             }
@@ -394,7 +420,8 @@ void hash_del_internal_node(void *ptr, const struct hash_export_node *node)
                 map->free_data((void*)node_val->data);
             if(map->free_key)
                 map->free_key((void*)node_val->key);
-            free(node_val);
+            node_val->next = map->spare;
+            map->spare = node_val;
 
             if(node->last)
                 ((struct hash_node*)node->last)->next = node->next;
@@ -453,6 +480,7 @@ void *hash_dup(void *ptr)
         ret->table = calloc(ret->table_sz, sizeof(struct hash_node*));
         ret->used_buckets = 0;
         ret->n_entries = 0;
+        ret->spare = NULL;
 
         void *save = NULL;
         while(1)
@@ -65,9 +65,8 @@ bool hash_remove(void *ptr, const void *key);
 /*
  * use like you would strtok_r
  *
- * allocates a buffer that's freed once all elements are processed if
- * you must stop iteration without processing every element,
- * free(*saved)
+ * allocates nothing, so iteration can be stopped at any point; the
+ * map must not be changed while it's being iterated over
  *
  * if keyptr!=NULL, the key pointer will be saved to *keyptr
  */
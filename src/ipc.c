@@ -0,0 +1,149 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "globals.h"
+
+#include "ipc.h"
+
+struct ipc_ring {
+    /* free-running counters, each written by only one side; on
+     * separate cache lines so the two sides don't fight over them */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+
+    unsigned char data[IPC_RING_SZ] __attribute__((aligned(64)));
+};
+
+struct ipc_shm {
+    struct ipc_ring ring[2];
+};
+
+/* packets are stored as | LENGTH | DATA |, and may wrap around */
+typedef uint16_t ipc_len_t;
+
+struct ipc_shm *ipc_shm_new(int up[2], int down[2])
+{
+    struct ipc_shm *shm = mmap(NULL, sizeof(struct ipc_shm), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shm == MAP_FAILED)
+        return NULL;
+
+    up[0] = eventfd(0, EFD_NONBLOCK);
+    down[0] = eventfd(0, EFD_NONBLOCK);
+    if(up[0] < 0 || down[0] < 0)
+    {
+        if(up[0] >= 0)
+            close(up[0]);
+        if(down[0] >= 0)
+            close(down[0]);
+        munmap(shm, sizeof(struct ipc_shm));
+        return NULL;
+    }
+
+    up[1] = dup(up[0]);
+    down[1] = dup(down[0]);
+
+    return shm;
+}
+
+void ipc_shm_free(struct ipc_shm *shm)
+{
+    munmap(shm, sizeof(struct ipc_shm));
+}
+
+static void ring_copy_in(struct ipc_ring *ring, uint32_t pos, const void *buf, size_t len)
+{
+    pos &= IPC_RING_SZ - 1;
+    size_t first = MIN(len, IPC_RING_SZ - pos);
+    memcpy(ring->data + pos, buf, first);
+    memcpy(ring->data, (const char*)buf + first, len - first);
+}
+
+static void ring_copy_out(struct ipc_ring *ring, uint32_t pos, void *buf, size_t len)
+{
+    pos &= IPC_RING_SZ - 1;
+    size_t first = MIN(len, IPC_RING_SZ - pos);
+    memcpy(buf, ring->data + pos, first);
+    memcpy((char*)buf + first, ring->data, len - first);
+}
+
+bool ipc_send(struct ipc_shm *shm, enum ipc_dir dir, int efd,
+              const void *buf, size_t len, int timeout)
+{
+    struct ipc_ring *ring = shm->ring + dir;
+    ipc_len_t pktlen = len;
+    size_t need = sizeof(pktlen) + len;
+
+    assert(len <= MSG_MAX);
+
+    uint32_t head = ring->head;
+
+    /* full: make sure the reader is awake and wait for it, 100us at
+     * a time */
+    for(int waited = 0;
+        IPC_RING_SZ - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < need;
+        ++waited)
+    {
+        uint64_t one = 1;
+        write(efd, &one, sizeof(one));
+        if(waited >= timeout * 10)
+            return false;
+        usleep(100);
+    }
+
+    ring_copy_in(ring, head, &pktlen, sizeof(pktlen));
+    ring_copy_in(ring, head + sizeof(pktlen), buf, len);
+
+    /* both of these must be sequentially consistent: either we see
+     * that the reader has emptied the ring and wake it, or it sees
+     * our packet before going to sleep */
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+    {
+        uint64_t one = 1;
+        write(efd, &one, sizeof(one));
+    }
+
+    return true;
+}
+
+ssize_t ipc_recv(struct ipc_shm *shm, enum ipc_dir dir, void *buf, size_t max)
+{
+    struct ipc_ring *ring = shm->ring + dir;
+
+    uint32_t tail = ring->tail;
+
+    if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+        return -1;
+
+    ipc_len_t pktlen;
+    ring_copy_out(ring, tail, &pktlen, sizeof(pktlen));
+    ring_copy_out(ring, tail + sizeof(pktlen), buf, MIN(pktlen, max));
+
+    __atomic_store_n(&ring->tail, tail + sizeof(pktlen) + pktlen, __ATOMIC_SEQ_CST);
+
+    return MIN(pktlen, max);
+}
+
+void ipc_clear(int efd)
+{
+    uint64_t n;
+    read(efd, &n, sizeof(n));
+}
@@ -0,0 +1,60 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* You should use #pragma once everywhere. */
+#pragma once
+
+#include "globals.h"
+
+/*
+ * Shared memory IPC between the master and a single child: a pair of
+ * single-producer, single-consumer ring buffers, one in each
+ * direction. A packet costs no syscalls unless the reader might be
+ * asleep, in which case it is woken with an eventfd.
+ */
+
+#define IPC_RING_SZ (64 * 1024) /* must be a power of two */
+
+enum ipc_dir { IPC_TO_MASTER = 0, IPC_TO_CHILD };
+
+struct ipc_shm;
+
+/* maps a new region and creates an eventfd for each direction; the
+ * eventfds are dup'd into both ends of up and down so they can be
+ * closed like pipes. Returns NULL on failure. */
+struct ipc_shm *ipc_shm_new(int up[2], int down[2]);
+void ipc_shm_free(struct ipc_shm *shm);
+
+/* a child waits this long, in ms, for the master to make room; the
+ * master holds back up to IPC_SPILL_MAX bytes for a child instead, and
+ * gives up on it once it's made no room for as long */
+#define IPC_SEND_TIMEOUT 10000
+#define IPC_SPILL_MAX (4 * 1024 * 1024)
+
+/* queues a packet, waking the reader with efd if needed; if the ring
+ * is full, waits up to timeout ms for space. Returns false if there
+ * still isn't any, and the packet's dropped. */
+bool ipc_send(struct ipc_shm *shm, enum ipc_dir dir, int efd,
+              const void *buf, size_t len, int timeout);
+
+/* dequeues a packet of at most max bytes, returns -1 if there is none */
+ssize_t ipc_recv(struct ipc_shm *shm, enum ipc_dir dir, void *buf, size_t max);
+
+/* call before draining a ring with ipc_recv() */
+void ipc_clear(int efd);
@@ -27,6 +27,7 @@ struct multimap_node {
     struct multimap_list *list;
     size_t n_pairs;
     struct multimap_t *map;
+    struct multimap_node *next_spare;
 };
 
 struct multimap_t {
@@ -41,8 +42,29 @@ struct multimap_t {
     void (*free_data)(void*);
     void (*free_key)(void*);
     void *(*dup_data)(void*);
+
+    /* freed nodes and pairs are kept for reuse, like the hash map's
+     * nodes, so taking and dropping things doesn't touch the heap */
+    struct multimap_node *spare_nodes;
+    struct multimap_list *spare_pairs;
 };
 
+static struct multimap_list *new_pair(struct multimap_t *map)
+{
+    struct multimap_list *pair = map->spare_pairs;
+    if(pair)
+        map->spare_pairs = pair->next;
+    else
+        pair = malloc(sizeof(*pair));
+    return pair;
+}
+
+static void free_pair(struct multimap_t *map, struct multimap_list *pair)
+{
+    pair->next = map->spare_pairs;
+    map->spare_pairs = pair;
+}
+
 static void free_node(void *ptr)
 {
     struct multimap_node *node = ptr;
@@ -55,10 +77,11 @@ static void free_node(void *ptr)
             node->map->free_data(iter->val);
         if(node->map->free_key)
             node->map->free_key((void*)iter->key);
-        free(iter);
+        free_pair(node->map, iter);
         iter = next;
     }
-    free(node);
+    node->next_spare = node->map->spare_nodes;
+    node->map->spare_nodes = node;
 }
 
 static void *dup_node(void *ptr)
@@ -108,6 +131,18 @@ void multimap_free(void *ptr)
         if(!(--map->refcount))
         {
             hash_free(map->hash_tab);
+            while(map->spare_nodes)
+            {
+                struct multimap_node *next = map->spare_nodes->next_spare;
+                free(map->spare_nodes);
+                map->spare_nodes = next;
+            }
+            while(map->spare_pairs)
+            {
+                struct multimap_list *next = map->spare_pairs->next;
+                free(map->spare_pairs);
+                map->spare_pairs = next;
+            }
             free(map);
         }
     }
@@ -148,11 +183,16 @@ bool multimap_insert(void *ptr, const void *key, const void *val)
         struct multimap_node *node = hash_lookup(map->hash_tab, key);
         if(!node)
         {
-            node = calloc(1, sizeof(struct multimap_node));
+            node = map->spare_nodes;
+            if(node)
+                map->spare_nodes = node->next_spare;
+            else
+                node = malloc(sizeof(struct multimap_node));
 
             node->map = map;
+            node->next_spare = NULL;
 
-            node->list = calloc(1, sizeof(struct multimap_list));
+            node->list = new_pair(map);
             node->list->key = key;
             node->list->val = (void*)val;
             node->list->next = NULL;
@@ -166,7 +206,7 @@ bool multimap_insert(void *ptr, const void *key, const void *val)
         }
         else
         {
-            struct multimap_list *new = calloc(1, sizeof(struct multimap_list));
+            struct multimap_list *new = new_pair(map);
             new->key = key;
             new->val = (void*)val;
             new->next = node->list;
@@ -216,7 +256,7 @@ size_t multimap_delete(void *ptr, const void *key, const void *val)
                 else
                     node->list = next;
 
-                free(iter);
+                free_pair(map, iter);
 
                 ++deleted;
                 --node->n_pairs;
@@ -344,6 +384,8 @@ void *multimap_copy(void *ptr)
 
         ret->hash_tab = hash_dup(map->hash_tab);
         ret->refcount = 1;
+        ret->spare_nodes = NULL;
+        ret->spare_pairs = NULL;
 
         /* iterate and replace each node's *map pointer */
         void *map_ptr = ret->hash_tab, *save;
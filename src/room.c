@@ -21,6 +21,7 @@
 #include "hash.h"
 #include "multimap.h"
 #include "server.h"
+#include "server_reqs.h"
 #include "room.h"
 #include "userdb.h"
 #include "world.h"
@@ -38,9 +39,10 @@ bool room_user_add(room_id id, struct child_data *child)
     if(child->user)
     {
         /* hash_insert returns NULL on success */
-        bool ret = !hash_insert(room->users, child->user, child);
+        bool ret = !hash_insert(room->users, &child->pid, child);
         if(room->data.hook_enter)
             room->data.hook_enter(id, child);
+        send_gmcp_enter(id, child);
         return ret;
     }
     else
@@ -53,9 +55,10 @@ bool room_user_del(room_id id, struct child_data *child)
 
     if(child->user)
     {
-        bool ret = hash_remove(room->users, child->user);
+        bool ret = hash_remove(room->users, &child->pid);
         if(room->data.hook_leave)
             room->data.hook_leave(id, child);
+        send_gmcp_leave(id, child);
         return ret;
     }
     else
@@ -90,6 +93,14 @@ void room_free(struct room_t *room)
     free(room->data.desc);
 }
 
+void room_set_desc(room_id id, const char *desc)
+{
+    struct room_t *room = room_get(id);
+    free(room->data.desc);
+    room->data.desc = strdup(desc);
+    ++room->desc_version;
+}
+
 bool room_obj_add(room_id room, struct object_t *obj)
 {
     bool status = true;
@@ -211,10 +222,13 @@ bool room_obj_del(room_id room, const char *name)
 #define OBJMAP_SIZE 8
 #define VERBMAP_SZ 8
 
+static SIMP_HASH(pid_t, pid_hash);
+static SIMP_EQUAL(pid_t, pid_equal);
+
 /* initialize the room's hash tables */
 void room_init_maps(struct room_t *room)
 {
-    room->users = hash_init((userdb_size() / 2) + 1, hash_djb, compare_strings);
+    room->users = hash_init((userdb_size() / 2) + 1, pid_hash, pid_equal);
 
     room->objects = multimap_init(OBJMAP_SIZE, hash_djb, compare_strings_nocase, obj_compare);
     multimap_setfreedata_cb(room->objects, obj_free);
@@ -38,7 +38,7 @@ struct roomdata_t {
     /* the non-const pointers can be modified by the world module */
     const char * const uniq_id;
 
-    /* mutable properties */
+    /* mutable properties; change desc with room_set_desc() */
     char *name;
     char *desc;
 
@@ -65,12 +65,16 @@ struct room_t {
     room_id id;
     struct roomdata_t data;
 
+    /* bumped by room_set_desc(), so clients know their wrapped copy of
+     * the description is stale, see out_desc() */
+    uint32_t desc_version;
+
     room_id adjacent[NUM_DIRECTIONS];
 
     /* hash maps */
     void *objects; /* multimap of object name -> object */
     void *verbs; /* name -> verb_t */
-    void *users; /* username -> child_data */
+    void *users; /* PID -> child_data, one for each session */
 
     void *userdata;
 };
@@ -81,8 +85,14 @@ struct room_t {
  * responsibility */
 bool room_user_add(room_id id, struct child_data *child);
 bool room_user_del(room_id id, struct child_data *child);
+
+/* with room threads (-t), only between rooms owned by the calling
+ * thread, see zone_owner() */
 void room_user_teleport(struct child_data *child, room_id id);
 
+/* replaces a room's description with a copy of desc */
+void room_set_desc(room_id id, const char *desc);
+
 /* On the first call, room should be a valid room id, and *save should
  * point to a void pointer. On subsequent calls, room should be
  * ROOM_NONE, and *save should remain unchanged from the previous
@@ -20,11 +20,15 @@
 
 #include "client.h"
 #include "hash.h"
+#include "ipc.h"
 #include "server.h"
 #include "server_reqs.h"
+#include "tls.h"
+#include "uring.h"
 #include "userdb.h"
 #include "util.h"
 #include "world.h"
+#include "zone.h"
 
 #define DEFAULT_PORT 1234
 #define BACKLOG 512
@@ -33,13 +37,156 @@
 bool are_child = false;
 void *child_map = NULL;
 
+/* login name -> first session logged in as it; room threads read it,
+ * see send_packet_user() */
+static void *user_map = NULL;
+static pthread_rwlock_t user_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 /* assume int is atomic */
 volatile int num_clients = 0;
 
+/* of those, how many are hibernating, see park_session() */
+int num_hibernating = 0;
+
 /* local data */
 static uint16_t port = DEFAULT_PORT;
 
-static int server_socket;
+static int server_socket = -1;
+
+/* -s: native TLS, on a port of its own, see tls.h */
+static uint16_t tls_port = 0;
+static int tls_socket = -1;
+static char *tls_cert = NULL, *tls_key = NULL, *tls_ciphers = NULL;
+
+/* how clients are served */
+enum server_mode server_mode = MODE_FORK;
+
+/* prefork mode: warm, idle children waiting to be handed a client
+ * socket over their control socket */
+#define DEFAULT_POOL_SIZE 4
+static int pool_size = DEFAULT_POOL_SIZE;
+static struct child_data **idle_pool = NULL;
+static int idle_count = 0;
+static ev_idle pool_watcher;
+
+/* mux mode: workers, each serving up to mux_clients sessions */
+#define DEFAULT_MUX_CLIENTS 16
+static int mux_clients = DEFAULT_MUX_CLIENTS;
+static struct child_data **workers = NULL;
+static int n_workers = 0;
+
+/* how children talk to the master */
+static enum { IPC_PIPE = 0, IPC_RING } ipc_backend = IPC_RING;
+
+/* event and mux modes: IDs for sessions which don't have a PID */
+static pid_t session_counter = 0;
+
+/* mux mode: the client socket being handed to a worker, which one
+ * forked meanwhile mustn't keep open, see child_startup() */
+static int dispatching = -1;
+
+/* whether new children leave the master's state alone rather than
+ * freeing it, see child_startup() */
+static bool slim_children = true;
+
+/* -B: fork this many children, report on them, and exit */
+static int fork_bench = 0;
+
+/* -t: threads to run the rooms on, see zone.h */
+static int room_threads = 0;
+
+/* -I: forked modes, seconds a client can idle at the prompt before
+ * its child is dropped and the session parked here; 0 for never */
+static int idle_timeout = 0;
+
+/* idle children are asked this many times per idle_timeout whether
+ * they've been idle long enough, so they sleep within a fraction of
+ * it */
+#define IDLE_CHECKS 4
+
+/* hibernating sessions, woken by their next keystroke */
+struct parked_session {
+    int      fd;
+    struct in_addr addr;
+    struct parked_state state;
+    void     (*raw_mode_cb)(struct child_data*, char *data, size_t len);
+    ev_io    watcher;
+    bool     awake; /* was being served when a restart began */
+    struct parked_session *next, **pprev;
+};
+static struct parked_session *parked = NULL;
+
+/* -M: sessions served at once, hibernating ones included, 0 for no
+ * limit; past it, new connections wait in line for a slot */
+#define DEFAULT_MAX_CLIENTS 256
+static int max_clients = DEFAULT_MAX_CLIENTS;
+
+/* -Q: how many connections can wait in line before more are turned
+ * away */
+#define DEFAULT_MAX_WAITING 64
+static int max_waiting = DEFAULT_MAX_WAITING;
+
+/* connections taken per wakeup of a listening socket */
+#define ACCEPT_BATCH 16
+
+/* out of descriptors or memory: seconds to stop accepting for */
+#define ACCEPT_PAUSE 0.5
+
+/* connections waiting in line for a slot, in order, see
+ * admit_waiting() */
+struct waiting_conn {
+    int      fd;
+    struct sockaddr_in addr;
+    bool     tls;
+    ev_io    watcher;
+    struct waiting_conn *next, **pprev;
+};
+static struct waiting_conn *waiting = NULL, **waiting_tail = &waiting;
+static int num_waiting = 0;
+
+static struct conn_stats conn_stats;
+
+/* the listening sockets' watchers, for pausing them, and their
+ * accepts when they're made through io_uring */
+static ev_io listen_watchers[2];
+static struct uring_op accept_ops[2];
+static int n_listeners = 0;
+static ev_timer accept_pause_timer;
+
+/* -u: event mode I/O through io_uring, if the kernel can, see uring.h */
+static bool use_uring = false;
+
+/* SIGUSR2: hand every session over to a new master, started from the
+ * same command line, then exit; see restart_begin() */
+#define RESTART_ENV "NETCOSM_RESTART_FD"
+
+/* how often sessions are asked to hand their clients back, and for
+ * how many seconds, before the rest are left behind */
+#define RESTART_POLL  0.1
+#define RESTART_GRACE 10
+
+/* ms the new master gets to take everything over */
+#define RESTART_TIMEOUT 30000
+
+static volatile sig_atomic_t restart_requested = 0;
+static bool restarting = false;
+static ev_timer restart_timer;
+
+/* the new master's serving, and we're only seeing off the sessions it
+ * couldn't take, for at most this many seconds */
+#define RESTART_LINGER 1
+static bool handed_over = false;
+static ev_tstamp restart_deadline;
+
+/* how we were started, for starting the new master the same way */
+static char **server_argv = NULL;
+static char *start_dir = NULL;
+
+/* TCP keepalive, so dead peers are noticed even while nobody writes
+ * to them: probes after a minute of silence, gives up a minute later */
+#define KEEPALIVE_IDLE  60
+#define KEEPALIVE_INTVL 10
+#define KEEPALIVE_CNT   6
 
 /* for debugging: */
 static char *world_module = "build/worlds/dunnet.so";
@@ -48,17 +195,35 @@ static char *module_handle = NULL;
 /* save after every X changes to the world state */
 #define SAVE_INTERVAL 10
 
+/* a save had to wait for the room threads */
+static bool save_pending = false;
+
 /* saves game state periodically */
 void server_save_state(bool force)
 {
     if(!are_child)
     {
+        /* room threads leave it to the main thread */
+        if(zone_defer_save())
+            return;
+
         static int n = 0;
         n = (n + 1) % SAVE_INTERVAL;
-        if(!n || force)
+        if(!n || force || save_pending)
         {
+            /* rather than wait for a slow request, the next change
+             * tries again */
+            if(!zone_pause(force))
+            {
+                save_pending = true;
+                return;
+            }
+
             world_save(WORLDFILE);
             userdb_write(USERFILE);
+            save_pending = false;
+
+            zone_resume();
         }
     }
 }
@@ -66,11 +231,25 @@ void server_save_state(bool force)
 static void free_child_data(void *ptr)
 {
     struct child_data *child = ptr;
-    if(child->user)
+    if(child->ctlsock >= 0)
+        close(child->ctlsock);
+    if(child->readpipe[0] >= 0)
+        close(child->readpipe[0]);
+    if(child->outpipe[1] >= 0)
+        close(child->outpipe[1]);
+    if(child->session)
+    {
+        client_free(child->session);
+        child->session = NULL;
+    }
+    discard_packets(child);
+    if(child->shm)
     {
-        free(child->user);
-        child->user = NULL;
+        ipc_shm_free(child->shm);
+        child->shm = NULL;
     }
+    if(child->user)
+        server_user_del(child);
     if(child->io_watcher)
     {
         ev_io_stop(EV_DEFAULT_ child->io_watcher);
@@ -78,9 +257,249 @@ static void free_child_data(void *ptr)
         free(child->io_watcher);
         child->io_watcher = NULL;
     }
+    if(child->idle_timer)
+    {
+        ev_timer_stop(EV_DEFAULT_ child->idle_timer);
+
+        free(child->idle_timer);
+        child->idle_timer = NULL;
+    }
     free(ptr);
 }
 
+void server_drop_session(user_t *child)
+{
+    debugf("Client disconnect.\n");
+
+    --num_clients;
+
+    if(child->worker)
+        --child->worker->nsessions;
+
+    /* its room belongs to another thread */
+    if(zone_threads)
+    {
+        retire_child(child);
+        return;
+    }
+
+    room_user_del(child->room, child);
+
+    pid_t pid = child->pid;
+    hash_remove(child_map, &pid);
+}
+
+void server_users_lock(void)
+{
+    pthread_rwlock_rdlock(&user_lock);
+}
+
+void server_users_unlock(void)
+{
+    pthread_rwlock_unlock(&user_lock);
+}
+
+/* these two are called with user_lock held for writing */
+static void user_add(user_t *child)
+{
+    user_t *first = hash_lookup(user_map, child->user);
+    if(first)
+    {
+        child->next_login = first->next_login;
+        first->next_login = child;
+    }
+    else
+    {
+        child->next_login = NULL;
+        hash_insert(user_map, child->user, child);
+    }
+}
+
+static void user_del(user_t *child)
+{
+    user_t *iter = hash_lookup(user_map, child->user);
+    if(iter == child)
+    {
+        /* the map's key is our name, so re-key it to the next one */
+        hash_remove(user_map, child->user);
+        if(child->next_login)
+            hash_insert(user_map, child->next_login->user, child->next_login);
+    }
+    else
+    {
+        for(; iter; iter = iter->next_login)
+        {
+            if(iter->next_login == child)
+            {
+                iter->next_login = child->next_login;
+                break;
+            }
+        }
+    }
+    child->next_login = NULL;
+}
+
+void server_user_rename(user_t *child, const char *name)
+{
+    /* room threads compare other sessions' names, so they mustn't
+     * see one half-written */
+    pthread_rwlock_wrlock(&user_lock);
+
+    if(child->user)
+        user_del(child);
+
+    /* names are stored in the child_data itself, no allocation */
+    child->user = child->username;
+    strncpy(child->username, name, sizeof(child->username) - 1);
+    user_add(child);
+
+    pthread_rwlock_unlock(&user_lock);
+}
+
+void server_user_del(user_t *child)
+{
+    if(!user_map || !child->user)
+        return;
+
+    pthread_rwlock_wrlock(&user_lock);
+
+    user_del(child);
+    child->user = NULL;
+
+    pthread_rwlock_unlock(&user_lock);
+}
+
+user_t *server_user_lookup(const char *user)
+{
+    return hash_lookup(user_map, user);
+}
+
+/* mux mode: drops every session a dead worker was serving */
+static void worker_died(pid_t pid)
+{
+    int idx;
+    for(idx = 0; idx < n_workers; ++idx)
+        if(workers[idx]->pid == pid)
+            break;
+
+    if(idx == n_workers)
+        return;
+
+    struct child_data *worker = workers[idx];
+
+    debugf("Worker %d died.\n", pid);
+
+    /* can't remove while iterating */
+    pid_t *dead = calloc(worker->nsessions, sizeof(pid_t));
+    int n_dead = 0;
+
+    void *ptr = child_map, *save;
+    while(n_dead < worker->nsessions)
+    {
+        pid_t *key;
+        struct child_data *child = hash_iterate(ptr, &save, (void**)&key);
+        ptr = NULL;
+        if(!child)
+            break;
+        if(child->worker == worker)
+            dead[n_dead++] = child->pid;
+    }
+
+    for(int i = 0; i < n_dead; ++i)
+        server_drop_session(hash_lookup(child_map, dead + i));
+
+    free(dead);
+
+    free_child_data(worker);
+    workers[idx] = workers[--n_workers];
+}
+
+/*** hibernation ***/
+
+static void parked_cb(EV_P_ ev_io *w, int revents);
+static void admit_waiting(void);
+static void restart_begin(void);
+
+/* keeps a client which nobody's serving until it next sends
+ * something, see parked_cb(); during a restart, it's left for the new
+ * master to serve again */
+static struct parked_session *parked_add(int fd, struct in_addr addr,
+                                         const struct parked_state *state)
+{
+    struct parked_session *p = calloc(1, sizeof(*p));
+    p->fd = fd;
+    p->addr = addr;
+    p->state = *state;
+    p->awake = restarting;
+
+    ev_io_init(&p->watcher, parked_cb, fd, EV_READ);
+    p->watcher.data = p;
+    if(!restarting)
+        ev_io_start(EV_DEFAULT_ &p->watcher);
+
+    p->next = parked;
+    if(parked)
+        parked->pprev = &p->next;
+    p->pprev = &parked;
+    parked = p;
+
+    ++num_hibernating;
+
+    return p;
+}
+
+/* parks a session whose client has been handed back to us, along
+ * with the part of its state only it knew */
+static void park_fd(int fd, struct child_data *child, struct parked_state *state)
+{
+    /* the child only knows its telnet state better than we do */
+    memcpy(state->user, child->username, sizeof(state->user));
+    state->admin = (child->state == STATE_ADMIN);
+    state->room = child->room;
+    state->rawmode = (child->raw_mode_cb != NULL);
+    state->gmcp = __atomic_load_n(&child->gmcp, __ATOMIC_RELAXED);
+
+    struct parked_session *p = parked_add(fd, child->addr, state);
+    p->raw_mode_cb = child->raw_mode_cb;
+
+    if(restarting)
+        debugf("Client %d handed back.\n", child->pid);
+    else
+        debugf("Client %d hibernating.\n", child->pid);
+
+    /* it's still connected */
+    server_drop_session(child);
+    ++num_clients;
+}
+
+/*
+ * A child which hibernated, or was restarting, sent its client socket
+ * back over its control socket before exiting. If it's there, parks
+ * the session.
+ */
+static bool park_session(struct child_data *child)
+{
+    struct parked_state state;
+    int fd = recv_fd(child->ctlsock, &state, sizeof(state));
+    if(fd < 0)
+        return false;
+
+    park_fd(fd, child, &state);
+
+    return true;
+}
+
+static void unpark_session(struct parked_session *p)
+{
+    ev_io_stop(EV_DEFAULT_ &p->watcher);
+
+    *p->pprev = p->next;
+    if(p->next)
+        p->next->pprev = p->pprev;
+
+    --num_hibernating;
+}
+
 static void handle_disconnects(void)
 {
     int saved_errno = errno;
@@ -88,15 +507,35 @@ static void handle_disconnects(void)
     pid_t pid;
     while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
     {
-        struct child_data *child = hash_lookup(child_map, &pid);
+        /* session IDs might clash with worker PIDs */
+        if(server_mode == MODE_MUX)
+        {
+            worker_died(pid);
+            continue;
+        }
 
-        debugf("Client disconnect.\n");
+        struct child_data *child = hash_lookup(child_map, &pid);
 
-        room_user_del(child->room, child);
+        if(!child)
+        {
+            /* an idle child died before being given a client */
+            for(int i = 0; i < idle_count; ++i)
+            {
+                if(idle_pool[i]->pid == pid)
+                {
+                    free_child_data(idle_pool[i]);
+                    idle_pool[i] = idle_pool[--idle_count];
+                    ev_idle_start(EV_DEFAULT_ &pool_watcher);
+                    break;
+                }
+            }
+            continue;
+        }
 
-        --num_clients;
+        if(child->ctlsock >= 0 && park_session(child))
+            continue;
 
-        hash_remove(child_map, &pid);
+        server_drop_session(child);
     }
 
     errno = saved_errno;
@@ -110,14 +549,18 @@ static void sigchld_handler(int sig)
     reap_children = 1;
 }
 
-static void handle_client(int fd, struct sockaddr_in *addr,
-                          int nclients, int to, int from)
+static void handle_client(int fd, const struct handoff *handoff, int ctlsock,
+                          int to, int from, struct ipc_shm *shm)
 {
-    client_main(fd, addr, nclients, to, from);
+    client_main(fd, handoff, ctlsock, to, from, shm);
 }
 
 static void __attribute__((noreturn)) server_shutdown(void)
 {
+    /* the new master owns everything now, see restart_leave() */
+    if(handed_over)
+        _exit(0);
+
     if(!are_child)
         debugf("Shutdown server.\n");
     else
@@ -128,30 +571,60 @@ static void __attribute__((noreturn)) server_shutdown(void)
 
     close(server_socket);
 
+    if(tls_socket >= 0)
+        close(tls_socket);
+
+    /* children never own the state below, see child_startup() */
+    if(are_child)
+        _exit(0);
+
+    /* nothing touches the world behind our back from here on */
+    zone_shutdown();
+
+    /* sessions are freed at once from here on, not once their
+     * requests are done */
+    uring_shutdown();
+
+    while(parked)
+    {
+        struct parked_session *p = parked;
+        unpark_session(p);
+        close(p->fd);
+        free(p);
+    }
+
+    while(waiting)
+    {
+        struct waiting_conn *c = waiting;
+        waiting = c->next;
+        close(c->fd);
+        free(c);
+    }
+
     /* save state */
-    if(!are_child)
-        server_save_state(true);
+    server_save_state(true);
 
     /* shut down modules */
+    auth_shutdown();
     client_shutdown();
     obj_shutdown();
     reqmap_free();
     userdb_shutdown();
     verb_shutdown();
     world_free();
+    tls_shutdown();
 
     /* free internal data structures */
     hash_free(child_map);
     child_map = NULL;
 
+    hash_free(user_map);
+    user_map = NULL;
+
     extern void *dir_map;
     hash_free(dir_map);
     dir_map = NULL;
 
-    extern char *current_user;
-    if(current_user)
-        free(current_user);
-
     if(module_handle)
         dlclose(module_handle);
 
@@ -247,7 +720,7 @@ static void load_worldfile(void)
             error("Failed to load world from disk.\nTry removing "WORLDFILE".");
 }
 
-static int server_bind(void)
+static int server_bind(uint16_t listen_port)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -261,7 +734,7 @@ static int server_bind(void)
 
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    addr.sin_port = htons(listen_port);
 
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
@@ -271,6 +744,9 @@ static int server_bind(void)
     if(listen(sock, BACKLOG) < 0)
         error("listen");
 
+    /* so new_connection_cb() can take all that's waiting */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
     return sock;
 }
 
@@ -281,7 +757,7 @@ static void childreq_cb(EV_P_ ev_io *w, int revents)
     /* data from a child's pipe */
     if(revents & EV_READ)
     {
-        if(!handle_child_req(w->fd))
+        if(!handle_child_req(w->data))
         {
             handle_disconnects();
         }
@@ -290,47 +766,209 @@ static void childreq_cb(EV_P_ ev_io *w, int revents)
         handle_disconnects();
 }
 
-static void new_connection_cb(EV_P_ ev_io *w, int revents)
+static void login_handover(void);
+
+/* eventfds don't hang up when a child dies like pipes do, so we also
+ * check after every loop iteration, which a SIGCHLD will interrupt */
+static void reap_cb(EV_P_ ev_prepare *w, int revents)
 {
     (void) EV_A;
     (void) w;
     (void) revents;
-    struct sockaddr_in client;
-    socklen_t client_len = sizeof(client);
-    int new_sock = accept(server_socket, (struct sockaddr*) &client, &client_len);
-    if(new_sock < 0)
-        error("accept");
 
-    ++num_clients;
+    if(reap_children)
+    {
+        reap_children = 0;
+        handle_disconnects();
+    }
 
-    int readpipe[2]; /* child->parent */
-    int outpipe [2]; /* parent->child */
+    /* clients we were logging in */
+    struct client_session *sess;
+    while((sess = client_next_closed()))
+        server_drop_session(sess->child);
+
+    login_handover();
+
+    if(restart_requested)
+    {
+        restart_requested = 0;
+        restart_begin();
+    }
 
-    /* try several methods to create a packet pipe between the child and master: */
+    /* everyone's been seen off, see restart_leave() */
+    if(handed_over && !num_clients)
+        _exit(0);
 
+    admit_waiting();
+}
+
+/* try several methods to create a packet pipe between the child and master */
+static void open_ipc_pipe(int fds[2])
+{
     /* first try creating a pipe in "packet mode": see pipe(2) */
-    if(pipe2(readpipe, O_DIRECT) < 0)
+    if(pipe2(fds, O_DIRECT) < 0)
     {
         /* then try a SOCK_SEQPACKET socket pair: see unix(7) */
-        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, readpipe) < 0)
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
         {
             /* if that failed, try a SOCK_DGRAM socket as a last resort */
-            if(socketpair(AF_UNIX, SOCK_DGRAM, 0, readpipe) < 0)
+            if(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0)
                 error("couldn't create child-master communication pipe");
             else
                 debugf("WARNING: Using a SOCK_DGRAM socket pair for IPC, performance may be degraded.\n");
         }
     }
+}
+
+/* closes what a new child inherited for talking to one of the
+ * master's other children, without writing to the master's heap */
+static void forget_child(struct child_data *child)
+{
+    if(child->ctlsock >= 0)
+        close(child->ctlsock);
+    if(child->readpipe[0] >= 0)
+        close(child->readpipe[0]);
+    if(child->outpipe[1] >= 0)
+        close(child->outpipe[1]);
+    if(child->shm)
+        ipc_shm_free(child->shm);
+}
+
+/*
+ * Called in a child right after fork(). None of the master's world,
+ * user or child data is used by a child, but freeing it all writes to
+ * every page of the master's heap, which the kernel then has to copy;
+ * so slim children (the default) only close the descriptors they
+ * inherited, while full ones free everything.
+ */
+static void child_startup(void)
+{
+    /* other idle children must see EOF if the master dies */
+    for(int i = 0; i < idle_count; ++i)
+        close(idle_pool[i]->ctlsock);
+
+    /* and hibernating clients must see EOF if we drop them, as must
+     * those waiting in line, or being logged in */
+    for(struct parked_session *p = parked; p; p = p->next)
+        close(p->fd);
+    for(struct waiting_conn *c = waiting; c; c = c->next)
+        close(c->fd);
+    if(dispatching >= 0)
+        close(dispatching);
+    dispatching = -1;
+
+    void *ptr = child_map, *save;
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+        if(child->session)
+            client_forget(child->session);
+    }
+
+    if(slim_children)
+    {
+        /* same for the other workers and clients */
+        for(int i = 0; i < n_workers; ++i)
+            forget_child(workers[i]);
 
-    if(pipe2(outpipe, O_DIRECT) < 0)
+        ptr = child_map;
+        while(1)
+        {
+            struct child_data *child = hash_iterate(ptr, &save, NULL);
+            ptr = NULL;
+            if(!child)
+                break;
+            forget_child(child);
+        }
+    }
+    else
     {
-        if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, outpipe) < 0)
+        for(int i = 0; i < n_workers; ++i)
+            free_child_data(workers[i]);
+        free(workers);
+
+        /* shut down modules */
+        obj_shutdown();
+        reqmap_free();
+        userdb_shutdown();
+        verb_shutdown();
+        world_free();
+
+        /* free our data structures */
+        hash_free(child_map);
+        hash_free(user_map);
+
+        if(module_handle)
+            dlclose(module_handle);
+
+        while(parked)
+        {
+            struct parked_session *p = parked;
+            parked = p->next;
+            free(p);
+        }
+
+        while(waiting)
         {
-            if(socketpair(AF_UNIX, SOCK_DGRAM, 0, outpipe) < 0)
-                error("error creating IPC pipe");
+            struct waiting_conn *c = waiting;
+            waiting = c->next;
+            free(c);
         }
     }
 
+    workers = NULL;
+    parked = NULL;
+    waiting = NULL;
+    waiting_tail = &waiting;
+    num_waiting = 0;
+    n_workers = 0;
+    child_map = NULL;
+    user_map = NULL;
+    module_handle = NULL;
+
+    auth_forked();
+    client_forked();
+
+    /* shut down libev */
+    ev_default_destroy();
+}
+
+/*
+ * Forks off a new child process. If sock is negative, the child
+ * waits for its client socket to be passed over a control socket
+ * (prefork mode), otherwise it serves sock right away, as described
+ * by handoff.
+ *
+ * Returns the master's data for the new child; never returns in the
+ * child.
+ */
+static struct child_data *spawn_child(int sock, const struct handoff *handoff)
+{
+    int readpipe[2]; /* child->parent */
+    int outpipe [2]; /* parent->child */
+    int ctlsock [2];
+
+    struct ipc_shm *shm = NULL;
+    if(ipc_backend == IPC_RING)
+        shm = ipc_shm_new(readpipe, outpipe);
+
+    /* fall back to pipes */
+    if(!shm)
+    {
+        open_ipc_pipe(readpipe);
+        open_ipc_pipe(outpipe);
+    }
+
+    pid_t master_pid = getpid();
+
+    /* hibernating and restarting children hand their client back
+     * over it too */
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ctlsock) < 0)
+        error("couldn't create control socket");
+
     pid_t pid = fork();
     if(pid < 0)
         error("fork");
@@ -340,93 +978,1260 @@ static void new_connection_cb(EV_P_ ev_io *w, int revents)
         /* child */
         are_child = true;
 
+        /* we won't see EOF from an eventfd if the master dies */
+        if(shm)
+        {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if(getppid() != master_pid)
+                exit(0);
+        }
+
         /* close unused file descriptors */
         close(readpipe[0]);
         close(outpipe[1]);
         close(server_socket);
+        if(tls_socket >= 0)
+            close(tls_socket);
+        tls_socket = -1;
+        close(ctlsock[0]);
 
-        /* shut down modules */
-        obj_shutdown();
-        reqmap_free();
-        userdb_shutdown();
-        verb_shutdown();
-        world_free();
+        child_startup();
 
-        /* free our data structures */
-        hash_free(child_map);
-        child_map = NULL;
+        if(server_mode == MODE_MUX)
+        {
+            client_worker_main(ctlsock[1], readpipe[1], outpipe[0], shm);
+            exit(0);
+        }
 
-        if(module_handle)
-            dlclose(module_handle);
-        module_handle = NULL;
+        struct handoff received;
 
-        /* shut down libev */
-        ev_default_destroy();
+        if(sock < 0)
+        {
+            /* we're warm now, wait for a client */
+            sock = recv_fd(ctlsock[1], &received, sizeof(received));
+
+            /* master went away */
+            if(sock < 0)
+                exit(0);
+
+            handoff = &received;
+        }
 
-        server_socket = new_sock;
+        server_socket = sock;
 
-        handle_client(new_sock, &client, num_clients, readpipe[1], outpipe[0]);
+        handle_client(sock, handoff, ctlsock[1], readpipe[1], outpipe[0], shm);
 
         exit(0);
     }
-    else
-    {
-        /* parent */
-        close(readpipe[1]);
-        close(outpipe[0]);
-        close(new_sock);
 
-        /* add the child to the child map */
-        struct child_data *new = calloc(1, sizeof(struct child_data));
-        memcpy(new->outpipe, outpipe, sizeof(outpipe));
-        memcpy(new->readpipe, readpipe, sizeof(readpipe));
-        new->addr = client.sin_addr;
-        new->pid = pid;
-        new->state = STATE_INIT;
-        new->user = NULL;
+    /* parent */
+    close(readpipe[1]);
+    close(outpipe[0]);
+    close(ctlsock[1]);
+
+    struct child_data *new = calloc(1, sizeof(struct child_data));
+    memcpy(new->outpipe, outpipe, sizeof(outpipe));
+    memcpy(new->readpipe, readpipe, sizeof(readpipe));
+    new->ctlsock = ctlsock[0];
+    new->shm = shm;
+    if(handoff)
+        new->addr = handoff->addr.sin_addr;
+    new->pid = pid;
+    new->state = STATE_INIT;
+    new->user = NULL;
+
+    /* so replies never have to allocate, see send_packet() */
+    new->outbuf = malloc(MSG_MAX);
+
+    return new;
+}
 
-        ev_io *new_io_watcher = calloc(1, sizeof(ev_io));
-        ev_io_init(new_io_watcher, childreq_cb, new->readpipe[0], EV_READ);
-        ev_set_priority(new_io_watcher, EV_MINPRI);
-        ev_io_start(EV_A_ new_io_watcher);
-        new->io_watcher = new_io_watcher;
+/* start listening for requests from a child */
+static void child_watch(struct child_data *child)
+{
+    ev_io *new_io_watcher = calloc(1, sizeof(ev_io));
+    ev_io_init(new_io_watcher, childreq_cb, child->readpipe[0], EV_READ);
+    new_io_watcher->data = child;
+    ev_set_priority(new_io_watcher, EV_MINPRI);
+    ev_io_start(EV_DEFAULT_ new_io_watcher);
+    child->io_watcher = new_io_watcher;
+}
 
-        pid_t *pidbuf = malloc(sizeof(pid_t));
-        *pidbuf = pid;
+/* asks a child whether its client has idled long enough to hibernate;
+ * it decides, as only it sees the client's input */
+static void idle_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void) EV_A;
+    (void) revents;
 
-        hash_insert(child_map, pidbuf, new);
-    }
+    struct child_data *child = w->data;
+    send_packet_pid(child->pid, REQ_HIBERNATE, &idle_timeout, sizeof(idle_timeout));
 }
 
-static void init_signals(void)
+/* start listening for requests from a child that is serving a client */
+static void child_register(struct child_data *child)
 {
-    struct sigaction sa;
+    child_watch(child);
 
-    /* SIGINT and SIGTERM cause graceful shutdown */
-    sigemptyset(&sa.sa_mask);
-    sigaddset(&sa.sa_mask, SIGINT);
-    sa.sa_handler = sigint_handler;
-    sa.sa_flags = SA_RESTART;
-    if(sigaction(SIGINT, &sa, NULL) < 0)
-        error("sigaction");
-    if(sigaction(SIGTERM, &sa, NULL) < 0)
-        error("sigaction");
+    pid_t *pidbuf = malloc(sizeof(pid_t));
+    *pidbuf = child->pid;
 
-    /* ignore SIGPIPE */
-    sigemptyset(&sa.sa_mask);
-    sa.sa_handler = SIG_IGN;
-    sa.sa_flags = 0;
-    if(sigaction(SIGPIPE, &sa, NULL) < 0)
-        error("sigaction");
+    hash_insert(child_map, pidbuf, child);
 
-    /* libev's default SIGCHLD handler exhibits some really strange
-     * behavior, which we don't like, so we use our own */
-    sigemptyset(&sa.sa_mask);
-    sigaddset(&sa.sa_mask, SIGCHLD);
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART;
-    if(sigaction(SIGCHLD, &sa, NULL) < 0)
-        error("sigaction");
+    if(idle_timeout)
+    {
+        child->idle_timer = calloc(1, sizeof(ev_timer));
+        ev_init(child->idle_timer, idle_cb);
+        child->idle_timer->repeat = (ev_tstamp)idle_timeout / IDLE_CHECKS;
+        child->idle_timer->data = child;
+        ev_timer_again(EV_DEFAULT_ child->idle_timer);
+    }
+}
+
+/* refills the pool of idle children, one fork per loop iteration so
+ * new connections are never kept waiting behind a refill */
+static void pool_refill_cb(EV_P_ ev_idle *w, int revents)
+{
+    (void) revents;
+
+    if(idle_count < pool_size)
+    {
+        struct child_data *child = spawn_child(-1, NULL);
+        idle_pool[idle_count++] = child;
+    }
+
+    if(idle_count >= pool_size)
+        ev_idle_stop(EV_A_ w);
+}
+
+/* hand a client socket to an idle child; returns NULL if none are
+ * available */
+static struct child_data *pool_dispatch(int sock, const struct handoff *handoff)
+{
+    while(idle_count > 0)
+    {
+        struct child_data *child = idle_pool[--idle_count];
+
+        ev_idle_start(EV_DEFAULT_ &pool_watcher);
+
+        if(send_fd(child->ctlsock, sock, handoff, sizeof(*handoff)))
+        {
+            child->addr = handoff->addr.sin_addr;
+            return child;
+        }
+
+        /* the child is probably dead, it'll be reaped by waitpid */
+        debugf("WARNING: failed to hand client to idle child %d\n", child->pid);
+        kill(child->pid, SIGKILL);
+        free_child_data(child);
+    }
+
+    return NULL;
+}
+
+/* mux mode: hand a client to a worker with room to spare, spawning a
+ * new one if needed; returns NULL if it's lost */
+static struct child_data *mux_dispatch(int sock, struct handoff *handoff)
+{
+    struct child_data *worker = NULL;
+    for(int i = 0; i < n_workers; ++i)
+    {
+        if(workers[i]->nsessions < mux_clients)
+        {
+            worker = workers[i];
+            break;
+        }
+    }
+
+    if(!worker)
+    {
+        dispatching = sock;
+        worker = spawn_child(-1, NULL);
+        dispatching = -1;
+        child_watch(worker);
+
+        workers = realloc(workers, (n_workers + 1) * sizeof(*workers));
+        workers[n_workers++] = worker;
+    }
+
+    handoff->id = ++session_counter;
+
+    if(!send_fd(worker->ctlsock, sock, handoff, sizeof(*handoff)))
+    {
+        /* the worker is probably dead, it'll be reaped by waitpid */
+        debugf("WARNING: failed to hand client to worker %d\n", worker->pid);
+        --num_clients;
+        return NULL;
+    }
+
+    struct child_data *new = calloc(1, sizeof(struct child_data));
+
+    new->readpipe[0] = new->readpipe[1] = -1;
+    new->outpipe[0] = new->outpipe[1] = -1;
+    new->ctlsock = -1;
+    new->addr = handoff->addr.sin_addr;
+    new->pid = handoff->id;
+    new->state = STATE_INIT;
+    new->tls = handoff->tls;
+    new->worker = worker;
+
+    ++worker->nsessions;
+
+    pid_t *pidbuf = malloc(sizeof(pid_t));
+    *pidbuf = new->pid;
+
+    hash_insert(child_map, pidbuf, new);
+
+    return new;
+}
+
+/* event mode: serve a client from the master itself; the other modes
+ * do only until it's logged in, see login_handover() */
+static struct child_data *event_client_new(int sock, struct handoff *handoff)
+{
+    struct child_data *new = calloc(1, sizeof(struct child_data));
+
+    new->readpipe[0] = new->readpipe[1] = -1;
+    new->outpipe[0] = new->outpipe[1] = -1;
+    new->ctlsock = -1;
+    new->addr = handoff->addr.sin_addr;
+    new->pid = ++session_counter;
+    new->state = STATE_INIT;
+    new->tls = handoff->tls;
+
+    /* forked modes: children's PIDs are keys too, so ours can't be */
+    if(server_mode == MODE_FORK || server_mode == MODE_PREFORK)
+        new->pid = -new->pid;
+
+    pid_t *pidbuf = malloc(sizeof(pid_t));
+    *pidbuf = new->pid;
+
+    hash_insert(child_map, pidbuf, new);
+
+    handoff->id = new->pid;
+    client_new(sock, handoff, new);
+
+    return new;
+}
+
+/* event mode: sessions can't be freed from inside their own
+ * callbacks, so they are reaped here, before the loop blocks */
+static void event_reap_cb(EV_P_ ev_prepare *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    struct client_session *sess;
+    while((sess = client_next_closed()))
+        server_drop_session(sess->child);
+
+    if(restart_requested)
+    {
+        restart_requested = 0;
+        restart_begin();
+    }
+
+    /* everyone's been seen off, see restart_leave() */
+    if(handed_over && !num_clients)
+        _exit(0);
+
+    admit_waiting();
+}
+
+/* forked modes: hand a client to an idle child, or a new one */
+static struct child_data *fork_dispatch(int sock, const struct handoff *handoff)
+{
+    struct child_data *new = NULL;
+
+    if(server_mode == MODE_PREFORK)
+        new = pool_dispatch(sock, handoff);
+
+    /* no idle children, fall back to forking */
+    if(!new)
+        new = spawn_child(sock, handoff);
+
+    close(sock);
+
+    new->tls = handoff->tls;
+    child_register(new);
+
+    return new;
+}
+
+/* hands a client to whatever serves clients in this mode, as handoff
+ * describes; num_clients must already count it. Returns our data for
+ * its session, or NULL if it's lost. */
+static struct child_data *dispatch_session(int sock, struct handoff *handoff)
+{
+    /* we log clients in ourselves, so that only those who manage to
+     * cost a process; TLS ones can't be handed on afterwards */
+    if(server_mode == MODE_EVENT || (!handoff->resume && !handoff->tls))
+        return event_client_new(sock, handoff);
+
+    if(server_mode == MODE_MUX)
+    {
+        struct child_data *new = mux_dispatch(sock, handoff);
+        close(sock);
+        return new;
+    }
+
+    return fork_dispatch(sock, handoff);
+}
+
+/* forked and mux modes: hands each client we've logged in to a
+ * process of its own, once its output's gone */
+static void login_handover(void)
+{
+    struct handoff handoff;
+    struct child_data *child;
+    int fd;
+
+    while((fd = client_next_authed(&handoff, &child)) >= 0)
+    {
+        handoff.addr.sin_family = AF_INET;
+        handoff.addr.sin_addr = child->addr;
+
+        /* it's still connected */
+        server_drop_session(child);
+        ++num_clients;
+
+        handoff.nclients = num_clients;
+        dispatch_session(fd, &handoff);
+    }
+}
+
+/* serves a parked session's client again, as it was left; one which
+ * hadn't logged in starts over */
+static void wake_session(struct parked_session *p)
+{
+    unpark_session(p);
+
+    struct handoff handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.addr.sin_family = AF_INET;
+    handoff.addr.sin_addr = p->addr;
+    handoff.nclients = num_clients;
+    handoff.resume = (p->state.user[0] != '\0');
+    handoff.state = p->state;
+
+    struct child_data *new = dispatch_session(p->fd, &handoff);
+    if(new)
+        new->raw_mode_cb = p->raw_mode_cb;
+
+    free(p);
+}
+
+/* a hibernating session's client has sent something, or gone away */
+static void parked_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) EV_A;
+    (void) revents;
+
+    struct parked_session *p = w->data;
+
+    /* the new master serves it, or we do once the restart's over */
+    if(restarting)
+    {
+        ev_io_stop(EV_A_ w);
+        return;
+    }
+
+    char c;
+    ssize_t len = recv(p->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if(len > 0)
+    {
+        wake_session(p);
+        return;
+    }
+
+    /* hung up, or keepalive gave up on it */
+    debugf("Hibernating client disconnected.\n");
+    unpark_session(p);
+    close(p->fd);
+    --num_clients;
+    free(p);
+}
+
+static void set_keepalive(int sock)
+{
+    int on = 1, idle = KEEPALIVE_IDLE, intvl = KEEPALIVE_INTVL, cnt = KEEPALIVE_CNT;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+/* a slot's free for a new session */
+static bool have_slot(void)
+{
+    return !max_clients || num_clients < max_clients;
+}
+
+/* says something to a connection we aren't serving yet, if it won't
+ * block; TLS clients can't be spoken to before their handshake */
+static void __attribute__((format(printf,3,4))) conn_say(int fd, bool tls, const char *fmt, ...)
+{
+    if(tls)
+        return;
+
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    send(fd, buf, MIN((size_t)len, sizeof(buf) - 1), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* hands a new connection to whatever serves clients in this mode */
+static void dispatch_connection(int sock, struct sockaddr_in *client, bool tls)
+{
+    ++num_clients;
+
+    struct handoff handoff;
+    memset(&handoff, 0, sizeof(handoff));
+    handoff.addr = *client;
+    handoff.nclients = num_clients;
+    handoff.tls = tls;
+
+    dispatch_session(sock, &handoff);
+}
+
+static void waiting_remove(struct waiting_conn *c)
+{
+    ev_io_stop(EV_DEFAULT_ &c->watcher);
+
+    *c->pprev = c->next;
+    if(c->next)
+        c->next->pprev = c->pprev;
+    else
+        waiting_tail = c->pprev;
+
+    --num_waiting;
+}
+
+/* tells everyone in line where they are now */
+static void waiting_moved(void)
+{
+    int pos = 0;
+    for(struct waiting_conn *c = waiting; c; c = c->next)
+        conn_say(c->fd, c->tls, "You are now #%d in line.\r\n", ++pos);
+}
+
+/* a connection waiting in line has sent something, or gone away */
+static void waiting_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) revents;
+
+    struct waiting_conn *c = w->data;
+
+    /* a TLS client's handshake has to be left for whoever serves it,
+     * so it's only watched until that turns up */
+    char buf[256];
+    ssize_t len = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT | (c->tls ? MSG_PEEK : 0));
+    if(len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if(len > 0)
+    {
+        /* anything typed before it's served is ignored */
+        if(c->tls)
+            ev_io_stop(EV_A_ w);
+        return;
+    }
+
+    debugf("Client %s gave up waiting.\n", inet_ntoa(c->addr.sin_addr));
+    ++conn_stats.abandoned;
+
+    waiting_remove(c);
+    close(c->fd);
+    free(c);
+
+    waiting_moved();
+}
+
+/* serves connections waiting in line, as far as there are slots for
+ * them */
+static void admit_waiting(void)
+{
+    /* the new master will, see restart_begin() */
+    if(!waiting || !have_slot() || restarting)
+        return;
+
+    while(waiting && have_slot())
+    {
+        struct waiting_conn *c = waiting;
+        waiting_remove(c);
+
+        debugf("Client %s admitted from the queue.\n", inet_ntoa(c->addr.sin_addr));
+        conn_say(c->fd, c->tls, "It's your turn.\r\n");
+
+        dispatch_connection(c->fd, &c->addr, c->tls);
+        free(c);
+    }
+
+    waiting_moved();
+}
+
+/* puts a connection at the back of the line */
+static void waiting_push(int sock, struct sockaddr_in *client, bool tls)
+{
+    struct waiting_conn *c = calloc(1, sizeof(*c));
+    c->fd = sock;
+    c->addr = *client;
+    c->tls = tls;
+
+    ev_io_init(&c->watcher, waiting_cb, sock, EV_READ);
+    c->watcher.data = c;
+    ev_io_start(EV_DEFAULT_ &c->watcher);
+
+    c->pprev = waiting_tail;
+    *waiting_tail = c;
+    waiting_tail = &c->next;
+
+    ++num_waiting;
+}
+
+/* full: puts a new connection in line, or turns it away */
+static void waiting_add(int sock, struct sockaddr_in *client, bool tls)
+{
+    if(num_waiting >= max_waiting)
+    {
+        debugf("Server full, turning away %s.\n", inet_ntoa(client->sin_addr));
+        conn_say(sock, tls, "The server is full, try again later.\r\n");
+        ++conn_stats.rejected;
+        close(sock);
+        return;
+    }
+
+    waiting_push(sock, client, tls);
+    ++conn_stats.queued;
+
+    debugf("Server full, %s is #%d in line.\n", inet_ntoa(client->sin_addr), num_waiting);
+    conn_say(sock, tls, "The server is full. You are #%d in line.\r\n", num_waiting);
+}
+
+static void listen_start(void)
+{
+    for(int i = 0; i < n_listeners; ++i)
+    {
+        if(!uring_running())
+            ev_io_start(EV_DEFAULT_ &listen_watchers[i]);
+        else if(!accept_ops[i].pending && !uring_accept(&accept_ops[i], listen_watchers[i].fd))
+            debugf("WARNING: couldn't queue an accept.\n");
+    }
+}
+
+static void accept_pause_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    listen_start();
+}
+
+static void listen_stop(void)
+{
+    for(int i = 0; i < n_listeners; ++i)
+    {
+        if(uring_running())
+            uring_cancel(&accept_ops[i]);
+        else
+            ev_io_stop(EV_DEFAULT_ &listen_watchers[i]);
+    }
+}
+
+/* out of descriptors or memory: trying again right away would only
+ * fail again, so stop accepting for a while */
+static void accept_pause(void)
+{
+    listen_stop();
+    ev_timer_set(&accept_pause_timer, ACCEPT_PAUSE, 0);
+    ev_timer_start(EV_DEFAULT_ &accept_pause_timer);
+}
+
+/* returns false if it's worth accepting again right away */
+static bool accept_failed(int err)
+{
+    /* gone before we got to it */
+    if(err == EINTR || err == ECONNABORTED)
+        return false;
+    if(err == EAGAIN || err == EWOULDBLOCK || err == ECANCELED)
+        return true;
+
+    ++conn_stats.errors;
+    debugf("WARNING: accept: %s\n", strerror(err));
+    if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+        accept_pause();
+    return true;
+}
+
+static void handle_new_connection(int sock, struct sockaddr_in *client, bool tls)
+{
+    ++conn_stats.accepted;
+
+    set_keepalive(sock);
+
+    /* nobody jumps the queue, and nobody's served by a master that's
+     * about to go */
+    if(have_slot() && !waiting && !restarting)
+        dispatch_connection(sock, client, tls);
+    else
+        waiting_add(sock, client, tls);
+}
+
+static void new_connection_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) EV_A;
+    (void) revents;
+
+    bool tls = w->fd == tls_socket;
+
+    /* the listening sockets don't block, so take what's there */
+    for(int i = 0; i < ACCEPT_BATCH; ++i)
+    {
+        struct sockaddr_in client;
+        socklen_t client_len = sizeof(client);
+        int new_sock = accept4(w->fd, (struct sockaddr*) &client, &client_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(new_sock < 0)
+        {
+            if(accept_failed(errno))
+                break;
+            continue;
+        }
+
+        handle_new_connection(new_sock, &client, tls);
+    }
+}
+
+/* io_uring: one completion per connection, from a multishot accept */
+static void uring_accept_cb(struct uring_op *op, int res, unsigned flags, const void *buf)
+{
+    (void) buf;
+
+    int listener = listen_watchers[op - accept_ops].fd;
+
+    if(res >= 0)
+    {
+        struct sockaddr_in client;
+        socklen_t client_len = sizeof(client);
+        if(getpeername(res, (struct sockaddr*) &client, &client_len) < 0)
+            close(res);
+        else
+            handle_new_connection(res, &client, listener == tls_socket);
+    }
+    else
+        accept_failed(-res);
+
+    /* it's stopped, for one reason or another */
+    if(!uring_more(flags) && !ev_is_active(&accept_pause_timer) && !restarting &&
+       !uring_accept(op, listener))
+        debugf("WARNING: couldn't queue an accept.\n");
+}
+
+/* the kernel's accept queue: connections it's taken, which we haven't */
+static int accept_backlog(int sock)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if(sock < 0 || getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 0;
+    /* for a listening socket, its queue length */
+    return info.tcpi_unacked;
+}
+
+void server_conn_stats(struct conn_stats *stats)
+{
+    *stats = conn_stats;
+    stats->waiting = num_waiting;
+    stats->backlog = accept_backlog(server_socket) + accept_backlog(tls_socket);
+    stats->max_clients = max_clients;
+}
+
+/*** hot restart ***/
+
+/*
+ * What a restarting master sends its successor, one message per
+ * socket, ending with RESTART_DONE. A successor built with a different
+ * idea of it can't read them, and the old master carries on.
+ */
+struct restart_msg {
+    enum { RESTART_NONE = 0, RESTART_LISTENER, RESTART_SESSION,
+           RESTART_WAITING, RESTART_DONE } type;
+
+    /* listeners and connections waiting in line: from the TLS port */
+    bool     tls;
+    struct sockaddr_in addr;
+
+    /* sessions: to be served again right away, rather than once they
+     * next send something */
+    bool     awake;
+    struct parked_state state;
+
+    /* sessions in raw mode: the world module's callback, by name */
+    char     raw_mode_cb[64];
+};
+
+static void sigusr2_handler(int sig)
+{
+    (void) sig;
+    restart_requested = 1;
+}
+
+static void restart_cb(EV_P_ ev_timer *w, int revents);
+
+/*
+ * SIGUSR2: stops accepting, and has every session hand its client
+ * back to be parked here, see restart_cb(). New connections wait in
+ * the kernel's accept queue meanwhile, which is handed over too.
+ */
+static void restart_begin(void)
+{
+    if(restarting)
+        return;
+
+    debugf("Restarting: handing sessions over to a new master.\n");
+    restarting = true;
+
+    ev_timer_stop(EV_DEFAULT_ &accept_pause_timer);
+    listen_stop();
+
+    if(server_mode == MODE_PREFORK)
+        ev_idle_stop(EV_DEFAULT_ &pool_watcher);
+
+    restart_deadline = ev_now(EV_DEFAULT) + RESTART_GRACE;
+    ev_timer_init(&restart_timer, restart_cb, RESTART_POLL, RESTART_POLL);
+    ev_timer_start(EV_DEFAULT_ &restart_timer);
+}
+
+/* the restart's off, so everything's served as it was */
+static void restart_abort(void)
+{
+    debugf("WARNING: restart failed, carrying on.\n");
+    restarting = false;
+
+    struct parked_session *p = parked;
+    while(p)
+    {
+        struct parked_session *next = p->next;
+        if(p->awake)
+            wake_session(p);
+        else
+            ev_io_start(EV_DEFAULT_ &p->watcher);
+        p = next;
+    }
+
+    void *ptr = child_map, *save;
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+        if(child->session)
+            client_restart_abort(child->session);
+    }
+
+    listen_start();
+    if(server_mode == MODE_PREFORK)
+        ev_idle_start(EV_DEFAULT_ &pool_watcher);
+    admit_waiting();
+}
+
+/* starts the new master, the way we were started, on its end of sock;
+ * it gets its descriptors from us rather than by inheriting them */
+static void __attribute__((noreturn)) restart_exec(int sock)
+{
+    close_range(3, sock - 1, 0);
+    close_range(sock + 1, ~0U, 0);
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", sock);
+    setenv(RESTART_ENV, buf, 1);
+
+    if(chdir(start_dir) == 0)
+        execvp(server_argv[0], server_argv);
+
+    debugf("WARNING: can't start a new master: %s\n", strerror(errno));
+    _exit(1);
+}
+
+/* sends the listening sockets, the parked sessions and the line */
+static bool restart_send(int sock)
+{
+    struct restart_msg msg;
+
+    for(int i = 0; i < n_listeners; ++i)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = RESTART_LISTENER;
+        msg.tls = (listen_watchers[i].fd == tls_socket);
+        if(!send_fd(sock, listen_watchers[i].fd, &msg, sizeof(msg)))
+            return false;
+    }
+
+    for(struct parked_session *p = parked; p; p = p->next)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = RESTART_SESSION;
+        msg.addr.sin_family = AF_INET;
+        msg.addr.sin_addr = p->addr;
+        msg.awake = p->awake;
+        msg.state = p->state;
+
+        /* only exported ones can be found again */
+        Dl_info info;
+        if(p->raw_mode_cb && dladdr((void*)p->raw_mode_cb, &info) && info.dli_sname)
+            strncpy(msg.raw_mode_cb, info.dli_sname, sizeof(msg.raw_mode_cb) - 1);
+
+        if(!send_fd(sock, p->fd, &msg, sizeof(msg)))
+            return false;
+    }
+
+    for(struct waiting_conn *c = waiting; c; c = c->next)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = RESTART_WAITING;
+        msg.tls = c->tls;
+        msg.addr = c->addr;
+        if(!send_fd(sock, c->fd, &msg, sizeof(msg)))
+            return false;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = RESTART_DONE;
+    return send(sock, &msg, sizeof(msg), 0) == sizeof(msg);
+}
+
+/* the new master says it's serving once it's taken everything */
+static bool restart_wait(int sock)
+{
+    ev_tstamp deadline = ev_time() + RESTART_TIMEOUT / 1000.0;
+    struct pollfd pfd = { sock, POLLIN, 0 };
+
+    /* children exiting interrupt us */
+    int ret;
+    do
+    {
+        int ms = (deadline - ev_time()) * 1000;
+        if(ms <= 0)
+            return false;
+        ret = poll(&pfd, 1, ms);
+    } while(ret < 0 && errno == EINTR);
+
+    char c;
+    return ret > 0 && read(sock, &c, 1) == 1;
+}
+
+/* asks a session to go, when the new master couldn't take it */
+static const char restart_kick_msg[] = "The server is restarting, please reconnect.\n";
+
+static void restart_linger_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    _exit(0);
+}
+
+/*
+ * The new master has everything but the sessions it couldn't take (TLS
+ * ones, whose state OpenSSL can't export to another process, and those
+ * busy for too long), which are told why they're being dropped; once
+ * they're gone, we exit without touching the saved state, which is its
+ * now, see server_shutdown().
+ */
+static void restart_leave(void)
+{
+    handed_over = true;
+
+    /* shutdown() would stop it listening too */
+    for(int i = 0; i < n_listeners; ++i)
+        close(listen_watchers[i].fd);
+    server_socket = tls_socket = -1;
+
+    while(parked)
+    {
+        struct parked_session *p = parked;
+        unpark_session(p);
+        close(p->fd);
+        free(p);
+        --num_clients;
+    }
+
+    while(waiting)
+    {
+        struct waiting_conn *c = waiting;
+        waiting_remove(c);
+        close(c->fd);
+        free(c);
+    }
+
+    if(!num_clients)
+        _exit(0);
+
+    void *ptr = child_map, *save;
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+        send_packet_pid(child->pid, REQ_KICK, restart_kick_msg, sizeof(restart_kick_msg));
+    }
+
+    static ev_timer linger_timer;
+    ev_timer_init(&linger_timer, restart_linger_cb, RESTART_LINGER, 0);
+    ev_timer_start(EV_DEFAULT_ &linger_timer);
+}
+
+/*
+ * Saves the world, then starts a new master and sends it everything
+ * that's parked, over a UNIX socket. Once it says it's serving, we
+ * exit without touching the sockets or the saved state, which are its
+ * now. If it doesn't, we carry on instead.
+ */
+static void restart_handover(void)
+{
+    ev_timer_stop(EV_DEFAULT_ &restart_timer);
+
+    /* it loads what's saved */
+    server_save_state(true);
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+    {
+        debugf("WARNING: socketpair: %s\n", strerror(errno));
+        restart_abort();
+        return;
+    }
+
+    pid_t pid = fork();
+    if(!pid)
+        restart_exec(fds[1]);
+    close(fds[1]);
+
+    /* a new master that's stuck can't keep us waiting forever */
+    struct timeval tv = { RESTART_TIMEOUT / 1000, 0 };
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    bool ok = pid > 0 && restart_send(fds[0]) && restart_wait(fds[0]);
+    close(fds[0]);
+
+    if(!ok)
+    {
+        /* it'll be reaped by waitpid */
+        if(pid > 0)
+            kill(pid, SIGKILL);
+        restart_abort();
+        return;
+    }
+
+    debugf("Restart: new master %d has taken over.\n", pid);
+
+    restart_leave();
+}
+
+/* mux mode: parks the sessions a worker's handed back */
+static void worker_handbacks(struct child_data *worker)
+{
+    struct pollfd pfd = { worker->ctlsock, POLLIN, 0 };
+    while(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+    {
+        struct parked_state state;
+        int fd = recv_fd(worker->ctlsock, &state, sizeof(state));
+        if(fd < 0)
+            break;
+
+        struct child_data *child = hash_lookup(child_map, &state.id);
+        if(child && child->worker == worker)
+            park_fd(fd, child, &state);
+        else
+            close(fd);
+    }
+}
+
+/*
+ * Asks every session still being served to hand its client back, as
+ * soon as it's between commands; forked children and mux workers send
+ * it over their control sockets, and event mode sessions are ours to
+ * take. Once all but the TLS ones are parked, or RESTART_GRACE is up,
+ * they're handed over.
+ */
+static void restart_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void) w;
+    (void) revents;
+
+    for(int i = 0; i < n_workers; ++i)
+        worker_handbacks(workers[i]);
+
+    /* can't park while iterating */
+    struct child_data **ours = calloc(num_clients + 1, sizeof(*ours));
+    int n_ours = 0, left = 0;
+
+    void *ptr = child_map, *save;
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+        if(child->tls || child->dead)
+            continue;
+
+        ++left;
+        if(child->session)
+            ours[n_ours++] = child;
+        else
+            send_packet_pid(child->pid, REQ_RESTART, NULL, 0);
+    }
+
+    for(int i = 0; i < n_ours; ++i)
+    {
+        struct parked_state state;
+        int fd = client_release(ours[i]->session, &state);
+        if(fd >= 0)
+        {
+            park_fd(fd, ours[i], &state);
+            --left;
+        }
+    }
+
+    free(ours);
+
+    if(!left || ev_now(EV_A) >= restart_deadline)
+        restart_handover();
+}
+
+/* new master: takes over what the old one sent, see restart_send() */
+static void restart_receive(int sock)
+{
+    debugf("Taking over from the old master.\n");
+
+    while(1)
+    {
+        struct restart_msg msg;
+        memset(&msg, 0, sizeof(msg));
+
+        int fd = recv_fd(sock, &msg, sizeof(msg));
+        if(fd < 0)
+        {
+            if(msg.type == RESTART_DONE)
+                break;
+            error("lost the old master while restarting");
+        }
+
+        switch(msg.type)
+        {
+        case RESTART_LISTENER:
+            /* -s may have been dropped since */
+            if(!msg.tls)
+                server_socket = fd;
+            else if(tls_port)
+                tls_socket = fd;
+            else
+                close(fd);
+            break;
+        case RESTART_SESSION:
+        {
+            struct parked_session *p = parked_add(fd, msg.addr.sin_addr, &msg.state);
+            p->awake = msg.awake;
+            if(msg.raw_mode_cb[0])
+                p->raw_mode_cb = dlsym(module_handle, msg.raw_mode_cb);
+            p->state.rawmode = (p->raw_mode_cb != NULL);
+            ++num_clients;
+            break;
+        }
+        case RESTART_WAITING:
+            waiting_push(fd, &msg.addr, msg.tls);
+            break;
+        default:
+            close(fd);
+            break;
+        }
+    }
+
+    debugf("Took over %d sessions, %d waiting in line.\n", num_clients, num_waiting);
+}
+
+/* new master: tells the old one it can go, and serves everyone it was
+ * serving */
+static void restart_finish(int sock)
+{
+    char c = 0;
+    if(write(sock, &c, 1) != 1)
+        debugf("WARNING: couldn't tell the old master we're serving.\n");
+    close(sock);
+
+    struct parked_session *p = parked;
+    while(p)
+    {
+        struct parked_session *next = p->next;
+        if(p->awake)
+            wake_session(p);
+        p = next;
+    }
+
+    admit_waiting();
+}
+
+static void init_signals(void)
+{
+    struct sigaction sa;
+
+    /* SIGINT and SIGTERM cause graceful shutdown */
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGINT);
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGINT, &sa, NULL) < 0)
+        error("sigaction");
+    if(sigaction(SIGTERM, &sa, NULL) < 0)
+        error("sigaction");
+
+    /* ignore SIGPIPE */
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    if(sigaction(SIGPIPE, &sa, NULL) < 0)
+        error("sigaction");
+
+    /* libev's default SIGCHLD handler exhibits some really strange
+     * behavior, which we don't like, so we use our own */
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGCHLD);
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGCHLD, &sa, NULL) < 0)
+        error("sigaction");
+
+    /* SIGUSR2 restarts, see restart_begin() */
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigusr2_handler;
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR2, &sa, NULL) < 0)
+        error("sigaction");
+}
+
+/* reads a "Name:   N kB" field from a /proc file, -1 if it's missing */
+static long proc_field(pid_t pid, const char *file, const char *name)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return -1;
+
+    long ret = -1;
+    char line[128];
+    size_t len = strlen(name);
+    while(fgets(line, sizeof(line), f))
+    {
+        if(!strncmp(line, name, len) && line[len] == ':')
+        {
+            ret = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/*
+ * -B: forks children the way clients are served, but has them wait
+ * right after child_startup() instead; reports how long fork() and
+ * startup took, and the memory each child ends up with, most of all
+ * the pages it had to copy from the master (Private_Dirty).
+ */
+static void __attribute__((noreturn)) fork_benchmark(int n)
+{
+    /* child_startup() destroys it */
+    ev_default_loop(0);
+
+    int ready[2], hold[2];
+    if(pipe(ready) < 0 || pipe(hold) < 0)
+        error("pipe");
+
+    pid_t *pids = calloc(n, sizeof(pid_t));
+    double fork_total = 0, fork_worst = 0, ready_total = 0, ready_worst = 0;
+
+    for(int i = 0; i < n; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pid_t pid = fork();
+        if(pid < 0)
+            error("fork");
+
+        if(!pid)
+        {
+            are_child = true;
+            close(ready[0]);
+            close(hold[1]);
+
+            child_startup();
+
+            char c = 0;
+            write(ready[1], &c, 1);
+
+            /* wait for the master to finish measuring */
+            read(hold[0], &c, 1);
+            _exit(0);
+        }
+
+        double us = elapsed_us(&start);
+        fork_total += us;
+        fork_worst = MAX(fork_worst, us);
+
+        char c;
+        if(read(ready[0], &c, 1) != 1)
+            error("child %d died during startup", pid);
+
+        us = elapsed_us(&start);
+        ready_total += us;
+        ready_worst = MAX(ready_worst, us);
+
+        pids[i] = pid;
+    }
+
+    long rss = 0, dirty = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        rss += proc_field(pids[i], "smaps_rollup", "Rss");
+        dirty += proc_field(pids[i], "smaps_rollup", "Private_Dirty");
+    }
+
+    debugf("Fork benchmark: %d %s children\n", n, slim_children ? "slim" : "full");
+    debugf("  fork():           %.0f us average, %.0f us worst\n", fork_total / n, fork_worst);
+    debugf("  fork to ready:    %.0f us average, %.0f us worst\n", ready_total / n, ready_worst);
+    debugf("  child RSS:        %ld kB average\n", rss / n);
+    debugf("  copied (dirty):   %ld kB average\n", dirty / n);
+    debugf("  master RSS:       %ld kB\n", proc_field(getpid(), "smaps_rollup", "Rss"));
+
+    close(hold[1]);
+    for(int i = 0; i < n; ++i)
+        waitpid(pids[i], NULL, 0);
+
+    free(pids);
+    exit(0);
 }
 
 static void __attribute__((noreturn)) print_help(char *argv[])
@@ -435,10 +2240,31 @@ static void __attribute__((noreturn)) print_help(char *argv[])
     debugf("NetCosm MUD server\n");
     debugf("\n");
     debugf(" -a USER PASS\tautomatic setup with USER/PASS\n");
+    debugf(" -B NUM\t\tfork NUM children, report fork latency and memory use, then exit\n");
+    debugf(" -C CERT\tPEM certificate chain for -s\n");
+    debugf(" -c STARTUP\tchild startup: slim (default) or full, which frees the master's state\n");
     debugf(" -d PREFIX\tcreate and change to PREFIX before writing data files\n");
     debugf(" -h, -?\t\tshow this help\n");
+    debugf(" -i IPC\t\tchild-master IPC: ring (shared memory, default) or pipe\n");
+    debugf(" -I SECS\thibernate clients idle for SECS at the prompt, in the forked modes\n"
+           "\t\t(default 0: never)\n");
+    debugf(" -K KEY\t\tPEM private key for -s (default: in CERT)\n");
+    debugf(" -M NUM\t\tserve at most NUM clients at once, 0 for no limit (default %d)\n",
+           DEFAULT_MAX_CLIENTS);
+    debugf(" -m MODE\tclient model: fork (default), prefork, event, or mux\n");
+    debugf(" -N NUM\t\tserve up to NUM clients per worker in mux mode (default %d)\n", DEFAULT_MUX_CLIENTS);
+    debugf(" -o DROP:MAX\twith DROP KB of output queued for a client, drop broadcasts to it;\n"
+           "\t\twith MAX KB, disconnect it (default %d:%d)\n",
+           DEFAULT_QUEUE_DROP / 1024, DEFAULT_QUEUE_MAX / 1024);
     debugf(" -p PORT\tlisten on PORT\n");
+    debugf(" -P NUM\t\tkeep NUM idle children in prefork mode (default %d)\n", DEFAULT_POOL_SIZE);
+    debugf(" -Q NUM\t\tlet NUM clients wait in line when full, turn away the rest\n"
+           "\t\t(default %d)\n", DEFAULT_MAX_WAITING);
+    debugf(" -s PORT\taccept TLS connections on PORT, with -C\n");
+    debugf(" -t NUM\t\trun rooms on NUM threads, not in event mode (default 0: none)\n");
+    debugf(" -u\t\tin event mode, do client I/O through io_uring if the kernel can\n");
     debugf(" -w MODULE\tuse a different world module\n");
+    debugf(" -x CIPHERS\tOpenSSL cipher list for -s, may include TLS 1.3 suites\n");
     exit(0);
 }
 
@@ -466,21 +2292,145 @@ static void parse_args(int argc, char *argv[])
                     autouser = argv[++i];
                     autopass = argv[++i];
                     break;
+                case 'B': /* fork benchmark */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    fork_bench = strtol(argv[++i], NULL, 10);
+                    if(fork_bench < 1)
+                        print_help(argv);
+                    break;
+                case 'C': /* TLS certificate */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    tls_cert = argv[++i];
+                    break;
+                case 'c': /* child startup */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    ++i;
+                    if(!strcmp(argv[i], "slim"))
+                        slim_children = true;
+                    else if(!strcmp(argv[i], "full"))
+                        slim_children = false;
+                    else
+                        print_help(argv);
+                    break;
                 case 'd': /* set data prefix */
                     if(i + 1 > argc)
                         print_help(argv);
                     data_prefix = argv[++i];
                     break;
+                case 'i': /* IPC backend */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    ++i;
+                    if(!strcmp(argv[i], "ring"))
+                        ipc_backend = IPC_RING;
+                    else if(!strcmp(argv[i], "pipe"))
+                        ipc_backend = IPC_PIPE;
+                    else
+                        print_help(argv);
+                    break;
+                case 'I': /* idle timeout */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    idle_timeout = strtol(argv[++i], NULL, 10);
+                    if(idle_timeout < 0)
+                        print_help(argv);
+                    break;
+                case 'K': /* TLS key */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    tls_key = argv[++i];
+                    break;
+                case 'M': /* session limit */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    max_clients = strtol(argv[++i], NULL, 10);
+                    if(max_clients < 0)
+                        print_help(argv);
+                    break;
+                case 'm': /* process model */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    ++i;
+                    if(!strcmp(argv[i], "fork"))
+                        server_mode = MODE_FORK;
+                    else if(!strcmp(argv[i], "prefork"))
+                        server_mode = MODE_PREFORK;
+                    else if(!strcmp(argv[i], "event"))
+                        server_mode = MODE_EVENT;
+                    else if(!strcmp(argv[i], "mux"))
+                        server_mode = MODE_MUX;
+                    else
+                        print_help(argv);
+                    break;
+                case 'N': /* clients per mux worker */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    mux_clients = strtol(argv[++i], NULL, 10);
+                    if(mux_clients < 1)
+                        print_help(argv);
+                    break;
+                case 'o': /* output queue limits */
+                {
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    char *end;
+                    long drop = strtol(argv[++i], &end, 10);
+                    if(*end != ':')
+                        print_help(argv);
+                    long max = strtol(end + 1, &end, 10);
+                    if(*end || drop < 0 || max < 1 || drop > max)
+                        print_help(argv);
+                    client_queue_drop = drop * 1024;
+                    client_queue_max = max * 1024;
+                    break;
+                }
                 case 'p': /* set port */
                     if(i + 1 > argc)
                         print_help(argv);
                     port = strtol(argv[++i], NULL, 10);
                     break;
+                case 'P': /* prefork pool size */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    pool_size = strtol(argv[++i], NULL, 10);
+                    if(pool_size < 1)
+                        print_help(argv);
+                    break;
+                case 'Q': /* admission queue length */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    max_waiting = strtol(argv[++i], NULL, 10);
+                    if(max_waiting < 0)
+                        print_help(argv);
+                    break;
+                case 's': /* TLS port */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    tls_port = strtol(argv[++i], NULL, 10);
+                    break;
+                case 't': /* room threads */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    room_threads = strtol(argv[++i], NULL, 10);
+                    if(room_threads < 0)
+                        print_help(argv);
+                    break;
+                case 'u': /* io_uring */
+                    use_uring = true;
+                    break;
                 case 'w': /* world */
                     if(i + 1 > argc)
                         print_help(argv);
                     world_module = argv[++i];
                     break;
+                case 'x': /* TLS ciphers */
+                    if(i + 1 > argc)
+                        print_help(argv);
+                    tls_ciphers = argv[++i];
+                    break;
                 default:
                     c = 'h';
                     goto retry;
@@ -512,12 +2462,35 @@ int server_main(int argc, char *argv[])
 
     parse_args(argc, argv);
 
+    /* for a restart, see restart_exec() */
+    server_argv = argv;
+    start_dir = getcwd(NULL, 0);
+
+    /* we're taking over from an old master */
+    int restart_sock = -1;
+    if(getenv(RESTART_ENV))
+    {
+        restart_sock = strtol(getenv(RESTART_ENV), NULL, 10);
+        unsetenv(RESTART_ENV);
+    }
+
     /* load default if none specified */
     if(!world_module)
     {
         error("no world module specified");
     }
 
+    if(tls_port && !tls_cert)
+    {
+        debugf("-s needs a certificate, see -C.\n");
+        exit(0);
+    }
+
+    /* paths are relative to where we were started, not the data
+     * prefix; every child shares the context made here */
+    if(tls_port)
+        tls_init(tls_cert, tls_key, tls_ciphers);
+
     /* this must be done before any world module data is used */
     load_worldfile();
 
@@ -547,9 +2520,17 @@ int server_main(int argc, char *argv[])
     hash_setfreedata_cb(child_map, free_child_data);
     hash_setfreekey_cb(child_map, free);
 
-    debugf("Listening on port %d.\n", port);
+    user_map = hash_init(16, hash_djb, compare_strings);
+
+    if(fork_bench)
+        fork_benchmark(fork_bench);
 
-    server_socket = server_bind();
+    /* sessions there don't have a process of their own to drop */
+    if((server_mode == MODE_EVENT || server_mode == MODE_MUX) && idle_timeout)
+    {
+        debugf("Hibernation is only for the forked modes, ignoring -I.\n");
+        idle_timeout = 0;
+    }
 
     struct ev_loop *loop = ev_default_loop(0);
 
@@ -557,14 +2538,68 @@ int server_main(int argc, char *argv[])
      * because libev grabs SIGCHLD in the process */
     init_signals();
 
-    ev_io server_watcher;
-    ev_io_init(&server_watcher, new_connection_cb, server_socket, EV_READ);
-    ev_set_priority(&server_watcher, EV_MAXPRI);
+    /* the old master's listening sockets are ours now */
+    if(restart_sock >= 0)
+        restart_receive(restart_sock);
+
+    if(server_socket < 0)
+    {
+        debugf("Listening on port %d.\n", port);
+        server_socket = server_bind(port);
+    }
+
+    if(tls_port && tls_socket < 0)
+    {
+        debugf("Listening for TLS on port %d.\n", tls_port);
+        tls_socket = server_bind(tls_port);
+    }
+
+    if(use_uring && server_mode != MODE_EVENT)
+        debugf("io_uring is only for event mode, ignoring -u.\n");
+    else if(use_uring)
+        uring_init();
+
+    int listeners[] = { server_socket, tls_socket };
+    n_listeners = tls_socket >= 0 ? 2 : 1;
+
+    for(int i = 0; i < n_listeners; ++i)
+    {
+        ev_io_init(&listen_watchers[i], new_connection_cb, listeners[i], EV_READ);
+        ev_set_priority(&listen_watchers[i], EV_MAXPRI);
+        accept_ops[i].cb = uring_accept_cb;
+    }
+
+    ev_init(&accept_pause_timer, accept_pause_cb);
 
-    ev_io_start(EV_A_ &server_watcher);
+    listen_start();
+
+    if(server_mode == MODE_PREFORK)
+    {
+        idle_pool = calloc(pool_size, sizeof(struct child_data*));
+        ev_idle_init(&pool_watcher, pool_refill_cb);
+        ev_set_priority(&pool_watcher, EV_MINPRI);
+        ev_idle_start(EV_A_ &pool_watcher);
+    }
+
+    ev_prepare reap_watcher;
+    if(server_mode == MODE_EVENT)
+        ev_prepare_init(&reap_watcher, event_reap_cb);
+    else
+        ev_prepare_init(&reap_watcher, reap_cb);
+    ev_prepare_start(EV_A_ &reap_watcher);
+
+    /* event mode sessions wait for replies in-line, so can't have
+     * their requests run elsewhere */
+    if(server_mode == MODE_EVENT && room_threads)
+        debugf("Room threads aren't supported in event mode, ignoring -t.\n");
+    else
+        zone_init(room_threads);
 
     atexit(server_shutdown);
 
+    if(restart_sock >= 0)
+        restart_finish(restart_sock);
+
     /* everything's ready, hand it over to libev */
     ev_loop(loop, 0);
 
@@ -20,9 +20,17 @@
 #pragma once
 
 #include "globals.h"
+#include "telnet.h"
 
 enum room_id;
 
+struct client_session;
+struct ipc_shm;
+struct zone_job;
+
+/* how clients are served */
+enum server_mode { MODE_FORK = 0, MODE_PREFORK, MODE_EVENT, MODE_MUX };
+
 /* everything the server needs to manage its children */
 /* aliased as user_t */
 struct child_data {
@@ -32,27 +40,154 @@ struct child_data {
     int      readpipe[2];
     int      outpipe[2];
 
+    /* shared memory ring buffers, NULL if using pipes; if set, the
+     * pipes above are eventfds used only for wakeups */
+    struct ipc_shm *shm;
+
+    /* packets waiting to be written to the child, see send_packet() */
+    unsigned char *outbuf;
+    size_t   outlen;
+    bool     outqueued;
+    struct child_data *next_out;
+
+    /* shared memory: packets the ring had no room for, oldest first,
+     * as | LENGTH | PACKET |; see flush_packets() */
+    unsigned char *spill;
+    size_t   spill_len, spill_size;
+    ev_tstamp spill_since; /* when it last made room */
+    struct child_data *next_spill;
+
+    /* for passing file descriptors to an idle child, -1 if none */
+    int      ctlsock;
+
     /* user state */
     int      state;
     room_id  room;
-    char     *user;
+    char     *user; /* points to username once logged in, NULL before */
+    char     username[MAX_NAME_LEN + 1];
+
+    /* output queued for the client, as last reported by the child */
+    size_t   outq;
+
+    /* GMCP_* flags from REQ_GMCP; read by room threads, so only
+     * accessed atomically */
+    unsigned char gmcp;
+
+    /* the next session logged in as the same user, see server_user_rename() */
+    struct child_data *next_login;
 
     /* libev watchers */
     ev_io    *io_watcher;
     ev_child *sigchld_watcher;
 
+    /* forked modes: asks the child to hibernate, see idle_cb() */
+    ev_timer *idle_timer;
+
     /* raw mode callback (NULL if none, set by world module) */
     void     (*raw_mode_cb)(struct child_data*, char *data, size_t len);
 
     /* remote IP */
     struct in_addr addr;
+
+    /* came in on the TLS port, so can't be handed to a new master */
+    bool     tls;
+
+    /* event mode: the session served by the master, NULL otherwise */
+    struct client_session *session;
+
+    /* mux mode: the worker serving this session, NULL otherwise */
+    struct child_data *worker;
+
+    /* mux mode: number of sessions a worker is serving */
+    int      nsessions;
+
+    /* room threads: a job of ours is running, and the requests
+     * waiting behind it, see dispatch_request() */
+    bool     busy;
+    struct zone_job *pending, *pending_tail;
+
+    /* room threads: gone, but still being taken out of its room */
+    bool     dead;
+};
+
+/* as much input as a session holds, see CLIENT_IN_SZ */
+#define LOGIN_INPUT_SZ 1024
+
+/* what the master keeps of a hibernating session, to resume it with */
+struct parked_state {
+    char     user[MAX_NAME_LEN + 1];
+    bool     admin;
+    room_id  room;
+    bool     rawmode;
+    unsigned char gmcp;
+    uint16_t term_width, term_height;
+    bool     mccp;
+
+    /* mux mode: which of a worker's sessions it was */
+    pid_t    id;
+};
+
+/* sent along with a client socket to a waiting child */
+struct handoff {
+    struct sockaddr_in addr;
+    int nclients;
+
+    /* mux mode: the ID the master knows the session as */
+    pid_t id;
+
+    /* it came in on the TLS port, and hasn't shaken hands yet */
+    bool tls;
+
+    /* the session is waking from hibernation, as it was left */
+    bool resume;
+    struct parked_state state;
+
+    /* the master's just logged it in, and hands over what it read of
+     * the client's input but didn't handle; see client_next_authed() */
+    bool login;
+    struct telnet_state telnet;
+    char input[LOGIN_INPUT_SZ];
+    unsigned input_len;
+};
+
+/* how new connections have fared, see server_conn_stats() */
+struct conn_stats {
+    unsigned long accepted;
+    unsigned long queued;     /* had to wait in line */
+    unsigned long rejected;   /* the line was full too */
+    unsigned long abandoned;  /* hung up while waiting */
+    unsigned long errors;     /* accept() failed */
+
+    /* right now */
+    int waiting;              /* in line */
+    int backlog;              /* the kernel's accepted, we haven't */
+    int max_clients;          /* 0 for no limit */
 };
 
 typedef struct child_data user_t;
 
 extern volatile int num_clients;
+extern int num_hibernating;
 extern void *child_map;
 extern bool are_child;
+extern enum server_mode server_mode;
 
 int server_main(int argc, char *argv[]);
 void server_save_state(bool force);
+
+void server_conn_stats(struct conn_stats *stats);
+
+/* event and mux modes: forget a session which has ended */
+void server_drop_session(user_t *child);
+
+/* index of sessions by login name, kept up to date as child->user
+ * changes; lookup returns the first session logged in as a user, the
+ * rest follow through next_login. del also clears child->user. */
+void server_user_rename(user_t *child, const char *name);
+void server_user_del(user_t *child);
+user_t *server_user_lookup(const char *user);
+
+/* room threads hold this while following lookups and next_login, or
+ * reading other sessions' names */
+void server_users_lock(void);
+void server_users_unlock(void);
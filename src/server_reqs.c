@@ -18,47 +18,295 @@
 
 #include "globals.h"
 
+#include "client_reqs.h"
 #include "hash.h"
+#include "ipc.h"
 #include "multimap.h"
 #include "server.h"
 #include "server_reqs.h"
 #include "userdb.h"
 #include "world.h"
+#include "zone.h"
 
-/* sends a single packet to a child, mostly reliable */
+/* for CLIENT STATS: requests handled, and the heap allocations made
+ * while handling them, which should stay at 0 once warmed up; room
+ * threads update these too */
+static unsigned long n_requests = 0, request_allocs = 0;
 
-/* splits REQ_BCASTMSG message into multiple packets if data length
- * exceeds MSG_MAX, however, other requests will not be split and will
- * cause a failed assertion */
+/* the request being handled by this thread, replies to its sender are
+ * tagged with its ID */
+static __thread struct child_data *reply_to = NULL;
+static __thread reqid_t reply_id = 0;
 
-static void send_packet(struct child_data *child, unsigned char cmd,
-                        const void *data, size_t datalen)
+/* replies are batched per child and written once the request is
+ * done; these are the children with something in their batch */
+static struct child_data *out_queue = NULL;
+
+/* children whose ring was full, with packets held back for them */
+static struct child_data *spilled = NULL;
+static ev_timer spill_timer;
+
+#define SPILL_RETRY 0.01
+
+static void spill_unlink(struct child_data *child)
+{
+    struct child_data **iter = &spilled;
+    while(*iter != child)
+        iter = &(*iter)->next_spill;
+    *iter = child->next_spill;
+    child->next_spill = NULL;
+}
+
+/* sends as much of what's held back for dest as its ring will take;
+ * true once it's all gone */
+static bool unspill(struct child_data *dest)
+{
+    size_t off = 0;
+    while(off < dest->spill_len)
+    {
+        uint16_t len;
+        memcpy(&len, dest->spill + off, sizeof(len));
+        if(!ipc_send(dest->shm, IPC_TO_CHILD, dest->outpipe[1],
+                     dest->spill + off + sizeof(len), len, 0))
+            break;
+        off += sizeof(len) + len;
+    }
+
+    if(off)
+    {
+        memmove(dest->spill, dest->spill + off, dest->spill_len - off);
+        dest->spill_len -= off;
+        dest->spill_since = ev_now(EV_DEFAULT);
+    }
+
+    return !dest->spill_len;
+}
+
+static void spill_cb(EV_P_ ev_timer *w, int revents)
+{
+    (void) revents;
+
+    struct child_data *child = spilled;
+    while(child)
+    {
+        struct child_data *next = child->next_spill;
+        if(unspill(child))
+            spill_unlink(child);
+        else if(ev_now(EV_A) - child->spill_since > IPC_SEND_TIMEOUT / 1000.0)
+        {
+            /* like one whose pipe is broken, it's dropped once it's
+             * reaped */
+            debugf("WARNING: child %d isn't reading, killing it\n", child->pid);
+            kill(child->pid, SIGKILL);
+            spill_unlink(child);
+            child->spill_len = 0;
+        }
+        child = next;
+    }
+
+    if(!spilled)
+        ev_timer_stop(EV_A_ w);
+}
+
+/* holds a packet back until dest's ring has room for it */
+static void spill_packet(struct child_data *dest, const void *buf, size_t len)
+{
+    uint16_t len16 = len;
+
+    if(dest->spill_len + sizeof(len16) + len > IPC_SPILL_MAX)
+    {
+        debugf("WARNING: child %d is too far behind, killing it\n", dest->pid);
+        kill(dest->pid, SIGKILL);
+        return;
+    }
+
+    if(dest->spill_len + sizeof(len16) + len > dest->spill_size)
+    {
+        dest->spill_size = MAX(dest->spill_size * 2, 4 * MSG_MAX);
+        dest->spill = realloc(dest->spill, dest->spill_size);
+    }
+
+    memcpy(dest->spill + dest->spill_len, &len16, sizeof(len16));
+    memcpy(dest->spill + dest->spill_len + sizeof(len16), buf, len);
+
+    if(!dest->spill_len)
+    {
+        dest->spill_since = ev_now(EV_DEFAULT);
+        dest->next_spill = spilled;
+        spilled = dest;
+
+        if(!ev_is_active(&spill_timer))
+        {
+            ev_timer_init(&spill_timer, spill_cb, SPILL_RETRY, SPILL_RETRY);
+            ev_timer_start(EV_DEFAULT_ &spill_timer);
+        }
+    }
+
+    dest->spill_len += sizeof(len16) + len;
+}
+
+static void flush_packets(struct child_data *dest)
+{
+    if(!dest->outlen)
+        return;
+
+    if(dest->shm)
+    {
+        /* a child that's fallen behind mustn't hold everyone up, so
+         * what its ring can't take waits, in order, for it to catch
+         * up */
+        if(!unspill(dest) ||
+           !ipc_send(dest->shm, IPC_TO_CHILD, dest->outpipe[1], dest->outbuf, dest->outlen, 0))
+            spill_packet(dest, dest->outbuf, dest->outlen);
+    }
+    else
+    {
+    tryagain:
+        if(write(dest->outpipe[1], dest->outbuf, dest->outlen) < 0)
+        {
+            /* write can fail, so we try again */
+            if(errno == EAGAIN)
+                goto tryagain;
+        }
+    }
+
+    dest->outlen = 0;
+}
+
+static void flush_all_packets(void)
+{
+    while(out_queue)
+    {
+        struct child_data *dest = out_queue;
+        out_queue = dest->next_out;
+        dest->outqueued = false;
+        flush_packets(dest);
+    }
+}
+
+void discard_packets(user_t *child)
+{
+    if(child->outqueued)
+    {
+        struct child_data **iter = &out_queue;
+        while(*iter != child)
+            iter = &(*iter)->next_out;
+        *iter = child->next_out;
+        child->outqueued = false;
+    }
+
+    free(child->outbuf);
+    child->outbuf = NULL;
+    child->outlen = 0;
+
+    if(child->spill_len)
+        spill_unlink(child);
+    free(child->spill);
+    child->spill = NULL;
+    child->spill_len = child->spill_size = 0;
+
+    while(child->pending)
+    {
+        struct zone_job *job = child->pending;
+        child->pending = job->next;
+        zone_job_free(job);
+    }
+    child->pending_tail = NULL;
+}
+
+/* queues a single record to a child, main thread only */
+static void queue_packet(struct child_data *child, reqid_t id, unsigned char cmd,
+                         const void *data, size_t datalen)
+{
+    /*
+     * master->child packets hold one or more records:
+     * | LENGTH | SID (mux mode only) | REQUEST ID | CMD | DATA |
+     */
+    size_t sid_len = child->worker ? sizeof(pid_t) : 0;
+    size_t hdr = sizeof(uint16_t) + sid_len + sizeof(reqid_t);
+
+    /* being taken out of its room, see retire_child() */
+    if(child->dead)
+        return;
+
+    /* event mode: the client lives in our address space */
+    if(child->session)
+    {
+        client_deliver(child->session, id, cmd, data, datalen);
+        return;
+    }
+
+    struct child_data *dest = child->worker ? child->worker : child;
+
+    if(dest->outlen + hdr + 1 + datalen > MSG_MAX)
+        flush_packets(dest);
+
+    unsigned char *rec = dest->outbuf + dest->outlen;
+    uint16_t reclen = hdr - sizeof(uint16_t) + 1 + datalen;
+
+    memcpy(rec, &reclen, sizeof(reclen));
+    rec += sizeof(reclen);
+    if(sid_len)
+        memcpy(rec, &child->pid, sid_len);
+    memcpy(rec + sid_len, &id, sizeof(id));
+    rec += sid_len + sizeof(id);
+    *rec++ = cmd;
+    if(datalen)
+        memcpy(rec, data, datalen);
+
+    dest->outlen += hdr + 1 + datalen;
+
+    if(!dest->outqueued)
+    {
+        dest->outqueued = true;
+        dest->next_out = out_queue;
+        out_queue = dest;
+    }
+}
+
+/* the biggest record header, which has a session ID */
+#define REC_HDR (sizeof(uint16_t) + sizeof(pid_t) + sizeof(reqid_t))
+
+/* splits REQ_BCASTMSG message into multiple records if data length
+ * exceeds MSG_MAX, however, other requests will not be split and will
+ * cause a failed assertion; room threads only have the PID, and leave
+ * the sending to the main thread */
+static void send_packet_id(struct child_data *child, pid_t pid, reqid_t id,
+                           unsigned char cmd, const void *data, size_t datalen)
 {
-    assert(datalen < MSG_MAX || cmd == REQ_BCASTMSG);
-    unsigned char pkt[MSG_MAX];
-    pkt[0] = cmd;
+    if(!data)
+        datalen = 0;
 
-    if(cmd == REQ_BCASTMSG && (data?datalen:0) + 1 > MSG_MAX)
+    assert(datalen + REC_HDR < MSG_MAX || cmd == REQ_BCASTMSG);
+
+    if(cmd == REQ_BCASTMSG && datalen + REC_HDR + 1 > MSG_MAX)
     {
         /* split long messages */
         const char *ptr = data, *stop = (const char*)data + datalen;
         while(ptr < stop)
         {
-            send_packet(child, cmd, ptr, MIN(stop - ptr, MSG_MAX - 1));
-            ptr += MSG_MAX - 1;
+            send_packet_id(child, pid, id, cmd, ptr, MIN((size_t)(stop - ptr), MSG_MAX - REC_HDR - 1));
+            ptr += MSG_MAX - REC_HDR - 1;
         }
         return;
     }
 
-    if(data && datalen)
-        memcpy(pkt + 1, data, datalen);
-tryagain:
-    if(write(child->outpipe[1], pkt, (data?datalen:0) + 1) < 0)
-    {
-        /* write can fail, so we try again */
-        if(errno == EAGAIN)
-            goto tryagain;
-    }
+    if(zone_current())
+        zone_reply(pid, id, cmd, data, datalen);
+    else
+        queue_packet(child, id, cmd, data, datalen);
+}
+
+/* queues a single record to a child, mostly reliable */
+static void send_packet(struct child_data *child, unsigned char cmd,
+                        const void *data, size_t datalen)
+{
+    send_packet_id(child, child->pid, (child == reply_to) ? reply_id : 0,
+                   cmd, data, datalen);
+
+    /* nobody will flush it for us outside of a request */
+    if(!reply_to && !zone_current())
+        flush_all_packets();
 }
 
 void child_toggle_rawmode(struct child_data *child, void (*cb)(user_t*, char *data, size_t len))
@@ -74,15 +322,355 @@ void child_toggle_rawmode(struct child_data *child, void (*cb)(user_t*, char *da
     }
 }
 
+/* messages are formatted into this rather than onto the heap, unless
+ * they're too long for it, or a message sent from within delivering
+ * another one needs it too */
+static __thread char msg_scratch[MSG_MAX * 4];
+static __thread bool scratch_busy = false;
+
+static char *format_msg(int *len, const char *fmt, va_list ap)
+{
+    va_list copy;
+    va_copy(copy, ap);
+
+    char *buf = NULL;
+    if(!scratch_busy)
+    {
+        *len = vsnprintf(msg_scratch, sizeof(msg_scratch), fmt, ap);
+        if(*len < (int)sizeof(msg_scratch))
+        {
+            buf = msg_scratch;
+            scratch_busy = true;
+        }
+    }
+
+    if(!buf)
+        *len = vasprintf(&buf, fmt, copy);
+
+    va_end(copy);
+    return buf;
+}
+
+static void free_msg(char *buf)
+{
+    if(buf == msg_scratch)
+        scratch_busy = false;
+    else
+        free(buf);
+}
+
 void __attribute__((format(printf,2,3))) send_msg(struct child_data *child, const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    char *buf;
-    int len = vasprintf(&buf, fmt, ap);
+    int len;
+    char *buf = format_msg(&len, fmt, ap);
     va_end(ap);
     send_packet(child, REQ_BCASTMSG, buf, len);
-    free(buf);
+    free_msg(buf);
+}
+
+/*** targeted delivery: these cost O(recipients), not O(clients) ***/
+
+size_t send_packet_room(room_id id, user_t *except, unsigned char cmd,
+                        const void *data, size_t datalen)
+{
+    struct room_t *room = room_get(id);
+
+    size_t n = 0;
+    void *ptr = room->users, *save;
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+        if(child == except)
+            continue;
+        send_packet(child, cmd, data, datalen);
+        ++n;
+    }
+    return n;
+}
+
+size_t send_packet_user(const char *user, unsigned char cmd,
+                        const void *data, size_t datalen)
+{
+    size_t n = 0;
+    server_users_lock();
+    for(user_t *child = server_user_lookup(user); child; child = child->next_login, ++n)
+        send_packet(child, cmd, data, datalen);
+    server_users_unlock();
+    return n;
+}
+
+bool send_packet_pid(pid_t pid, unsigned char cmd, const void *data, size_t datalen)
+{
+    /* room threads can't look at child_map, finish_job() does instead */
+    if(zone_current())
+    {
+        send_packet_id(NULL, pid, (reply_to && reply_to->pid == pid) ? reply_id : 0,
+                       cmd, data, datalen);
+        return true;
+    }
+
+    user_t *child = hash_lookup(child_map, &pid);
+
+    /* mux workers aren't clients */
+    if(!child || (server_mode == MODE_MUX && !child->worker))
+        return false;
+
+    send_packet(child, cmd, data, datalen);
+    return true;
+}
+
+void send_packet_set(user_t **children, size_t n, unsigned char cmd,
+                     const void *data, size_t datalen)
+{
+    for(size_t i = 0; i < n; ++i)
+        send_packet(children[i], cmd, data, datalen);
+}
+
+size_t __attribute__((format(printf,3,4))) send_msg_room(room_id room, user_t *except,
+                                                          const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len;
+    char *buf = format_msg(&len, fmt, ap);
+    va_end(ap);
+    size_t n = send_packet_room(room, except, REQ_BCASTMSG, buf, len);
+    free_msg(buf);
+    return n;
+}
+
+size_t __attribute__((format(printf,2,3))) send_msg_user(const char *user, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len;
+    char *buf = format_msg(&len, fmt, ap);
+    va_end(ap);
+    size_t n = send_packet_user(user, REQ_BCASTMSG, buf, len);
+    free_msg(buf);
+    return n;
+}
+
+bool __attribute__((format(printf,2,3))) send_msg_pid(pid_t pid, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len;
+    char *buf = format_msg(&len, fmt, ap);
+    va_end(ap);
+    bool ret = send_packet_pid(pid, REQ_BCASTMSG, buf, len);
+    free_msg(buf);
+    return ret;
+}
+
+void __attribute__((format(printf,3,4))) send_msg_set(user_t **children, size_t n,
+                                                       const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len;
+    char *buf = format_msg(&len, fmt, ap);
+    va_end(ap);
+    send_packet_set(children, n, REQ_BCASTMSG, buf, len);
+    free_msg(buf);
+}
+
+/*** GMCP: the same events as data, for clients which want them ***/
+
+static bool gmcp_flag(struct child_data *child, unsigned char flag)
+{
+    return __atomic_load_n(&child->gmcp, __ATOMIC_RELAXED) & flag;
+}
+
+/* lists are cut short here, keeping messages well inside a packet */
+#define GMCP_LIST_MAX (MSG_MAX / 2)
+
+static const char *gmcp_dirs[NUM_DIRECTIONS] = {
+    "n", "ne", "e", "se", "s", "sw", "w", "nw", "u", "d", "in", "out",
+};
+
+/* appends s to buf as a JSON string */
+static void json_str(char *buf, size_t sz, const char *s)
+{
+    size_t len = strlen(buf);
+    if(len + 3 > sz)
+        return;
+
+    buf[len++] = '"';
+    for(; *s && len + 8 < sz; ++s)
+    {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\')
+        {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        }
+        else if(c < 0x20)
+            len += snprintf(buf + len, sz - len, "\\u%04x", c);
+        else
+            buf[len++] = c;
+    }
+    buf[len++] = '"';
+    buf[len] = '\0';
+}
+
+static void send_gmcp(struct child_data *child, const char *msg)
+{
+    if(gmcp_flag(child, GMCP_ON))
+        send_packet(child, REQ_GMCP, msg, strlen(msg));
+}
+
+/* to everyone in a room who isn't logged in as child's user */
+static void send_gmcp_others(room_id id, struct child_data *child, const char *msg)
+{
+    void *ptr = room_get(id)->users, *save;
+    server_users_lock();
+    while(1)
+    {
+        struct child_data *other = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!other)
+            break;
+
+        if(other != child && strcmp(other->user, child->user))
+            send_gmcp(other, msg);
+    }
+    server_users_unlock();
+}
+
+/* Room.Info and Room.Players, for the child alone */
+static void send_gmcp_room(struct child_data *child, room_id id)
+{
+    if(!gmcp_flag(child, GMCP_ON))
+        return;
+
+    struct room_t *room = room_get(id);
+    char msg[MSG_MAX - REC_HDR], name[GMCP_LIST_MAX], exits[256];
+
+    name[0] = '\0';
+    json_str(name, sizeof(name), room->data.name ? room->data.name : "");
+
+    size_t len = 0;
+    exits[0] = '\0';
+    for(int i = 0; i < NUM_DIRECTIONS; ++i)
+        if(room->adjacent[i] != ROOM_NONE)
+            len += snprintf(exits + len, sizeof(exits) - len, "%s\"%s\":%d",
+                            len ? "," : "", gmcp_dirs[i], room->adjacent[i]);
+
+    snprintf(msg, sizeof(msg), "Room.Info {\"num\":%d,\"name\":%s,\"exits\":{%s}}",
+             id, name, exits);
+    send_gmcp(child, msg);
+
+    /* everyone else there, as list_room_users() sees them */
+    char players[GMCP_LIST_MAX] = "[";
+    void *ptr = room->users, *save;
+    server_users_lock();
+    while(1)
+    {
+        struct child_data *other = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!other)
+            break;
+
+        if(other == child || !strcmp(other->user, child->user))
+            continue;
+        if(strlen(players) + 2 * MAX_NAME_LEN + 4 >= sizeof(players))
+            break;
+
+        if(players[1])
+            strlcat(players, ",", sizeof(players));
+        json_str(players, sizeof(players), other->user);
+    }
+    server_users_unlock();
+    strlcat(players, "]", sizeof(players));
+
+    snprintf(msg, sizeof(msg), "Room.Players %s", players);
+    send_gmcp(child, msg);
+}
+
+void send_gmcp_enter(room_id id, user_t *child)
+{
+    send_gmcp_room(child, id);
+
+    char msg[MSG_MAX - REC_HDR] = "Room.AddPlayer {\"name\":";
+    json_str(msg, sizeof(msg), child->user);
+    strlcat(msg, "}", sizeof(msg));
+    send_gmcp_others(id, child, msg);
+}
+
+void send_gmcp_leave(room_id id, user_t *child)
+{
+    char msg[MSG_MAX - REC_HDR] = "Room.RemovePlayer {\"name\":";
+    json_str(msg, sizeof(msg), child->user);
+    strlcat(msg, "}", sizeof(msg));
+    send_gmcp_others(id, child, msg);
+}
+
+/* appends {"id":...,"name":...} to buf */
+static void json_item(char *buf, size_t sz, const struct object_t *obj)
+{
+    size_t len = strlen(buf);
+    snprintf(buf + len, sz - len, "{\"id\":\"%"PRI_OBJID"\",\"name\":", obj->id);
+    json_str(buf, sz, obj->name);
+    strlcat(buf, "}", sz);
+}
+
+void send_gmcp_item(const char *user, const struct object_t *obj, bool added)
+{
+    char msg[MSG_MAX - REC_HDR];
+    snprintf(msg, sizeof(msg), "Char.Items.%s {\"location\":\"inv\",\"item\":",
+             added ? "Add" : "Remove");
+    json_item(msg, GMCP_LIST_MAX, obj);
+    strlcat(msg, "}", sizeof(msg));
+
+    server_users_lock();
+    for(user_t *child = server_user_lookup(user); child; child = child->next_login)
+        send_gmcp(child, msg);
+    server_users_unlock();
+}
+
+void send_gmcp_items(user_t *child)
+{
+    if(!gmcp_flag(child, GMCP_ON))
+        return;
+
+    char msg[MSG_MAX - REC_HDR] = "Char.Items.List {\"location\":\"inv\",\"items\":[";
+    bool first = true;
+
+    userdb_lock();
+
+    void *ptr = userdb_lookup(child->user)->objects, *save;
+    while(1)
+    {
+        const struct multimap_list *iter = multimap_iterate(ptr, &save, NULL);
+        if(!iter)
+            break;
+        ptr = NULL;
+
+        /* aliases list the same objects again */
+        if(strcmp(iter->key, ((struct object_t*)iter->val)->name))
+            continue;
+
+        for(; iter; iter = iter->next)
+        {
+            if(strlen(msg) + 2 * strlen(iter->key) + 40 >= GMCP_LIST_MAX)
+                break;
+            if(!first)
+                strlcat(msg, ",", sizeof(msg));
+            json_item(msg, sizeof(msg), iter->val);
+            first = false;
+        }
+    }
+
+    userdb_unlock();
+
+    strlcat(msg, "]}", sizeof(msg));
+    send_gmcp(child, msg);
 }
 
 static void req_pass_msg(unsigned char *data, size_t datalen,
@@ -91,8 +679,6 @@ static void req_pass_msg(unsigned char *data, size_t datalen,
     (void) sender;
 
     send_packet(child, REQ_BCASTMSG, data, datalen);
-    if(child->pid != sender->pid)
-        send_packet(child, REQ_ALLDONE, NULL, 0);
 }
 
 static void req_send_clientinfo(unsigned char *data, size_t datalen,
@@ -100,7 +686,7 @@ static void req_send_clientinfo(unsigned char *data, size_t datalen,
 {
     (void) data;
     (void) datalen;
-    char buf[128];
+    char buf[160];
     const char *state[] = {
         "INIT",
         "LOGIN SCREEN",
@@ -111,11 +697,12 @@ static void req_send_clientinfo(unsigned char *data, size_t datalen,
     };
 
     if(child->user)
-        snprintf(buf, sizeof(buf), "Client %s PID %d [%s] USER %s",
-                 inet_ntoa(child->addr), child->pid, state[child->state], child->user);
+        snprintf(buf, sizeof(buf), "Client %s PID %d [%s] USER %s OUTQ %zu",
+                 inet_ntoa(child->addr), child->pid, state[child->state], child->user,
+                 child->outq);
     else
-        snprintf(buf, sizeof(buf), "Client %s PID %d [%s]",
-                 inet_ntoa(child->addr), child->pid, state[child->state]);
+        snprintf(buf, sizeof(buf), "Client %s PID %d [%s] OUTQ %zu",
+                 inet_ntoa(child->addr), child->pid, state[child->state], child->outq);
 
     if(sender->pid == child->pid)
         strncat(buf, " [YOU]\n", sizeof(buf) - strlen(buf) - 1);
@@ -137,9 +724,9 @@ static void req_change_user(unsigned char *data, size_t datalen,
                             struct child_data *sender, struct child_data *child)
 {
     (void) data; (void) datalen; (void) child; (void) sender;
-    if(sender->user)
-        free(sender->user);
-    sender->user = strdup((char*)data);
+    server_user_rename(sender, (char*)data);
+
+    send_gmcp_items(sender);
 }
 
 //void req_hang(unsigned char *data, size_t datalen,
@@ -148,41 +735,36 @@ static void req_change_user(unsigned char *data, size_t datalen,
 //    while(1);
 //}
 
-static void req_kick_client(unsigned char *data, size_t datalen,
-                            struct child_data *sender, struct child_data *child)
+static void req_kick_client(unsigned char *data, size_t datalen, struct child_data *sender)
 {
     /* format is | PID | Message | */
-    (void) data; (void) datalen; (void) child; (void) sender;
+    (void) data; (void) datalen; (void) sender;
     if(datalen >= sizeof(pid_t))
     {
         pid_t kicked_pid = *((pid_t*)data);
-        if(kicked_pid == child->pid)
-        {
-            send_packet(child, REQ_KICK, data + sizeof(pid_t), datalen - sizeof(pid_t));
+        if(send_packet_pid(kicked_pid, REQ_KICK, data + sizeof(pid_t), datalen - sizeof(pid_t)))
             send_msg(sender, "Success.\n");
-        }
     }
 }
 
+/* mux mode: a session on a worker has ended */
+static void req_disconnect(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    (void) data; (void) datalen;
+    if(sender->worker)
+        server_drop_session(sender);
+}
+
 static void req_wait(unsigned char *data, size_t datalen, struct child_data *sender)
 {
     (void) data; (void) datalen; (void) sender;
     sleep(10);
 }
 
-static void req_send_desc(unsigned char *data, size_t datalen, struct child_data *sender)
+/* appends a line for each visible object in a room to buf */
+static void list_room_objs(room_id id, char *buf, size_t bufsz)
 {
-    (void) data; (void) datalen; (void) sender;
-    struct room_t *room = room_get(sender->room);
-    send_packet(sender, REQ_BCASTMSG, (void*)room->data.desc, strlen(room->data.desc));
-
-    send_packet(sender, REQ_PRINTNEWLINE, NULL, 0);
-
-    /* list objects */
-    char buf[MSG_MAX];
-    buf[0] = 0;
     void *save = NULL;
-    room_id id = sender->room;
     while(1)
     {
         size_t n_objs;
@@ -194,40 +776,142 @@ static void req_send_desc(unsigned char *data, size_t datalen, struct child_data
         const char *name = iter->key;
         struct object_t *obj = iter->val;
 
-        buf[0] = '\0';
+        /* skip aliases */
+        if(obj->hidden || strcmp(name, obj->name))
+            continue;
 
-        if(!obj->hidden)
+        if(n_objs == 1)
         {
-            if(!strcmp(name, obj->name))
+            char *article = (is_vowel(name[0])?"an":"a");
+            strlcat(buf, "There is ", bufsz);
+            if(obj->default_article)
             {
-                if(n_objs == 1)
-                {
-                    char *article = (is_vowel(name[0])?"an":"a");
-                    strlcat(buf, "There is ", sizeof(buf));
-                    if(obj->default_article)
-                    {
-                        strlcat(buf, article, sizeof(buf));
-                        strlcat(buf, " ", sizeof(buf));
-                    }
-                    strlcat(buf, name, sizeof(buf));
-                    strlcat(buf, " here.\n", sizeof(buf));
-                }
-                else
-                {
-                    strlcat(buf, "There are ", sizeof(buf));
-                    char n[32];
-                    snprintf(n, sizeof(n), "%zu ", n_objs);
-                    strlcat(buf, n, sizeof(buf));
-                    strlcat(buf, name, sizeof(buf));
-                    strlcat(buf, "s here.\n", sizeof(buf));
-                }
+                strlcat(buf, article, bufsz);
+                strlcat(buf, " ", bufsz);
             }
-
-            send_msg(sender, "%s", buf);
+            strlcat(buf, name, bufsz);
+            strlcat(buf, " here.\n", bufsz);
+        }
+        else
+        {
+            strlcat(buf, "There are ", bufsz);
+            char n[32];
+            snprintf(n, sizeof(n), "%zu ", n_objs);
+            strlcat(buf, n, bufsz);
+            strlcat(buf, name, bufsz);
+            strlcat(buf, "s here.\n", bufsz);
         }
     }
 }
 
+/* appends a line for everyone else in the sender's room to buf */
+static void list_room_users(struct child_data *sender, char *buf, size_t bufsz)
+{
+    struct room_t *room = room_get(sender->room);
+    void *ptr = room->users, *save;
+    server_users_lock();
+    while(1)
+    {
+        struct child_data *child = hash_iterate(ptr, &save, NULL);
+        ptr = NULL;
+        if(!child)
+            break;
+
+        if(child == sender || !strcmp(child->user, sender->user))
+            continue;
+
+        strlcat(buf, child->user, bufsz);
+        strlcat(buf, " is here.\n", bufsz);
+    }
+    server_users_unlock();
+}
+
+/* descriptions go along with their room ID and version, so the child
+ * can reuse its wrapped copy, see out_desc() */
+static void send_desc(struct child_data *sender, struct room_t *room)
+{
+    size_t hdr = sizeof(room->id) + sizeof(room->desc_version);
+    size_t len = strlen(room->data.desc);
+
+    /* too long for one record */
+    if(hdr + len + REC_HDR >= MSG_MAX)
+    {
+        send_packet(sender, REQ_BCASTMSG, room->data.desc, len);
+        return;
+    }
+
+    unsigned char buf[MSG_MAX];
+    memcpy(buf, &room->id, sizeof(room->id));
+    memcpy(buf + sizeof(room->id), &room->desc_version, sizeof(room->desc_version));
+    memcpy(buf + hdr, room->data.desc, len);
+    send_packet(sender, REQ_GETROOMDESC, buf, hdr + len);
+}
+
+/* everything LOOK shows, as one reply */
+static void send_room_view(struct child_data *sender)
+{
+    struct room_t *room = room_get(sender->room);
+
+    char buf[MSG_MAX * 2];
+    buf[0] = '\0';
+
+    if(room->data.name)
+    {
+        strlcat(buf, room->data.name, sizeof(buf));
+        strlcat(buf, "\n\n", sizeof(buf));
+        send_packet(sender, REQ_BCASTMSG, buf, strlen(buf));
+    }
+    send_desc(sender, room);
+
+    strcpy(buf, "\n");
+    list_room_objs(sender->room, buf, sizeof(buf));
+    if(sender->user)
+        list_room_users(sender, buf, sizeof(buf));
+
+    send_packet(sender, REQ_BCASTMSG, buf, strlen(buf));
+}
+
+/* after a move: brief GMCP clients get the room's name, and the rest
+ * from Room.Info */
+static void send_move_view(struct child_data *sender)
+{
+    if(gmcp_flag(sender, GMCP_ON) && gmcp_flag(sender, GMCP_BRIEF))
+    {
+        struct room_t *room = room_get(sender->room);
+        if(room->data.name)
+            send_msg(sender, "%s\n", room->data.name);
+    }
+    else
+        send_room_view(sender);
+}
+
+static void req_send_desc(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    (void) data; (void) datalen; (void) sender;
+    send_desc(sender, room_get(sender->room));
+
+    send_packet(sender, REQ_PRINTNEWLINE, NULL, 0);
+
+    /* list objects */
+    char buf[MSG_MAX];
+    buf[0] = '\0';
+    list_room_objs(sender->room, buf, sizeof(buf));
+    if(buf[0])
+        send_packet(sender, REQ_BCASTMSG, buf, strlen(buf));
+}
+
+static void req_look(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    (void) data; (void) datalen;
+    send_room_view(sender);
+}
+
+static void req_print_newline(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    (void) data; (void) datalen;
+    send_packet(sender, REQ_PRINTNEWLINE, NULL, 0);
+}
+
 static void req_send_roomname(unsigned char *data, size_t datalen, struct child_data *sender)
 {
     (void) data; (void) datalen; (void) sender;
@@ -254,12 +938,58 @@ static void req_set_room(unsigned char *data, size_t datalen, struct child_data
     child_set_room(sender, id);
 }
 
+/* room threads: a move between rooms owned by different threads is
+ * handed from one to the other, so that each room's hooks run on its
+ * owner: the new room's enter hook, then the old room's leave hook and
+ * the exit, then the entry */
+enum { MOVE_START = 0, MOVE_CHECK_ENTER, MOVE_LEAVE, MOVE_ENTER };
+
+/* returns true if the job has been handed off */
+static bool move_across(struct zone_job *job, struct child_data *sender, int *status)
+{
+    struct room_t *from = room_get(job->from), *to = room_get(job->to);
+
+    switch(job->stage)
+    {
+    case MOVE_CHECK_ENTER:
+        if(to->data.hook_enter && !to->data.hook_enter(job->to, sender))
+            return false;
+        job->stage = MOVE_LEAVE;
+        zone_handoff(job->from);
+        return true;
+    case MOVE_LEAVE:
+        if(from->data.hook_leave && !from->data.hook_leave(job->from, sender))
+            return false;
+        room_user_del(job->from, sender);
+        job->stage = MOVE_ENTER;
+        zone_handoff(job->to);
+        return true;
+    case MOVE_ENTER:
+        child_set_room(sender, job->to);
+        *status = 1;
+
+        /* saves the client a LOOK */
+        send_move_view(sender);
+        return false;
+    default:
+        return false;
+    }
+}
+
 static void req_move_room(unsigned char *data, size_t datalen, struct child_data *sender)
 {
     (void) data; (void) datalen; (void) sender;
 
     int status = 0;
 
+    struct zone_job *job = zone_current();
+    if(job && job->stage != MOVE_START)
+    {
+        if(!move_across(job, sender, &status))
+            send_packet(sender, REQ_MOVE, &status, sizeof(status));
+        return;
+    }
+
     enum direction_t dir = *((enum direction_t*)data);
     struct room_t *current = room_get(sender->room);
 
@@ -270,6 +1000,14 @@ static void req_move_room(unsigned char *data, size_t datalen, struct child_data
     {
         send_msg(sender, "You cannot go that way.\n");
     }
+    else if(zone_owner(new) != zone_owner(sender->room))
+    {
+        job->from = sender->room;
+        job->to = new;
+        job->stage = MOVE_CHECK_ENTER;
+        zone_handoff(new);
+        return;
+    }
     else
     {
         struct room_t *new_room = room_get(new);
@@ -283,6 +1021,9 @@ static void req_move_room(unsigned char *data, size_t datalen, struct child_data
 
             child_set_room(sender, new);
             status = 1;
+
+            /* saves the client a LOOK */
+            send_move_view(sender);
         }
     }
 
@@ -293,13 +1034,12 @@ static void req_send_user(unsigned char *data, size_t datalen, struct child_data
 {
     if(datalen)
     {
+        userdb_lock();
         struct userdata_t *user = userdb_lookup((char*)data);
 
         if(user)
-        {
             send_packet(sender, REQ_GETUSERDATA, user, sizeof(*user));
-            return;
-        }
+        userdb_unlock();
     }
 }
 
@@ -328,6 +1068,58 @@ static void req_send_geninfo(unsigned char *data, size_t datalen, struct child_d
     (void) data;
     (void) datalen;
     send_msg(sender, "Total clients: %d\n", num_clients);
+    if(num_hibernating)
+        send_msg(sender, "Hibernating: %d\n", num_hibernating);
+
+    struct conn_stats stats;
+    server_conn_stats(&stats);
+    if(stats.waiting)
+        send_msg(sender, "Waiting in line: %d\n", stats.waiting);
+}
+
+static void req_stats(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    (void) data;
+    (void) datalen;
+    send_msg(sender, "Requests handled: %lu\n", __atomic_load_n(&n_requests, __ATOMIC_RELAXED));
+
+    struct conn_stats stats;
+    server_conn_stats(&stats);
+    send_msg(sender, "Connections: %lu accepted, %lu queued, %lu turned away, %lu gave up, %lu errors\n",
+             stats.accepted, stats.queued, stats.rejected, stats.abandoned, stats.errors);
+    if(stats.max_clients)
+        send_msg(sender, "Sessions: %d of %d, %d waiting in line, %d in the accept queue\n",
+                 num_clients, stats.max_clients, stats.waiting, stats.backlog);
+    else
+        send_msg(sender, "Sessions: %d, %d waiting in line, %d in the accept queue\n",
+                 num_clients, stats.waiting, stats.backlog);
+#if ALLOC_STATS
+    send_msg(sender, "Heap allocations: %lu total, %lu while handling requests\n",
+             alloc_count(), __atomic_load_n(&request_allocs, __ATOMIC_RELAXED));
+#else
+    send_msg(sender, "Heap allocations: not counted, build with ALLOC_STATS=1\n");
+#endif
+}
+
+static void req_outqueue(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    if(datalen == sizeof(sender->outq))
+        memcpy(&sender->outq, data, sizeof(sender->outq));
+}
+
+static void req_gmcp(unsigned char *data, size_t datalen, struct child_data *sender)
+{
+    if(datalen != 1)
+        return;
+
+    unsigned char old = __atomic_exchange_n(&sender->gmcp, data[0], __ATOMIC_RELAXED);
+
+    /* switched on after logging in, catch it up */
+    if(sender->user && (data[0] & GMCP_ON) && !(old & GMCP_ON))
+    {
+        send_gmcp_room(sender, sender->room);
+        send_gmcp_items(sender);
+    }
 }
 
 static void req_kick_always(unsigned char *data, size_t datalen,
@@ -362,6 +1154,8 @@ static void req_look_at(unsigned char *data, size_t datalen, struct child_data *
     (void) datalen;
     size_t n_objs = 0, tmp;
 
+    userdb_lock();
+
     const struct multimap_list *room_list = room_obj_get_size(sender->room, (const char*)data, &n_objs);
     const struct multimap_list *inv_list = multimap_lookup(userdb_lookup(sender->user)->objects, data, &tmp);
 
@@ -381,6 +1175,8 @@ static void req_look_at(unsigned char *data, size_t datalen, struct child_data *
 
     if(!room_list && !inv_list)
         send_msg(sender, "I don't know what that is.\n");
+
+    userdb_unlock();
 }
 
 static void req_take(unsigned char *data, size_t datalen, struct child_data *sender)
@@ -389,6 +1185,8 @@ static void req_take(unsigned char *data, size_t datalen, struct child_data *sen
     const struct multimap_list *iter = room_obj_get(sender->room, (const char*)data), *next;
     if(iter)
     {
+        userdb_lock();
+
         while(iter)
         {
             next = iter->next;
@@ -412,6 +1210,8 @@ static void req_take(unsigned char *data, size_t datalen, struct child_data *sen
             iter = next;
         }
 
+        userdb_unlock();
+
         server_save_state(false);
     }
     else
@@ -425,6 +1225,8 @@ static void req_inventory(unsigned char *data, size_t datalen, struct child_data
     (void) datalen;
     (void) data;
 
+    userdb_lock();
+
     void *ptr = userdb_lookup(sender->user)->objects, *save;
 
     send_msg(sender, "You currently have:\n");
@@ -454,6 +1256,8 @@ static void req_inventory(unsigned char *data, size_t datalen, struct child_data
     }
     if(ptr)
         send_msg(sender, "Nothing!\n");
+
+    userdb_unlock();
 }
 
 static void req_drop(unsigned char *data, size_t datalen, struct child_data *sender)
@@ -461,10 +1265,15 @@ static void req_drop(unsigned char *data, size_t datalen, struct child_data *sen
     (void) datalen;
     (void) data;
 
+    userdb_lock();
+
     struct userdata_t *user = userdb_lookup(sender->user);
 
     if(!user)
+    {
+        userdb_unlock();
         return;
+    }
 
     size_t n_objs;
     const struct multimap_list *iter = multimap_lookup(user->objects, (const char*)data, &n_objs);
@@ -472,6 +1281,7 @@ static void req_drop(unsigned char *data, size_t datalen, struct child_data *sen
     if(!iter)
     {
         send_msg(sender, "You don't have that.\n");
+        userdb_unlock();
         return;
     }
 
@@ -495,6 +1305,8 @@ static void req_drop(unsigned char *data, size_t datalen, struct child_data *sen
         iter = next;
     }
 
+    userdb_unlock();
+
     server_save_state(false);
 }
 
@@ -503,6 +1315,8 @@ static void req_listusers(unsigned char *data, size_t datalen, struct child_data
     (void) data;
     (void) datalen;
 
+    userdb_lock();
+
     void *save = NULL;
     while(1)
     {
@@ -514,6 +1328,8 @@ static void req_listusers(unsigned char *data, size_t datalen, struct child_data
                  user->priv,
                  ctime(&user->last_login));
     }
+
+    userdb_unlock();
 }
 
 static void req_execverb(unsigned char *data, size_t datalen, struct child_data *sender)
@@ -559,7 +1375,8 @@ static const struct child_request {
 
     bool havedata;
 
-    enum { CHILD_NONE, CHILD_SENDER, CHILD_ALL_BUT_SENDER, CHILD_ALL } which;
+    /* CHILD_ROOM is everyone in the sender's room, sender included */
+    enum { CHILD_NONE, CHILD_SENDER, CHILD_ALL_BUT_SENDER, CHILD_ALL, CHILD_ROOM } which;
 
     /* sender_pipe is the pipe to the sender of the request */
     /* data points to bogus if havedata = false */
@@ -567,50 +1384,55 @@ static const struct child_request {
                          struct child_data *sender, struct child_data *child);
 
     void (*finalize)(unsigned char *data, size_t len, struct child_data *sender);
+
+    /* no REQ_ALLDONE is sent, the child doesn't wait for these */
+    bool oneway;
+
+    /* with room threads, runs on the thread owning the sender's room */
+    bool room;
 } requests[] = {
-    {  REQ_NOP,             false,  CHILD_NONE,            NULL,                 NULL,               },
-    {  REQ_BCASTMSG,        true,   CHILD_ALL,             req_pass_msg,         NULL,               },
-    {  REQ_CHANGESTATE,     true,   CHILD_SENDER,          req_change_state,     NULL,               },
-    {  REQ_CHANGEUSER,      true,   CHILD_SENDER,          req_change_user,      NULL,               },
-    {  REQ_KICK,            true,   CHILD_ALL,             req_kick_client,      NULL,               },
-    {  REQ_KICKALL,         true,   CHILD_ALL_BUT_SENDER,  req_kick_always,      NULL,               },
-    {  REQ_LISTCLIENTS,     false,  CHILD_ALL,             req_send_clientinfo,  req_send_geninfo,   },
-    {  REQ_SETROOM,         true,   CHILD_NONE,            NULL,                 req_set_room,       },
-    {  REQ_MOVE,            true,   CHILD_NONE,            NULL,                 req_move_room,      },
-    {  REQ_GETUSERDATA,     true,   CHILD_NONE,            NULL,                 req_send_user,      },
-    {  REQ_DELUSERDATA,     true,   CHILD_NONE,            NULL,                 req_del_user,       },
-    {  REQ_ADDUSERDATA,     true,   CHILD_NONE,            NULL,                 req_add_user,       },
-    {  REQ_LOOKAT,          true,   CHILD_NONE,            NULL,                 req_look_at,        },
-    {  REQ_TAKE,            true,   CHILD_NONE,            NULL,                 req_take,           },
-    {  REQ_DROP,            true,   CHILD_NONE,            NULL,                 req_drop,           },
-    {  REQ_EXECVERB,        true,   CHILD_NONE,            NULL,                 req_execverb        },
-    {  REQ_WAIT,            false,  CHILD_NONE,            NULL,                 req_wait,           },
-    {  REQ_GETROOMDESC,     false,  CHILD_NONE,            NULL,                 req_send_desc,      },
-    {  REQ_GETROOMNAME,     false,  CHILD_NONE,            NULL,                 req_send_roomname,  },
-    {  REQ_PRINTINVENTORY,  false,  CHILD_NONE,            NULL,                 req_inventory,      },
-    {  REQ_LISTUSERS,       false,  CHILD_NONE,            NULL,                 req_listusers       },
-    //{ REQ_ROOMMSG,     true,  CHILD_ALL,            req_send_room_msg,   NULL,           },
+    {  REQ_NOP,             false,  CHILD_NONE,            NULL,                 NULL,              false,  false  },
+    {  REQ_BCASTMSG,        true,   CHILD_ALL,             req_pass_msg,         NULL,              false,  false  },
+    {  REQ_CHANGESTATE,     true,   CHILD_SENDER,          req_change_state,     NULL,              true,   false  },
+    {  REQ_CHANGEUSER,      true,   CHILD_SENDER,          req_change_user,      NULL,              true,   false  },
+    {  REQ_KICK,            true,   CHILD_NONE,            NULL,                 req_kick_client,   false,  false  },
+    {  REQ_KICKALL,         true,   CHILD_ALL_BUT_SENDER,  req_kick_always,      NULL,              false,  false  },
+    {  REQ_LISTCLIENTS,     false,  CHILD_ALL,             req_send_clientinfo,  req_send_geninfo,  false,  false  },
+    {  REQ_SETROOM,         true,   CHILD_NONE,            NULL,                 req_set_room,      true,   true   },
+    {  REQ_MOVE,            true,   CHILD_NONE,            NULL,                 req_move_room,     false,  true   },
+    {  REQ_GETUSERDATA,     true,   CHILD_NONE,            NULL,                 req_send_user,     false,  false  },
+    {  REQ_DELUSERDATA,     true,   CHILD_NONE,            NULL,                 req_del_user,      false,  false  },
+    {  REQ_ADDUSERDATA,     true,   CHILD_NONE,            NULL,                 req_add_user,      false,  false  },
+    {  REQ_LOOKAT,          true,   CHILD_NONE,            NULL,                 req_look_at,       false,  true   },
+    {  REQ_TAKE,            true,   CHILD_NONE,            NULL,                 req_take,          false,  true   },
+    {  REQ_DROP,            true,   CHILD_NONE,            NULL,                 req_drop,          false,  true   },
+    {  REQ_EXECVERB,        true,   CHILD_NONE,            NULL,                 req_execverb,      false,  true   },
+    {  REQ_WAIT,            false,  CHILD_NONE,            NULL,                 req_wait,          false,  true   },
+    {  REQ_GETROOMDESC,     false,  CHILD_NONE,            NULL,                 req_send_desc,     false,  true   },
+    {  REQ_GETROOMNAME,     false,  CHILD_NONE,            NULL,                 req_send_roomname, false,  true   },
+    {  REQ_PRINTINVENTORY,  false,  CHILD_NONE,            NULL,                 req_inventory,     false,  true   },
+    {  REQ_LISTUSERS,       false,  CHILD_NONE,            NULL,                 req_listusers,     false,  false  },
+    {  REQ_PRINTNEWLINE,    false,  CHILD_NONE,            NULL,                 req_print_newline, false,  false  },
+    {  REQ_LOOK,            false,  CHILD_NONE,            NULL,                 req_look,          false,  true   },
+    {  REQ_DISCONNECT,      false,  CHILD_NONE,            NULL,                 req_disconnect,    true,   false  },
+    {  REQ_ROOMMSG,         true,   CHILD_ROOM,            req_pass_msg,         NULL,              false,  true   },
+    {  REQ_STATS,           false,  CHILD_NONE,            NULL,                 req_stats,         false,  false  },
+    {  REQ_OUTQUEUE,        true,   CHILD_NONE,            NULL,                 req_outqueue,      true,   false  },
+    {  REQ_GMCP,            true,   CHILD_NONE,            NULL,                 req_gmcp,          true,   true   },
 };
 
-static SIMP_HASH(unsigned char, uchar_hash);
-static SIMP_EQUAL(unsigned char, uchar_equal);
-
-static void *request_map = NULL;
+/* request codes are one byte, so they index this directly */
+static const struct child_request *request_map[UCHAR_MAX + 1];
 
 void reqmap_init(void)
 {
-    request_map = hash_init(ARRAYLEN(requests), uchar_hash, uchar_equal);
     for(unsigned i = 0; i < ARRAYLEN(requests); ++i)
-        hash_insert(request_map, &requests[i].code, requests + i);
+        request_map[requests[i].code] = requests + i;
 }
 
 void reqmap_free(void)
 {
-    if(request_map)
-    {
-        hash_free(request_map);
-        request_map = NULL;
-    }
+    memset(request_map, 0, sizeof(request_map));
 }
 
 /**
@@ -629,17 +1451,186 @@ void reqmap_free(void)
 
 static unsigned char packet[MSG_MAX + 1];
 
-bool handle_child_req(int in_fd)
+/*** room threads, see zone.h ***/
+
+static void start_job(struct zone_job *job)
+{
+    user_t *child = job->child;
+    child->busy = true;
+
+    /* SETROOM is about the room being entered */
+    if(job->cmd == REQ_SETROOM && job->len >= sizeof(room_id))
+        memcpy(&job->room, job->data, sizeof(room_id));
+    else
+        job->room = child->room;
+
+    zone_submit(job);
+}
+
+static void add_pending(user_t *child, struct zone_job *job)
 {
-    ssize_t packet_len = read(in_fd, packet, MSG_MAX);
+    job->next = NULL;
+    if(child->pending_tail)
+        child->pending_tail->next = job;
+    else
+        child->pending = job;
+    child->pending_tail = job;
+}
 
-    if((size_t)packet_len < sizeof(pid_t) + 1)
+/* runs a child's requests which were waiting on a job, until one of
+ * them needs a room thread too */
+static void run_pending(user_t *child)
+{
+    struct zone_job *job;
+    while(!child->busy && (job = child->pending))
     {
-        /* the pipe is probably broken (i.e. disconnect), so we don't
-         * try to send a reply */
-        return false;
+        child->pending = job->next;
+        if(!child->pending)
+            child->pending_tail = NULL;
+
+        const struct child_request *req = request_map[job->cmd];
+        if(job->retire || (req && req->room))
+            start_job(job);
+        else
+        {
+            handle_request(child, job->id, job->cmd, job->data, job->len);
+            zone_job_free(job);
+        }
+    }
+}
+
+/* requests about the sender's room go to the thread owning it, the
+ * rest run here, but never ahead of an earlier one from the same
+ * child, so replies still arrive in order */
+static void dispatch_request(user_t *sender, reqid_t id, unsigned char cmd,
+                             unsigned char *data, size_t datalen)
+{
+    const struct child_request *req = request_map[cmd];
+
+    if(!zone_threads || (!sender->busy && !(req && req->room)))
+    {
+        handle_request(sender, id, cmd, data, datalen);
+        return;
     }
 
+    struct zone_job *job = zone_job_new();
+    job->child = sender;
+    job->id = id;
+    job->cmd = cmd;
+    job->len = MIN(datalen, MSG_MAX);
+    memcpy(job->data, data, job->len);
+    job->data[job->len] = '\0';
+
+    if(sender->busy)
+        add_pending(sender, job);
+    else
+        start_job(job);
+}
+
+/* the request carries on in another room thread, see zone_handoff() */
+static bool handed_off(void)
+{
+    struct zone_job *job = zone_current();
+    return job && job->handoff;
+}
+
+void run_job(struct zone_job *job)
+{
+    if(job->retire)
+        room_user_del(job->room, job->child);
+    else
+        handle_request(job->child, job->id, job->cmd, job->data, job->len);
+}
+
+void finish_job(struct zone_job *job)
+{
+    user_t *child = job->child;
+
+    /* replies, see zone_reply() */
+    const unsigned char *rec = job->out, *end = job->out + job->outlen;
+    while(rec < end)
+    {
+        pid_t pid;
+        reqid_t id;
+        uint16_t len;
+
+        memcpy(&pid, rec, sizeof(pid));
+        rec += sizeof(pid);
+        memcpy(&id, rec, sizeof(id));
+        rec += sizeof(id);
+        unsigned char cmd = *rec++;
+        memcpy(&len, rec, sizeof(len));
+        rec += sizeof(len);
+
+        user_t *dest = hash_lookup(child_map, &pid);
+
+        /* mux workers aren't clients */
+        if(dest && !(server_mode == MODE_MUX && !dest->worker))
+            send_packet_id(dest, pid, id, cmd, rec, len);
+
+        rec += len;
+    }
+
+    flush_all_packets();
+
+    if(job->save)
+        server_save_state(false);
+
+    bool retired = job->retire;
+    zone_job_free(job);
+    child->busy = false;
+
+    if(retired)
+    {
+        pid_t pid = child->pid;
+        hash_remove(child_map, &pid);
+        return;
+    }
+
+    run_pending(child);
+}
+
+void retire_child(user_t *child)
+{
+    if(child->dead)
+        return;
+    child->dead = true;
+
+    /* nothing more is read from it */
+    if(child->io_watcher)
+        ev_io_stop(EV_DEFAULT_ child->io_watcher);
+
+    while(child->pending)
+    {
+        struct zone_job *job = child->pending;
+        child->pending = job->next;
+        zone_job_free(job);
+    }
+    child->pending_tail = NULL;
+
+    struct zone_job *job = zone_job_new();
+    job->child = child;
+    job->cmd = REQ_NOP;
+    job->len = 0;
+    job->retire = true;
+
+    if(child->busy)
+        add_pending(child, job);
+    else
+        start_job(job);
+}
+
+/*
+ * Handles one packet from a child, already read into packet[]:
+ * | PID | REQUEST ID | CMD | DATA |
+ */
+#define CHILD_HDR (sizeof(pid_t) + sizeof(reqid_t))
+
+static void handle_child_packet(ssize_t packet_len)
+{
+    if((size_t)packet_len < CHILD_HDR + 1)
+        return;
+
     struct child_data *sender = NULL;
 
     pid_t sender_pid;
@@ -647,18 +1638,65 @@ bool handle_child_req(int in_fd)
 
     sender = hash_lookup(child_map, &sender_pid);
 
-    if(!sender)
+    if(!sender || sender->dead)
     {
         debugf("WARNING: got data from unknown PID, ignoring.\n");
-        goto fail;
+        return;
+    }
+
+    reqid_t id;
+    memcpy(&id, packet + sizeof(pid_t), sizeof(id));
+
+    unsigned char cmd = packet[CHILD_HDR];
+
+    unsigned char *data = packet + CHILD_HDR + 1;
+    size_t datalen = packet_len - CHILD_HDR - 1;
+
+    dispatch_request(sender, id, cmd, data, datalen);
+}
+
+bool handle_child_req(user_t *child)
+{
+    ssize_t packet_len;
+
+    /* shared memory: drain everything that's there */
+    if(child->shm)
+    {
+        ipc_clear(child->readpipe[0]);
+        while((packet_len = ipc_recv(child->shm, IPC_TO_MASTER, packet, MSG_MAX)) >= 0)
+            handle_child_packet(packet_len);
+
+        /* it's awake, so it may well have made room */
+        if(child->spill_len && unspill(child))
+            spill_unlink(child);
+        return true;
+    }
+
+    packet_len = read(child->readpipe[0], packet, MSG_MAX);
+
+    if((size_t)packet_len < CHILD_HDR + 1)
+    {
+        /* the pipe is probably broken (i.e. disconnect), so we don't
+         * try to send a reply */
+        return false;
     }
 
-    unsigned char cmd = packet[sizeof(pid_t)];
+    handle_child_packet(packet_len);
 
-    unsigned char *data = packet + sizeof(pid_t) + 1;
-    size_t datalen = packet_len - sizeof(pid_t) - 1;
+    return true;
+}
+
+void handle_request(struct child_data *sender, reqid_t id, unsigned char cmd,
+                    unsigned char *data, size_t datalen)
+{
+    struct child_data *old_reply_to = reply_to;
+    reqid_t old_reply_id = reply_id;
+    reply_to = sender;
+    reply_id = id;
 
-    struct child_request *req = hash_lookup(request_map, &cmd);
+    unsigned long allocs_before = alloc_count();
+
+    const struct child_request *req = request_map[cmd];
 
     //debugf("Child %d sends request %d\n", sender_pid, cmd);
 
@@ -678,6 +1716,20 @@ bool handle_child_req(int in_fd)
         break;
     case CHILD_NONE:
         goto finish;
+    case CHILD_ROOM:
+    {
+        struct room_t *room = room_get(sender->room);
+        void *ptr = room->users, *save;
+        while(1)
+        {
+            struct child_data *child = hash_iterate(ptr, &save, NULL);
+            ptr = NULL;
+            if(!child)
+                break;
+            req->handle_child(data, datalen, sender, child);
+        }
+        goto finish;
+    }
     default:
         break;
     }
@@ -713,8 +1765,22 @@ finish:
     /* fall through */
 fail:
 
-    if(sender)
+    if((!req || !req->oneway) && !handed_off())
         send_packet(sender, REQ_ALLDONE, NULL, 0);
 
-    return true;
+    reply_to = old_reply_to;
+    reply_id = old_reply_id;
+
+    if(!reply_to)
+    {
+        if(!zone_current())
+            flush_all_packets();
+
+        /* nested requests are counted as part of the outermost one */
+        if(!handed_off())
+        {
+            __atomic_add_fetch(&n_requests, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&request_allocs, alloc_count() - allocs_before, __ATOMIC_RELAXED);
+        }
+    }
 }
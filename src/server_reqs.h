@@ -22,27 +22,33 @@
 
 #include "server.h"
 
+struct object_t;
+
+/* identifies a request, and the packets replying to it; 0 for
+ * packets which aren't a reply to anything */
+typedef uint32_t reqid_t;
+
 /* child<->master commands */
 /* not all of these are implemented by both parties */
 /* meanings might be different for the server and child, see comments */
 #define REQ_NOP               0 /* server, child: do nothing (used for acknowledgement) */
 #define REQ_BCASTMSG          1 /* server: broadcast text; child: print following text */
 #define REQ_LISTCLIENTS       2 /* server: list childs */
-#define REQ_CHANGESTATE       3 /* server: change child state flag */
-#define REQ_CHANGEUSER        4 /* server: change child login name */
+#define REQ_CHANGESTATE       3 /* server: change child state flag, no reply */
+#define REQ_CHANGEUSER        4 /* server: change child login name, no reply */
 #define REQ_HANG              5 /* <UNIMP> server: loop forever */
 #define REQ_KICK              6 /* server: kick PID with message; child: print message, quit */
 #define REQ_WAIT              7 /* <DEBUG> server: sleep 10s */
-#define REQ_GETROOMDESC       8 /* server: send child room description */
-#define REQ_SETROOM           9 /* server: set child room */
-#define REQ_MOVE              10 /* server: move child based on direction; child: success or failure */
+#define REQ_GETROOMDESC       8 /* server: send child room description; child: print a room description, after its room ID and version */
+#define REQ_SETROOM           9 /* server: set child room, no reply */
+#define REQ_MOVE              10 /* server: move child based on direction, sending the new room's view on success; child: success or failure */
 #define REQ_GETROOMNAME       11 /* server: send child's room name */
 #define REQ_LISTROOMCLIENTS   12 /* server: list clients in child's room */
 #define REQ_GETUSERDATA       13 /* server: send user data; child: get user data */
 #define REQ_DELUSERDATA       14 /* server: delete user data; child: success/failure */
 #define REQ_ADDUSERDATA       15 /* server: insert user data; child: success/fail */
-#define REQ_PRINTNEWLINE      16 /* child: print a newline */
-#define REQ_ALLDONE           17 /* child: break out of send_master() */
+#define REQ_PRINTNEWLINE      16 /* server: send one back, to order output between pipelined requests; child: print a newline */
+#define REQ_ALLDONE           17 /* child: the request with this ID is complete; never sent for one-way requests */
 #define REQ_KICKALL           18 /* server: kick everyone except the sender */
 #define REQ_LOOKAT            19 /* server: send object description */
 #define REQ_TAKE              20 /* server: add object to user inventory */
@@ -51,6 +57,18 @@
 #define REQ_LISTUSERS         23 /* server: list users in USERFILE */
 #define REQ_EXECVERB          24 /* server: execute a verb with its arguments */
 #define REQ_RAWMODE           25 /* child: toggle the child's processing of commands and instead send input directly to master */
+#define REQ_DISCONNECT        26 /* server: a mux mode session has ended, no reply */
+#define REQ_LOOK              27 /* server: send the room name, description, objects and occupants in one reply */
+#define REQ_ROOMMSG           28 /* server: send text to everyone in the child's room */
+#define REQ_STATS             29 /* server: send request and allocation counts */
+#define REQ_OUTQUEUE          30 /* server: note how much output the child has queued for its client, no reply */
+#define REQ_GMCP              31 /* server: set the child's GMCP_* flags, no reply; child: send a GMCP message to the client */
+#define REQ_HIBERNATE         32 /* child: if the client's been idle for (int) seconds, hand it back over the control socket and exit */
+#define REQ_RESTART           33 /* child: the master is restarting, hand the client back over the control socket and exit */
+
+/* REQ_GMCP flags */
+#define GMCP_ON    (1 << 0) /* the client speaks GMCP */
+#define GMCP_BRIEF (1 << 1) /* and doesn't want rooms described after moves */
 
 /* child states, sent as an int to the master */
 #define STATE_INIT      0 /* initial state */
@@ -60,13 +78,60 @@
 #define STATE_ADMIN     4 /* logged in w/ admin privs */
 #define STATE_FAILED    5 /* failed a password attempt */
 
-bool handle_child_req(int in_fd);
+/* drops any packets queued for or requests queued from a child which
+ * is going away */
+void discard_packets(user_t *child);
+
+/* handles requests from a child, returns false if its pipe is broken */
+bool handle_child_req(user_t *child);
+
+/* dispatches a request which has already been read, replies go to
+ * sender tagged with id */
+void handle_request(user_t *sender, reqid_t id, unsigned char cmd,
+                    unsigned char *data, size_t datalen);
+/* room threads: runs a job on its room's thread, and sends its
+ * replies once it's back on the main thread */
+struct zone_job;
+void run_job(struct zone_job *job);
+void finish_job(struct zone_job *job);
+
+/* room threads: takes a child out of its room, then forgets it */
+void retire_child(user_t *child);
+
 void master_ack_handler(int s, siginfo_t *info, void *v);
 void reqmap_init(void);
 void reqmap_free(void);
 
 void send_msg(user_t *child, const char *fmt, ...) __attribute__((format(printf,2,3)));
 
+/* targeted delivery, each costing O(recipients): everyone in a room
+ * except `except' (which may be NULL), every session logged in as a
+ * user, a single PID, or an explicit set of children; all but the
+ * last return how many were sent to */
+size_t send_packet_room(room_id room, user_t *except, unsigned char cmd,
+                        const void *data, size_t datalen);
+size_t send_packet_user(const char *user, unsigned char cmd,
+                        const void *data, size_t datalen);
+bool send_packet_pid(pid_t pid, unsigned char cmd, const void *data, size_t datalen);
+void send_packet_set(user_t **children, size_t n, unsigned char cmd,
+                     const void *data, size_t datalen);
+
+/* the same, for formatted text */
+size_t send_msg_room(room_id room, user_t *except, const char *fmt, ...) __attribute__((format(printf,3,4)));
+size_t send_msg_user(const char *user, const char *fmt, ...) __attribute__((format(printf,2,3)));
+bool send_msg_pid(pid_t pid, const char *fmt, ...) __attribute__((format(printf,2,3)));
+void send_msg_set(user_t **children, size_t n, const char *fmt, ...) __attribute__((format(printf,3,4)));
+
+/* GMCP messages for clients which have asked for them: a player
+ * entering or leaving a room (Room.Info and Room.Players go to the
+ * player, Room.AddPlayer and Room.RemovePlayer to everyone else there),
+ * an object added to or taken from a user's inventory, and the whole
+ * inventory */
+void send_gmcp_enter(room_id room, user_t *child);
+void send_gmcp_leave(room_id room, user_t *child);
+void send_gmcp_item(const char *user, const struct object_t *obj, bool added);
+void send_gmcp_items(user_t *child);
+
 /* toggle the child into "raw mode": all commands typed by the
  * connected client will be send to the world module;
  * if the child is already in raw mode the callback is ignored */
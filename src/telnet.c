@@ -22,79 +22,143 @@
 #include "globals.h"
 
 #include "client.h"
+#include "client_reqs.h"
 #include "telnet.h"
 
-static uint16_t term_width, term_height;
-
 uint16_t telnet_get_width(void)
 {
-    return term_width;
+    return session->term_width;
 }
 
 uint16_t telnet_get_height(void)
 {
-    return term_height;
+    return session->term_height;
 }
 
-enum telnet_status telnet_parse_data(unsigned char *buf, size_t buflen)
+/* WILL, WONT, DO or DONT from the client */
+static void telnet_option(unsigned char verb, unsigned char opt)
 {
-    bool iac = false;
-    bool found_cmd = false;
-    bool in_sb = false;
-    bool line_done = false;
+    switch(opt)
+    {
+    case TELOPT_COMPRESS2:
+        if(verb == DO)
+            client_compress_start();
+        else if(verb == DONT)
+            client_compress_end();
+        break;
+    case TELOPT_GMCP:
+        if(verb == DO)
+            client_set_gmcp(session->gmcp | GMCP_ON);
+        else if(verb == DONT)
+            client_set_gmcp(0);
+        break;
+    }
+}
 
-    for(unsigned i = 0; i < buflen; ++i)
+/* IAC SB ... IAC SE from the client */
+static void telnet_subneg(const struct telnet_state *ts)
+{
+    switch(ts->sb[0])
     {
-        unsigned char c = buf[i];
+    case TELOPT_NAWS:
+        if(ts->sb_len >= 5)
+        {
+            uint16_t width = ts->sb[1] << 8 | ts->sb[2];
+            uint16_t height = ts->sb[3] << 8 | ts->sb[4];
+
+            /* zero means unknown */
+            if(width)
+                session->term_width = width;
+            if(height)
+                session->term_height = height;
+        }
+        break;
+    }
+}
 
-        if(c == IAC)
-            iac = true;
-        else if(c == '\n' || c == '\r')
-            line_done = true;
-        else if(c == '\0') // ignore NULLs
-            buf[i] = ' ';
+ssize_t telnet_parse_data(unsigned char *buf, size_t len)
+{
+    struct telnet_state *ts = &session->telnet;
+    size_t out = 0;
 
-        if(iac)
+    for(size_t i = 0; i < len; ++i)
+    {
+        unsigned char c = buf[i];
+
+        switch(ts->state)
         {
-            if(TELCMD_OK(c))
+        case TS_CR:
+            ts->state = TS_DATA;
+
+            /* CR LF and CR NUL both just end the line */
+            if(c == '\n' || c == '\0')
+                break;
+            /* fall through */
+        case TS_DATA:
+            if(c == IAC)
+                ts->state = TS_IAC;
+            else if(c == '\r')
             {
-                found_cmd = true;
-                switch(c)
-                {
-                case IP:
-                    return TELNET_EXIT;
-                case SB:
-                    in_sb = true;
-                    break;
-                case TELOPT_NAWS:
-                    if(in_sb)
-                    {
-                        /* read height/width */
-                        uint8_t bytes[4];
-                        int j = 0;
-                        while(j < 4 && i < buflen)
-                        {
-                            bytes[j++] = buf[++i];
-                            //debugf("%d ", buf[j - 1]);
-                            if(bytes[j - 1] == 255) /* 255 is doubled to distinguish from IAC */
-                            {
-                                ++i;
-                            }
-                        }
-                        if(i >= buflen && j != 4)
-                            error("client SB NAWS command to short");
-                        term_width = ntohs(*((uint16_t*)bytes));
-                        term_height = ntohs(*((uint16_t*)(bytes+2)));
-                    }
-                    break;
-                }
-                continue;
+                buf[out++] = '\n';
+                ts->state = TS_CR;
             }
+            else if(c != '\0')
+                buf[out++] = c;
+            break;
+        case TS_IAC:
+            ts->state = TS_DATA;
+            switch(c)
+            {
+            case IAC: /* escaped 255 */
+                buf[out++] = c;
+                break;
+            case IP:
+                return -1;
+            case WILL:
+            case WONT:
+            case DO:
+            case DONT:
+                ts->verb = c;
+                ts->state = TS_OPT;
+                break;
+            case SB:
+                ts->sb_len = 0;
+                ts->state = TS_SB;
+                break;
+            default:
+                /* NOP, GA and so on */
+                break;
+            }
+            break;
+        case TS_OPT:
+            ts->state = TS_DATA;
+            telnet_option(ts->verb, c);
+            break;
+        case TS_SB:
+            if(c == IAC)
+                ts->state = TS_SB_IAC;
+            else if(ts->sb_len < sizeof(ts->sb))
+                ts->sb[ts->sb_len++] = c;
+            break;
+        case TS_SB_IAC:
+            if(c == IAC)
+            {
+                if(ts->sb_len < sizeof(ts->sb))
+                    ts->sb[ts->sb_len++] = c;
+                ts->state = TS_SB;
+            }
+            else
+            {
+                /* SE, or a broken subnegotiation we give up on */
+                ts->state = TS_DATA;
+                if(c == SE && ts->sb_len)
+                    telnet_subneg(ts);
+            }
+            break;
         }
     }
 
-    return found_cmd ? TELNET_FOUNDCMD :
-        (line_done ? TELNET_LINEOVER : TELNET_DATA);
+    return out;
 }
 
 void telnet_echo_off(void)
@@ -129,13 +193,38 @@ void telnet_init(void)
         IAC, DO,   TELOPT_ECHO,
 
         IAC, DONT, TELOPT_LINEMODE,
+
+        IAC, WILL, TELOPT_COMPRESS2,
+        IAC, WILL, TELOPT_GMCP,
     };
-    term_width = 80;
-    term_height = 24;
+    session->term_width = 80;
+    session->term_height = 24;
 
     out_raw(init_seq, ARRAYLEN(init_seq));
 }
 
+void telnet_send_gmcp(const char *msg, size_t len)
+{
+    const unsigned char start[] = { IAC, SB, TELOPT_GMCP };
+    const unsigned char end[] = { IAC, SE };
+
+    out_raw(start, ARRAYLEN(start));
+
+    /* IACs in the data are doubled */
+    const char *iac;
+    while((iac = memchr(msg, IAC, len)))
+    {
+        size_t n = iac - msg + 1;
+        out_raw(msg, n);
+        out_raw(iac, 1);
+        msg += n;
+        len -= n;
+    }
+    out_raw(msg, len);
+
+    out_raw(end, ARRAYLEN(end));
+}
+
 void telnet_clear_screen(void)
 {
     /* ESC ] 2 J */
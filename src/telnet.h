@@ -20,14 +20,30 @@
 
 #include <arpa/telnet.h>
 
+/* MCCP2 and GMCP, not in <arpa/telnet.h> */
+#define TELOPT_COMPRESS2 86
+#define TELOPT_GMCP      201
+
 void telnet_init(void);
 
-enum telnet_status { TELNET_DATA = 0,
-                     TELNET_FOUNDCMD,
-                     TELNET_LINEOVER,
-                     TELNET_EXIT };
+/* the parser's state, carried over between reads so commands can be
+ * split across them */
+struct telnet_state {
+    enum { TS_DATA = 0, TS_CR, TS_IAC, TS_OPT, TS_SB, TS_SB_IAC } state;
+
+    /* WILL, WONT, DO or DONT, waiting for its option */
+    unsigned char verb;
 
-enum telnet_status telnet_parse_data(unsigned char*, size_t);
+    /* subnegotiation so far, option first; anything past the end of
+     * this is dropped */
+    unsigned char sb[16];
+    size_t   sb_len;
+};
+
+/* strips telnet commands out of buf in place and acts on them, turning
+ * line endings into '\n'; returns how much data is left, or -1 if the
+ * client wants to quit */
+ssize_t telnet_parse_data(unsigned char *buf, size_t len);
 
 uint16_t telnet_get_width(void);
 uint16_t telnet_get_height(void);
@@ -36,3 +52,6 @@ void telnet_echo_on(void);
 void telnet_echo_off(void);
 
 void telnet_clear_screen(void);
+
+/* sends "Package.Message json" as a GMCP subnegotiation */
+void telnet_send_gmcp(const char *msg, size_t len);
@@ -0,0 +1,222 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "globals.h"
+
+#include "tls.h"
+
+static SSL_CTX *tls_ctx = NULL;
+
+static void __attribute__((noreturn)) tls_error(const char *what)
+{
+    ERR_print_errors_fp(stderr);
+    error("%s", what);
+}
+
+/* TLS 1.3 suites are configured apart from everything older, so a
+ * mixed list gets split on the TLS_ prefix the 1.3 names share */
+static void tls_set_ciphers(const char *ciphers)
+{
+    size_t len = strlen(ciphers) + 1;
+    char *list = calloc(len, 1), *suites = calloc(len, 1);
+    char *copy = strdup(ciphers), *save = NULL;
+
+    for(char *tok = strtok_r(copy, ":, ", &save); tok; tok = strtok_r(NULL, ":, ", &save))
+    {
+        char *dest = strncmp(tok, "TLS_", 4) ? list : suites;
+        if(*dest)
+            strcat(dest, ":");
+        strcat(dest, tok);
+    }
+
+    if(*list && !SSL_CTX_set_cipher_list(tls_ctx, list))
+        tls_error("bad cipher list");
+    if(*suites && !SSL_CTX_set_ciphersuites(tls_ctx, suites))
+        tls_error("bad TLS 1.3 cipher suites");
+
+    debugf("TLS ciphers: %s | %s\n", *list ? list : "(default)", *suites ? suites : "(default)");
+
+    free(copy);
+    free(list);
+    free(suites);
+}
+
+void tls_init(const char *cert, const char *key, const char *ciphers)
+{
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if(!tls_ctx)
+        tls_error("SSL_CTX_new");
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* most clients just hang up, which is EOF like any other */
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    /* writes are retried with whatever is queued by then, which may
+     * have moved and grown since the attempt that blocked */
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                     SSL_MODE_RELEASE_BUFFERS);
+
+    if(SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1)
+        tls_error("can't load TLS certificate");
+    if(SSL_CTX_use_PrivateKey_file(tls_ctx, key ? key : cert, SSL_FILETYPE_PEM) != 1)
+        tls_error("can't load TLS key");
+    if(SSL_CTX_check_private_key(tls_ctx) != 1)
+        tls_error("TLS key doesn't match certificate");
+
+    if(ciphers)
+        tls_set_ciphers(ciphers);
+
+    /* the ID cache only helps within one process (event and mux
+     * modes); tickets, whose keys are made here and inherited by every
+     * child, resume sessions in the forked modes as well */
+    static const unsigned char sid_ctx[] = "netcosm";
+    SSL_CTX_set_session_id_context(tls_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT);
+
+    debugf("TLS enabled with %s\n", cert);
+}
+
+void tls_shutdown(void)
+{
+    if(tls_ctx)
+        SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+bool tls_enabled(void)
+{
+    return tls_ctx != NULL;
+}
+
+SSL *tls_new(int fd)
+{
+    SSL *ssl = SSL_new(tls_ctx);
+    if(!ssl)
+        return NULL;
+    if(SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void tls_close(SSL *ssl)
+{
+    if(!ssl)
+        return;
+    /* one attempt only: the peer's close_notify isn't worth waiting for */
+    if(SSL_is_init_finished(ssl))
+        SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+enum tls_status tls_handshake(SSL *ssl)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if(ret == 1)
+        return TLS_DONE;
+
+    switch(SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    default:
+        debugf("TLS handshake failed: %s\n",
+               ERR_reason_error_string(ERR_peek_error()) ?: "connection closed");
+        ERR_clear_error();
+        return TLS_FAILED;
+    }
+}
+
+/* turns an SSL_read/SSL_write failure into what read/write would say */
+static ssize_t tls_result(SSL *ssl, int ret)
+{
+    switch(SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if(!errno)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+ssize_t tls_read(SSL *ssl, void *buf, size_t len)
+{
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : len);
+    return ret > 0 ? ret : tls_result(ssl, ret);
+}
+
+/* small pieces are gathered into one record rather than sent as a
+ * record each, which would cost a header and MAC apiece */
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int n)
+{
+    static char buf[TLS_RECORD_MAX];
+    const void *data = buf;
+    size_t len = 0;
+
+    if(n == 1 || (n > 0 && iov[0].iov_len >= TLS_RECORD_MAX))
+    {
+        data = iov[0].iov_base;
+        len = iov[0].iov_len;
+    }
+    else
+    {
+        for(int i = 0; i < n && len < sizeof(buf); ++i)
+        {
+            size_t chunk = MIN(iov[i].iov_len, sizeof(buf) - len);
+            memcpy(buf + len, iov[i].iov_base, chunk);
+            len += chunk;
+        }
+    }
+
+    if(!len)
+        return 0;
+
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(ssl, data, len > INT_MAX ? INT_MAX : len);
+    return ret > 0 ? ret : tls_result(ssl, ret);
+}
+
+bool tls_pending(SSL *ssl)
+{
+    return ssl && SSL_pending(ssl) > 0;
+}
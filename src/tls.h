@@ -0,0 +1,63 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "globals.h"
+
+/*
+ * Native TLS (-s): a second listening port whose clients get an SSL
+ * stream on top of their socket. The context is made once in the
+ * master, before any child is forked, so every child shares the
+ * session ticket keys and a client can resume its session whichever
+ * child it lands on.
+ */
+
+/* how long a session can sit in the cache, or a ticket stay valid */
+#define TLS_SESSION_TIMEOUT (60 * 60)
+
+/* the biggest TLS record payload; writes are coalesced up to this */
+#define TLS_RECORD_MAX 16384
+
+enum tls_status { TLS_DONE = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_FAILED };
+
+/* loads a PEM certificate chain and its key (which may be in the same
+ * file); ciphers is an OpenSSL cipher list, which may also name TLS 1.3
+ * suites (TLS_*), or NULL for the defaults. Fatal on error. */
+void tls_init(const char *cert, const char *key, const char *ciphers);
+void tls_shutdown(void);
+
+bool tls_enabled(void);
+
+/* a server-side stream on fd, not yet handshaken */
+SSL *tls_new(int fd);
+
+/* sends a close_notify if it can, and frees the stream */
+void tls_close(SSL *ssl);
+
+/* carries the handshake as far as the socket allows */
+enum tls_status tls_handshake(SSL *ssl);
+
+/* read() and writev() through the stream: -1 with errno EAGAIN when
+ * the socket isn't ready, 0 for EOF from read */
+ssize_t tls_read(SSL *ssl, void *buf, size_t len);
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int n);
+
+/* decrypted input which the socket won't signal as readable again */
+bool tls_pending(SSL *ssl);
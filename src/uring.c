@@ -0,0 +1,506 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "globals.h"
+
+#include "uring.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+/* the one provided buffer group */
+#define URING_BGID 0
+
+static struct {
+    int fd;
+
+    /* submission queue: we own the tail, the kernel the head */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    /* completion queue: the other way around */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+
+    /* the registered read buffers, and the ring handing them back */
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    char *bufs;
+    uint16_t br_tail;
+
+    ev_io watcher;
+    ev_prepare submit_watcher;
+} ring = { .fd = -1 };
+
+static bool running = false;
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_uring_register(unsigned opcode, void *arg, unsigned nargs)
+{
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nargs);
+}
+
+static void uring_free(void)
+{
+    if(ring.br)
+        munmap(ring.br, ring.br_sz);
+    free(ring.bufs);
+    if(ring.sqes)
+        munmap(ring.sqes, ring.sqes_sz);
+    if(ring.cq_ptr && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_sz);
+    if(ring.sq_ptr)
+        munmap(ring.sq_ptr, ring.sq_sz);
+    if(ring.fd >= 0)
+        close(ring.fd);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+static bool uring_map(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+
+    ring.fd = sys_uring_setup(URING_ENTRIES, &p);
+    if(ring.fd < 0)
+        return false;
+
+    /* completions must never be dropped, we'd lose track of requests */
+    if(!(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    ring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_sz = ring.cq_sz = MAX(ring.sq_sz, ring.cq_sz);
+
+    ring.sq_ptr = mmap(NULL, ring.sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if(ring.sq_ptr == MAP_FAILED)
+    {
+        ring.sq_ptr = NULL;
+        return false;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cq_ptr = ring.sq_ptr;
+    else
+    {
+        ring.cq_ptr = mmap(NULL, ring.cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if(ring.cq_ptr == MAP_FAILED)
+        {
+            ring.cq_ptr = NULL;
+            return false;
+        }
+    }
+
+    ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED)
+    {
+        ring.sqes = NULL;
+        return false;
+    }
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return true;
+}
+
+/* hands buffer bid back to the kernel, to be read into again */
+static void buf_recycle(uint16_t bid)
+{
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uintptr_t)(ring.bufs + (size_t)bid * URING_BUF_SZ);
+    b->len = URING_BUF_SZ;
+    b->bid = bid;
+    __atomic_store_n(&ring.br->tail, ++ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static bool uring_register_bufs(void)
+{
+    ring.br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring.br = mmap(NULL, ring.br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring.br == MAP_FAILED)
+    {
+        ring.br = NULL;
+        return false;
+    }
+
+    ring.bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SZ);
+    if(!ring.bufs)
+        return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring.br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+
+    if(sys_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for(int i = 0; i < URING_BUF_COUNT; ++i)
+        buf_recycle(i);
+
+    return true;
+}
+
+static unsigned sq_ready(void)
+{
+    return ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void uring_submit(void)
+{
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned n = sq_ready();
+    while(n)
+    {
+        int ret = sys_uring_enter(n, 0, 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            /* EBUSY: the completions we haven't reaped are in the way,
+             * they'll be reaped once we're back in the loop */
+            if(errno != EBUSY && errno != EAGAIN)
+                debugf("WARNING: io_uring_enter: %s\n", strerror(errno));
+            return;
+        }
+        n = sq_ready();
+    }
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_op *op)
+{
+    if(!running)
+        return NULL;
+
+    if(sq_ready() >= ring.sq_entries)
+    {
+        uring_submit();
+        if(sq_ready() >= ring.sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = ring.sq_local_tail++ & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)op;
+    ring.sq_array[idx] = idx;
+
+    if(op)
+        ++op->pending;
+
+    return sqe;
+}
+
+static void uring_reap(void)
+{
+    unsigned head = *ring.cq_head;
+    while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct uring_op *op = (struct uring_op*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        /* the slot's free as soon as we've copied it */
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+        const void *buf = NULL;
+        if(flags & IORING_CQE_F_BUFFER)
+            buf = ring.bufs + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SZ;
+
+        /* cancellations have no op of their own */
+        if(op)
+        {
+            if(!uring_more(flags))
+                --op->pending;
+            op->cb(op, res, flags, buf);
+        }
+
+        if(buf)
+            buf_recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+}
+
+static void uring_cb(EV_P_ ev_io *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    uring_reap();
+}
+
+/* everything queued this iteration goes in one io_uring_enter() */
+static void submit_cb(EV_P_ ev_prepare *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    if(sq_ready() || ring.sq_local_tail != *ring.sq_tail)
+        uring_submit();
+}
+
+/*
+ * Multishot recv() needs a newer kernel than the ring itself, and
+ * the only way to find out is to ask for one: does a byte sent down a
+ * socket pair come back, with more to come?
+ */
+static bool probe_cb_done;
+static int probe_res;
+static unsigned probe_flags;
+
+static void probe_cb(struct uring_op *op, int res, unsigned flags, const void *buf)
+{
+    (void) op;
+    (void) buf;
+    if(!probe_cb_done)
+    {
+        probe_cb_done = true;
+        probe_res = res;
+        probe_flags = flags;
+    }
+}
+
+static bool uring_probe(void)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0)
+        return false;
+
+    struct uring_op op = { probe_cb, NULL, 0 };
+    probe_cb_done = false;
+
+    bool ok = uring_recv(&op, sv[0]) && write(sv[1], "", 1) == 1;
+    if(ok)
+    {
+        uring_submit();
+        while(!probe_cb_done)
+        {
+            if(sys_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                break;
+            uring_reap();
+        }
+        ok = probe_cb_done && probe_res == 1 && uring_more(probe_flags);
+    }
+
+    /* the recv ends once its socket's closed; wait for that so nothing
+     * is left pointing at op */
+    uring_cancel(&op);
+    close(sv[1]);
+    close(sv[0]);
+    uring_submit();
+    while(op.pending)
+    {
+        if(sys_uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            break;
+        uring_reap();
+    }
+
+    if(!ok)
+        errno = ENOTSUP;
+    return ok;
+}
+
+bool uring_init(void)
+{
+    running = true;
+    if(!uring_map() || !uring_register_bufs() || !uring_probe())
+    {
+        debugf("io_uring unavailable (%s), using libev.\n", strerror(errno));
+        running = false;
+        uring_free();
+        return false;
+    }
+
+    ev_io_init(&ring.watcher, uring_cb, ring.fd, EV_READ);
+    ev_io_start(EV_DEFAULT_ &ring.watcher);
+
+    /* after everything else that might queue requests, see flush_cb() */
+    ev_prepare_init(&ring.submit_watcher, submit_cb);
+    ev_set_priority(&ring.submit_watcher, EV_MINPRI);
+    ev_prepare_start(EV_DEFAULT_ &ring.submit_watcher);
+
+    debugf("Using io_uring for client I/O.\n");
+    return true;
+}
+
+void uring_shutdown(void)
+{
+    if(!running)
+        return;
+
+    ev_io_stop(EV_DEFAULT_ &ring.watcher);
+    ev_prepare_stop(EV_DEFAULT_ &ring.submit_watcher);
+
+    running = false;
+    uring_free();
+}
+
+bool uring_running(void)
+{
+    return running;
+}
+
+bool uring_accept(struct uring_op *op, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(op);
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return true;
+}
+
+bool uring_recv(struct uring_op *op, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(op);
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    return true;
+}
+
+bool uring_send(struct uring_op *op, int fd, const void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe = get_sqe(op);
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = MIN(len, (size_t)INT_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return true;
+}
+
+void uring_cancel(struct uring_op *op)
+{
+    if(!op->pending)
+        return;
+
+    struct io_uring_sqe *sqe = get_sqe(NULL);
+    if(!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)op;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+#else
+
+/* built against headers without multishot requests */
+
+bool uring_init(void)
+{
+    debugf("io_uring unavailable (built without it), using libev.\n");
+    return false;
+}
+
+void uring_shutdown(void) {}
+
+bool uring_running(void)
+{
+    return false;
+}
+
+bool uring_accept(struct uring_op *op, int fd)
+{
+    (void) op;
+    (void) fd;
+    return false;
+}
+
+bool uring_recv(struct uring_op *op, int fd)
+{
+    (void) op;
+    (void) fd;
+    return false;
+}
+
+bool uring_send(struct uring_op *op, int fd, const void *buf, size_t len)
+{
+    (void) op;
+    (void) fd;
+    (void) buf;
+    (void) len;
+    return false;
+}
+
+void uring_cancel(struct uring_op *op)
+{
+    (void) op;
+}
+
+#endif
+
+bool uring_more(unsigned flags)
+{
+#ifdef IORING_CQE_F_MORE
+    return flags & IORING_CQE_F_MORE;
+#else
+    (void) flags;
+    return false;
+#endif
+}
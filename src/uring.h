@@ -0,0 +1,73 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "globals.h"
+
+/*
+ * io_uring (-u): in event mode, client sockets are read and written,
+ * and new connections accepted, through one ring rather than by a
+ * syscall each. Reads are multishot into a ring of buffers registered
+ * with the kernel and shared by every session; submissions are made
+ * all at once, just before the event loop blocks. libev still runs
+ * the loop, and is told when completions arrive.
+ *
+ * Nothing here is needed: if the kernel (or the headers we were built
+ * against) can't do all of this, uring_init() says so and everything
+ * stays on libev.
+ */
+
+/* a request in flight, embedded in whatever made it; cb gets each of
+ * its completions, with the data for reads, and pending counts those
+ * still to come */
+struct uring_op {
+    void (*cb)(struct uring_op *op, int res, unsigned flags, const void *buf);
+    void *data;
+    int  pending;
+};
+
+/* size of each registered read buffer, and how many there are */
+#define URING_BUF_SZ    2048
+#define URING_BUF_COUNT 1024
+
+/* submission queue entries, completions get four times as many */
+#define URING_ENTRIES   1024
+
+bool uring_init(void);
+void uring_shutdown(void);
+
+bool uring_running(void);
+
+/* these return false if the request couldn't be queued; the ring is
+ * submitted before the loop blocks, or when it's full */
+
+/* new connections on a listening socket, as non-blocking sockets */
+bool uring_accept(struct uring_op *op, int fd);
+
+/* data as it arrives, until EOF or cancelled */
+bool uring_recv(struct uring_op *op, int fd);
+
+bool uring_send(struct uring_op *op, int fd, const void *buf, size_t len);
+
+/* whatever op has in flight finishes early, with -ECANCELED */
+void uring_cancel(struct uring_op *op);
+
+/* whether more completions of a request are to come */
+bool uring_more(unsigned flags);
@@ -31,6 +31,18 @@
 static void *map = NULL;
 static char *db_file = NULL;
 
+static pthread_mutex_t lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void userdb_lock(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+void userdb_unlock(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
 static void free_userdata(void *ptr)
 {
     struct userdata_t *data = ptr;
@@ -179,42 +191,61 @@ bool userdb_write(const char *file)
 
 struct userdata_t *userdb_lookup(const char *key)
 {
-    return hash_lookup(map, key);
+    userdb_lock();
+    struct userdata_t *ret = hash_lookup(map, key);
+    userdb_unlock();
+    return ret;
 }
 
 bool userdb_remove(const char *key)
 {
-    if(hash_remove(map, key))
-    {
+    userdb_lock();
+    bool ret = hash_remove(map, key);
+    userdb_unlock();
+
+    /* saving waits for room threads, so not with the lock held */
+    if(ret)
         server_save_state(false);
-        return true;
-    }
-    return false;
+    return ret;
 }
 
 bool userdb_add(struct userdata_t *data)
 {
     if(!data)
         return false;
-    struct userdata_t *new = calloc(1, sizeof(*new)); /* only in C! */
-    memcpy(new, data, sizeof(*new));
 
-    /* don't overwrite their inventory */
-    struct userdata_t *old = userdb_lookup(new->username);
+    userdb_lock();
 
-    if(old && old->objects)
+    /* existing users (e.g. logging in) are updated in place, which
+     * also leaves their inventory alone */
+    struct userdata_t *old = userdb_lookup(data->username);
+    if(old)
     {
-        new->objects = multimap_dup(old->objects);
+        if(old != data)
+        {
+            void *objects = old->objects;
+            memcpy(old, data, sizeof(*old));
+            old->objects = objects;
+        }
     }
     else
     {
-        new->objects = multimap_init(8, hash_djb, compare_strings_nocase, obj_compare);
+        struct userdata_t *new = calloc(1, sizeof(*new)); /* only in C! */
+        memcpy(new, data, sizeof(*new));
+        new->objects = NULL;
+        hash_overwrite(map, new->username, new);
+        old = new;
+    }
+
+    if(!old->objects)
+    {
+        old->objects = multimap_init(8, hash_djb, compare_strings_nocase, obj_compare);
 
-        multimap_setdupdata_cb(new->objects, (void*(*)(void*))obj_dup);
-        multimap_setfreedata_cb(new->objects, obj_free);
+        multimap_setdupdata_cb(old->objects, (void*(*)(void*))obj_dup);
+        multimap_setfreedata_cb(old->objects, obj_free);
     }
 
-    hash_overwrite(map, new->username, new);
+    userdb_unlock();
 
     server_save_state(false);
 
@@ -280,6 +311,8 @@ struct userdata_t *userdb_iterate(void **save)
 
 bool userdb_add_obj(const char *name, struct object_t *obj)
 {
+    userdb_lock();
+
     struct userdata_t *user = userdb_lookup(name);
 
     /* add aliases */
@@ -291,11 +324,21 @@ bool userdb_add_obj(const char *name, struct object_t *obj)
         alias = alias->next;
     }
 
-    return multimap_insert(user->objects, obj->name, obj_dup(obj));
+    bool ret = multimap_insert(user->objects, obj->name, obj_dup(obj));
+
+    userdb_unlock();
+
+    send_gmcp_item(name, obj, true);
+    return ret;
 }
 
 bool userdb_del_obj_by_ptr(const char *username, struct object_t *obj)
 {
+    /* this may be the last reference, and the GMCP message needs it */
+    obj_dup(obj);
+
+    userdb_lock();
+
     struct userdata_t *user = userdb_lookup(username);
 
     struct obj_alias_t *iter = obj->alias_list;
@@ -309,11 +352,21 @@ bool userdb_del_obj_by_ptr(const char *username, struct object_t *obj)
         iter = iter->next;
     }
 
-    return multimap_delete(user->objects, obj->name, &tmp);
+    bool ret = multimap_delete(user->objects, obj->name, &tmp);
+
+    userdb_unlock();
+
+    if(ret)
+        send_gmcp_item(username, obj, false);
+
+    obj_free(obj);
+    return ret;
 }
 
 bool userdb_del_obj(const char *username, const char *obj_name)
 {
+    userdb_lock();
+
     struct userdata_t *user = userdb_lookup(username);
     const struct multimap_list *iter = multimap_lookup(user->objects, obj_name, NULL);
     while(iter)
@@ -324,6 +377,7 @@ bool userdb_del_obj(const char *username, const char *obj_name)
         iter = next;
     }
 
+    userdb_unlock();
     return true;
 }
 
@@ -343,8 +397,19 @@ struct userdata_t *userdb_request_lookup(const char *name)
         }
         return NULL;
     }
-    else
-        return userdb_lookup(name);
+
+    /* a copy, like children get: the record itself may only be
+     * touched with the lock held */
+    userdb_lock();
+    struct userdata_t *user = userdb_lookup(name);
+    if(user)
+    {
+        returned_reqdata.userdata = *user;
+        returned_reqdata.userdata.objects = NULL;
+    }
+    userdb_unlock();
+
+    return user ? &returned_reqdata.userdata : NULL;
 }
 
 bool userdb_request_add(struct userdata_t *data)
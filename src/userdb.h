@@ -48,7 +48,8 @@ struct userdata_t {
 void userdb_init(const char *dbfile);
 
 /* looks up a username in the DB, returns NULL upon failure */
-/* changes made to the returned structure will persist */
+/* changes made to the returned structure will persist; hold
+ * userdb_lock() for as long as it's used */
 struct userdata_t *userdb_lookup(const char *username);
 
 bool userdb_remove(const char *username);
@@ -67,9 +68,16 @@ void userdb_shutdown(void);
 /* save the DB to disk */
 bool userdb_write(const char*);
 
-/* *save should be set to NULL on the first run */
+/* *save should be set to NULL on the first run; hold the lock
+ * throughout */
 struct userdata_t *userdb_iterate(void **save);
 
+/* room threads use the DB too; the functions here take this lock
+ * themselves, but hold it while using what they return. It can be
+ * taken more than once by the same thread. */
+void userdb_lock(void);
+void userdb_unlock(void);
+
 bool userdb_add_obj(const char *username, struct object_t *obj);
 bool userdb_del_obj(const char *username, const char *obj_name);
 bool userdb_del_obj_by_ptr(const char *username, struct object_t *obj);
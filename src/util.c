@@ -31,6 +31,44 @@ void __attribute__((noreturn)) error(const char *fmt, ...)
     exit(EXIT_FAILURE);
 }
 
+#if ALLOC_STATS
+/* counts every heap allocation, libc's own included, by standing in
+ * for glibc's allocator entry points */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+
+static unsigned long n_allocs = 0;
+
+void *malloc(size_t sz)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(sz);
+}
+
+void *calloc(size_t n, size_t sz)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, sz);
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+    __atomic_add_fetch(&n_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, sz);
+}
+
+unsigned long alloc_count(void)
+{
+    return __atomic_load_n(&n_allocs, __ATOMIC_RELAXED);
+}
+#else
+unsigned long alloc_count(void)
+{
+    return 0;
+}
+#endif
+
 void remove_cruft(char *str)
 {
     char *junk;
@@ -47,18 +85,17 @@ void debugf_real(const char *func, int line, const char *file, const char *fmt,
     (void) line;
     (void) file;
 
-    int len;
-
     va_list ap;
     va_start(ap, fmt);
 
-    char *buf;
-    len = vasprintf(&buf, fmt, ap);
+    /* long messages are truncated, so logging never allocates */
+    char buf[512];
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if(len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
 
     write(STDOUT_FILENO, buf, len);
 
-    free(buf);
-
     va_end(ap);
 }
 
@@ -187,6 +224,69 @@ void write_int(int fd, int b)
         error("write failed");
 }
 
+bool send_fd(int sock, int fd, const void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == (ssize_t)len;
+}
+
+int recv_fd(int sock, void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    ssize_t ret;
+    do
+        ret = recvmsg(sock, &msg, 0);
+    while(ret < 0 && errno == EINTR);
+
+    if(ret != (ssize_t)len)
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
 bool is_vowel(char c)
 {
     switch(tolower(c))
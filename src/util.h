@@ -32,6 +32,11 @@
 void __attribute__((noreturn,format(printf,1,2))) error(const char *fmt, ...);
 void __attribute__((format(printf,4,5))) debugf_real(const char*, int, const char*, const char *fmt, ...);
 void remove_cruft(char*);
+
+/* heap allocations made by this process so far, always 0 unless
+ * built with ALLOC_STATS=1 */
+unsigned long alloc_count(void);
+
 void all_upper(char*);
 void all_lower(char*);
 
@@ -56,6 +61,13 @@ size_t read_size(int fd);
 void write_int(int fd, int i);
 int read_int(int fd);
 
+/* pass a file descriptor, along with some data, over a UNIX domain
+ * socket (see unix(7), SCM_RIGHTS) */
+bool send_fd(int sock, int fd, const void *data, size_t len);
+
+/* returns the received descriptor, or -1 on failure or EOF */
+int recv_fd(int sock, void *data, size_t len);
+
 bool is_vowel(char c);
 
 size_t strlcat(char *dst, const char *src, size_t siz);
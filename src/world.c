@@ -22,6 +22,7 @@
 #include "multimap.h"
 #include "room.h"
 #include "world.h"
+#include "zone.h"
 
 /* verb classes */
 const struct verb_class_t *netcosm_verb_classes;
@@ -171,7 +172,13 @@ static void sim_cb(EV_P_ ev_timer *w, int revents)
     (void) EV_A;
     (void) w;
     (void) revents;
+
+    /* the callback can look at any room; rather than wait for room
+     * threads, a busy tick is skipped */
+    if(!zone_pause(false))
+        return;
     netcosm_world_simulation_cb();
+    zone_resume();
 }
 
 void world_free(void)
@@ -107,7 +107,14 @@ static const struct world_api api = {
     read_int,
     is_vowel,
     strlcat,
-    format_noun
+    format_noun,
+    room_set_desc,
+    send_msg_room,
+    send_msg_user,
+    send_msg_pid,
+    send_msg_set,
+    userdb_lock,
+    userdb_unlock
 };
 
 const struct world_api *nc = &api;
@@ -0,0 +1,321 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "globals.h"
+
+#include "server.h"
+#include "server_reqs.h"
+#include "world.h"
+#include "zone.h"
+
+int zone_threads = 0;
+
+struct zone {
+    pthread_t thread;
+
+    /* protects the queue */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct zone_job *head, *tail;
+};
+
+static struct zone *zones = NULL;
+static bool stopping = false;
+
+/* held for reading while a job runs, and for writing by zone_pause() */
+static pthread_rwlock_t world_lock;
+
+/* finished jobs, waiting for the main thread */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zone_job *done_head = NULL, *done_tail = NULL;
+static ev_async done_watcher;
+static struct ev_loop *main_loop = NULL;
+
+/* main thread only */
+static struct zone_job *spare_jobs = NULL;
+
+static __thread struct zone_job *current = NULL;
+
+int zone_owner(room_id id)
+{
+    if(zone_threads < 2 || id < 0 || (size_t)id >= netcosm_world_sz)
+        return 0;
+
+    /* neighbouring rooms tend to have neighbouring IDs, so blocks
+     * keep most moves on one thread */
+    return (size_t)id * zone_threads / netcosm_world_sz;
+}
+
+struct zone_job *zone_job_new(void)
+{
+    struct zone_job *job = spare_jobs;
+    if(job)
+        spare_jobs = job->next;
+    else
+        job = calloc(1, sizeof(*job));
+
+    job->next = NULL;
+    job->handoff = false;
+    job->stage = 0;
+    job->retire = false;
+    job->save = false;
+    job->outlen = 0;
+    return job;
+}
+
+void zone_job_free(struct zone_job *job)
+{
+    job->next = spare_jobs;
+    spare_jobs = job;
+}
+
+static void free_jobs(struct zone_job *job)
+{
+    while(job)
+    {
+        struct zone_job *next = job->next;
+        free(job->out);
+        free(job);
+        job = next;
+    }
+}
+
+void zone_submit(struct zone_job *job)
+{
+    struct zone *zone = zones + zone_owner(job->room);
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&zone->lock);
+    if(zone->tail)
+        zone->tail->next = job;
+    else
+        zone->head = job;
+    zone->tail = job;
+    pthread_cond_signal(&zone->wake);
+    pthread_mutex_unlock(&zone->lock);
+}
+
+struct zone_job *zone_current(void)
+{
+    return current;
+}
+
+void zone_handoff(room_id room)
+{
+    current->room = room;
+    current->handoff = true;
+}
+
+void zone_reply(pid_t pid, reqid_t id, unsigned char cmd,
+                const void *data, size_t datalen)
+{
+    struct zone_job *job = current;
+    uint16_t len = datalen;
+    size_t need = sizeof(pid) + sizeof(id) + 1 + sizeof(len) + datalen;
+
+    /* jobs are recycled, so this stops growing once warmed up */
+    if(job->outlen + need > job->outsz)
+    {
+        job->outsz = MAX(job->outsz * 2, job->outlen + need);
+        job->out = realloc(job->out, job->outsz);
+    }
+
+    unsigned char *rec = job->out + job->outlen;
+    memcpy(rec, &pid, sizeof(pid));
+    rec += sizeof(pid);
+    memcpy(rec, &id, sizeof(id));
+    rec += sizeof(id);
+    *rec++ = cmd;
+    memcpy(rec, &len, sizeof(len));
+    rec += sizeof(len);
+    if(datalen)
+        memcpy(rec, data, datalen);
+
+    job->outlen += need;
+}
+
+bool zone_defer_save(void)
+{
+    if(!current)
+        return false;
+    current->save = true;
+    return true;
+}
+
+bool zone_pause(bool wait)
+{
+    if(!zone_threads)
+        return true;
+    if(wait)
+        return !pthread_rwlock_wrlock(&world_lock);
+    return !pthread_rwlock_trywrlock(&world_lock);
+}
+
+void zone_resume(void)
+{
+    if(zone_threads)
+        pthread_rwlock_unlock(&world_lock);
+}
+
+static void job_done(struct zone_job *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&done_lock);
+    if(done_tail)
+        done_tail->next = job;
+    else
+        done_head = job;
+    done_tail = job;
+    pthread_mutex_unlock(&done_lock);
+
+    ev_async_send(main_loop, &done_watcher);
+}
+
+static void done_cb(EV_P_ ev_async *w, int revents)
+{
+    (void) EV_A;
+    (void) w;
+    (void) revents;
+
+    pthread_mutex_lock(&done_lock);
+    struct zone_job *job = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    while(job)
+    {
+        struct zone_job *next = job->next;
+        finish_job(job);
+        job = next;
+    }
+}
+
+static void *zone_main(void *arg)
+{
+    struct zone *zone = arg;
+
+    pthread_mutex_lock(&zone->lock);
+    while(1)
+    {
+        while(!zone->head && !stopping)
+            pthread_cond_wait(&zone->wake, &zone->lock);
+        if(stopping)
+            break;
+
+        struct zone_job *job = zone->head;
+        zone->head = job->next;
+        if(!zone->head)
+            zone->tail = NULL;
+        pthread_mutex_unlock(&zone->lock);
+
+        pthread_rwlock_rdlock(&world_lock);
+        current = job;
+        job->handoff = false;
+        run_job(job);
+        current = NULL;
+        pthread_rwlock_unlock(&world_lock);
+
+        if(job->handoff)
+            zone_submit(job);
+        else
+            job_done(job);
+
+        pthread_mutex_lock(&zone->lock);
+    }
+    pthread_mutex_unlock(&zone->lock);
+
+    return NULL;
+}
+
+void zone_init(int nthreads)
+{
+    if(nthreads < 1)
+        return;
+
+    /* a thread per room at most */
+    zone_threads = MIN((size_t)nthreads, netcosm_world_sz);
+
+    /* so a steady stream of jobs can't keep a save waiting forever */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&world_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    main_loop = EV_DEFAULT;
+    ev_async_init(&done_watcher, done_cb);
+    ev_async_start(main_loop, &done_watcher);
+
+    /* signals are the main thread's business */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    zones = calloc(zone_threads, sizeof(struct zone));
+    for(int i = 0; i < zone_threads; ++i)
+    {
+        pthread_mutex_init(&zones[i].lock, NULL);
+        pthread_cond_init(&zones[i].wake, NULL);
+        if(pthread_create(&zones[i].thread, NULL, zone_main, zones + i))
+            error("pthread_create");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    debugf("Running rooms on %d threads.\n", zone_threads);
+}
+
+void zone_shutdown(void)
+{
+    if(!zones)
+        return;
+
+    for(int i = 0; i < zone_threads; ++i)
+    {
+        pthread_mutex_lock(&zones[i].lock);
+        stopping = true;
+        pthread_cond_signal(&zones[i].wake);
+        pthread_mutex_unlock(&zones[i].lock);
+    }
+
+    /* a handoff can still queue a job on a thread that has stopped */
+    for(int i = 0; i < zone_threads; ++i)
+        pthread_join(zones[i].thread, NULL);
+
+    for(int i = 0; i < zone_threads; ++i)
+    {
+        free_jobs(zones[i].head);
+        pthread_mutex_destroy(&zones[i].lock);
+        pthread_cond_destroy(&zones[i].wake);
+    }
+
+    free(zones);
+    zones = NULL;
+
+    ev_async_stop(main_loop, &done_watcher);
+    free_jobs(done_head);
+    done_head = done_tail = NULL;
+    free_jobs(spare_jobs);
+    spare_jobs = NULL;
+
+    pthread_rwlock_destroy(&world_lock);
+    zone_threads = 0;
+}
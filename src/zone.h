@@ -0,0 +1,105 @@
+/*
+ *   NetCosm - a MUD server
+ *   Copyright (C) 2016 Franklin Wei
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "globals.h"
+
+#include "room.h"
+#include "server_reqs.h"
+
+/*
+ * Room threads (-t): rooms are split into contiguous blocks, one per
+ * thread, and only the owning thread touches a room's users, objects
+ * and hooks. The main thread keeps all of the I/O and the maps of
+ * children and users, and runs every request that isn't about a room
+ * itself. A child's requests still run one at a time, in order, see
+ * dispatch_request().
+ *
+ * Room threads never write to children: their replies are collected
+ * in the job, addressed by PID, and sent by the main thread once the
+ * job is finished.
+ */
+
+struct zone_job {
+    struct zone_job *next;
+
+    user_t  *child;
+    reqid_t  id;
+    unsigned char cmd;
+    unsigned char data[MSG_MAX + 1];
+    size_t   len;
+
+    /* the room whose owner runs the job next */
+    room_id  room;
+
+    /* set by zone_handoff(), the job moves on rather than finishing */
+    bool     handoff;
+
+    /* per-request progress across handoffs, see req_move_room() */
+    int      stage;
+    room_id  from, to;
+
+    /* takes the child out of its room rather than running a request */
+    bool     retire;
+
+    /* server_save_state() was called, the main thread does it */
+    bool     save;
+
+    /* | PID | REQUEST ID | CMD | LENGTH | DATA | records */
+    unsigned char *out;
+    size_t   outlen, outsz;
+};
+
+/* number of room threads, 0 if everything runs on the main thread */
+extern int zone_threads;
+
+/* starts the threads, after the world is loaded */
+void zone_init(int nthreads);
+void zone_shutdown(void);
+
+/* which thread owns a room */
+int zone_owner(room_id id);
+
+/* main thread only: jobs are recycled rather than freed */
+struct zone_job *zone_job_new(void);
+void zone_job_free(struct zone_job *job);
+
+/* queues a job for the owner of job->room */
+void zone_submit(struct zone_job *job);
+
+/* the job this thread is running, NULL on the main thread */
+struct zone_job *zone_current(void);
+
+/* from inside a job: continue it on the thread owning `room' */
+void zone_handoff(room_id room);
+
+/* from inside a job: queues a reply for the main thread to send */
+void zone_reply(pid_t pid, reqid_t id, unsigned char cmd,
+                const void *data, size_t datalen);
+
+/* from inside a job: leaves a save to the main thread; returns false
+ * on the main thread */
+bool zone_defer_save(void);
+
+/* main thread only: stops the room threads between jobs so the whole
+ * world can be looked at. Without wait, returns false rather than
+ * waiting for running jobs. */
+bool zone_pause(bool wait);
+void zone_resume(void);
@@ -0,0 +1,56 @@
+#!/bin/sh
+# usage: load.sh [CLIENTS] [PORT]
+#
+# Load test for the master's request path. Build with
+# `make ALLOC_STATS=1', start `netcosm -a test test', then run this.
+# Once the server has warmed up, the allocations made while handling
+# requests should stop growing between the two CLIENT STATS reports.
+
+CLIENTS=${1:-20}
+PORT=${2:-1234}
+
+login() {
+    sleep .1
+    echo test
+    sleep .1
+    echo test
+    sleep 1
+}
+
+session() {
+    login
+    for i in 1 2 3 4 5
+    do
+        echo look
+        sleep .1
+        echo say hello
+        sleep .1
+        echo go east
+        sleep .1
+        echo go west
+        sleep .1
+        echo take shovel
+        sleep .1
+        echo inventory
+        sleep .1
+        echo drop shovel
+        sleep .1
+    done
+}
+
+load() {
+    for i in `seq $CLIENTS`
+    do
+        session | telnet localhost $PORT > /dev/null 2>&1 &
+    done
+    wait
+}
+
+stats() {
+    (login; echo client stats; sleep .5) | telnet localhost $PORT 2>/dev/null | grep -E "Requests|Heap"
+}
+
+load
+stats
+load
+stats
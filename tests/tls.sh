@@ -0,0 +1,67 @@
+#!/bin/bash
+# usage: tls.sh [CLIENTS] [LOOKS]
+#
+# Throughput of native TLS against plain telnet and the stunnel setup.
+# Make a certificate with
+#   openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem \
+#       -out cert.pem -subj /CN=localhost
+# start `netcosm -a test test -s 9920 -C cert.pem -K key.pem', and, to
+# compare it too, stunnel with stunnel/server.cfg. Each client logs in,
+# sends LOOKS commands in one go and quits; the time for every client
+# to be done is shown for each setup which is listening, with the
+# rooms they saw (one more each than LOOKS, from logging in).
+
+CLIENTS=${1:-20}
+LOOKS=${2:-200}
+
+PORT=1234
+TLS_PORT=9920
+STUNNEL_PORT=992
+
+session() {
+    sleep .1
+    echo test
+    sleep .1
+    echo test
+    sleep .5
+    for i in `seq $LOOKS`
+    do
+        echo look
+    done
+    echo quit
+}
+
+# bash's /dev/tcp rather than telnet, which can't be told to wait for
+# the server to hang up
+plain() {
+    exec 3<>/dev/tcp/localhost/$PORT
+    session >&3
+    cat <&3
+    exec 3<&-
+}
+
+tls() {
+    session | openssl s_client -quiet -ign_eof -connect localhost:$1 2>/dev/null
+}
+
+run() {
+    start=`date +%s.%N`
+    for i in `seq $CLIENTS`
+    do
+        "$@" > /tmp/tls.$i.out &
+    done
+    wait
+    end=`date +%s.%N`
+    seen=`cat /tmp/tls.*.out | grep -c "Dead End"`
+    rm -f /tmp/tls.*.out
+    echo "$1: $seen of `expr $CLIENTS \* \( $LOOKS + 1 \)` rooms seen in `awk "BEGIN { print $end - $start }"` s"
+}
+
+run plain
+run tls $TLS_PORT
+if openssl s_client -connect localhost:$STUNNEL_PORT < /dev/null > /dev/null 2>&1
+then
+    run tls $STUNNEL_PORT
+else
+    echo "stunnel isn't listening on $STUNNEL_PORT, skipped"
+fi
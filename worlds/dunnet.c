@@ -126,7 +126,11 @@ static void hidden_init(room_id id)
 static bool building_enter(room_id id, user_t *user)
 {
     (void) id;
-    if(nc->multimap_lookup(userdb_lookup(user->user)->objects, "shiny brass key", NULL))
+    nc->userdb_lock();
+    bool has_key = nc->multimap_lookup(userdb_lookup(user->user)->objects, "shiny brass key", NULL);
+    nc->userdb_unlock();
+
+    if(has_key)
         return true;
     else
     {
@@ -416,7 +420,11 @@ static void dig_exec(struct verb_t *verb, char *args, user_t *user)
 {
     (void) verb;
     (void) args;
-    if(!nc->multimap_lookup(userdb_lookup(user->user)->objects, "shovel", NULL))
+    nc->userdb_lock();
+    bool has_shovel = nc->multimap_lookup(userdb_lookup(user->user)->objects, "shovel", NULL);
+    nc->userdb_unlock();
+
+    if(!has_shovel)
     {
         nc->send_msg(user, "You have nothing with which to dig.\n");
         return;
@@ -464,10 +472,14 @@ static void put_exec(struct verb_t *verb, char *args, user_t *user)
     }
 
     args = NULL;
+
+    /* obj is in the user's inventory, so keep it from changing under us */
+    nc->userdb_lock();
     const struct multimap_list *list = nc->multimap_lookup(userdb_lookup(user->user)->objects,
                                                        obj_name, NULL);
     if(!list)
     {
+        nc->userdb_unlock();
         nc->send_msg(user, "You don't have that.\n");
         return;
     }
@@ -482,6 +494,7 @@ static void put_exec(struct verb_t *verb, char *args, user_t *user)
 
     if(!ind_obj_name)
     {
+        nc->userdb_unlock();
         nc->send_msg(user, "You must supply an indirect object.\n");
         return;
     }
@@ -490,6 +503,7 @@ static void put_exec(struct verb_t *verb, char *args, user_t *user)
 
     if(!list)
     {
+        nc->userdb_unlock();
         nc->send_msg(user, "I don't know what that indirect object is.\n");
         return;
     }
@@ -500,15 +514,16 @@ static void put_exec(struct verb_t *verb, char *args, user_t *user)
     if(!strcmp(obj->name, "CPU card") && !strcmp(ind_obj->name, "computer") && user->room == nc->room_get_id("computer_room"))
     {
         nc->userdb_del_obj_by_ptr(user->user, obj);
+        nc->userdb_unlock();
         nc->send_msg(user, "As you put the CPU board in the computer, it immediately springs to life.  The lights start flashing, and the fans seem to startup.\n");
         bool *b = nc->room_get(user->room)->userdata;
         *b = true;
 
-        free(nc->room_get(user->room)->data.desc);
-        nc->room_get(user->room)->data.desc = strdup("You are in a computer room.  It seems like most of the equipment has been removed.  There is a VAX 11/780 in front of you, however, with one of the cabinets wide open.  A sign on the front of the machine says: This VAX is named 'pokey'.  To type on the console, use the 'type' command.  The exit is to the east.\nThe panel lights are flashing in a seemingly organized pattern.");
+        nc->room_set_desc(user->room, "You are in a computer room.  It seems like most of the equipment has been removed.  There is a VAX 11/780 in front of you, however, with one of the cabinets wide open.  A sign on the front of the machine says: This VAX is named 'pokey'.  To type on the console, use the 'type' command.  The exit is to the east.\nThe panel lights are flashing in a seemingly organized pattern.");
     }
     else
     {
+        nc->userdb_unlock();
         nc->send_msg(user, "I don't know how to combine those objects.  Perhaps you should just try dropping it.\n");
     }
 }
@@ -525,10 +540,12 @@ static void eat_exec(struct verb_t *verb, char *args, user_t *user)
     }
 
     size_t n_objs;
+    nc->userdb_lock();
     const struct multimap_list *list = nc->multimap_lookup(userdb_lookup(user->user)->objects, obj_name, &n_objs);
 
     if(!list)
     {
+        nc->userdb_unlock();
         if(!nc->room_obj_get(user->room, obj_name))
             nc->send_msg(user, "I don't know what that is.\n");
         else
@@ -552,6 +569,7 @@ static void eat_exec(struct verb_t *verb, char *args, user_t *user)
     }
 
     nc->userdb_del_obj(user->user, obj_name);
+    nc->userdb_unlock();
 }
 
 static void shake_exec(struct verb_t *verb, char *args, user_t *user)
@@ -569,10 +587,12 @@ static void shake_exec(struct verb_t *verb, char *args, user_t *user)
     size_t n_objs_room, n_objs_inv;
     const struct multimap_list *list_room = nc->room_obj_get_size(user->room, obj_name, &n_objs_room);
 
+    nc->userdb_lock();
     const struct multimap_list *list_inv = nc->multimap_lookup(userdb_lookup(user->user)->objects, obj_name, &n_objs_inv);
 
     if(!list_room && !list_inv)
     {
+        nc->userdb_unlock();
         nc->send_msg(user, "I don't know what that is.\n");
         return;
     }
@@ -594,6 +614,7 @@ static void shake_exec(struct verb_t *verb, char *args, user_t *user)
                              n_objs_inv, obj->default_article,
                              false));
     }
+    nc->userdb_unlock();
 }
 
 #if 0
@@ -621,6 +642,7 @@ static void pokey_unix_command(user_t *user, char *data)
 
 static void console_cb(user_t *user, char *data, size_t len)
 {
+    nc->userdb_lock();
     struct dunnet_user *du = userdb_lookup(user->user)->userdata;
     /* we use their state data to decide how to interpret it */
     switch(du->console_state)
@@ -664,6 +686,7 @@ static void console_cb(user_t *user, char *data, size_t len)
         send_msg(user, "FIXME");
         break;
     }
+    nc->userdb_unlock();
 }
 
 static void type_exec(struct verb_t *verb, char *args, user_t *user)
@@ -686,6 +709,7 @@ static void type_exec(struct verb_t *verb, char *args, user_t *user)
         }
         else
         {
+            nc->userdb_lock();
             struct userdata_t *data = nc->userdb_lookup(user->user);
             if(!data->userdata)
                 data->userdata = calloc(1, sizeof(struct dunnet_user));
@@ -715,6 +739,7 @@ static void type_exec(struct verb_t *verb, char *args, user_t *user)
                     break;
                 }
             }
+            nc->userdb_unlock();
 
             /* all lines typed are now passed directly to us */
             nc->child_toggle_rawmode(user, console_cb);